@@ -0,0 +1,62 @@
+/*
+ * checksum.hpp
+ *
+ *  Fletcher checksum of MIP packets, and bulk validation of frames.
+ */
+
+#ifndef CHECKSUM_H_
+#define CHECKSUM_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace imu_3dm_gx4 {
+
+/**
+ * @brief fletcher16 The 8-bit Fletcher checksum used by MIP packets, over
+ * the header and payload of a frame.
+ * @return The first sum in the high byte, the second in the low byte, ie. in
+ * the order the checksum is sent.
+ *
+ * @note Uses AVX2 or SSE2 where the CPU supports it, chosen once at runtime,
+ * and a scalar loop otherwise.
+ */
+uint16_t fletcher16(const uint8_t *data, size_t length);
+
+/**
+ * @brief fletcher16Scalar Reference implementation of fletcher16().
+ */
+uint16_t fletcher16Scalar(const uint8_t *data, size_t length);
+
+/**
+ * @brief fletcher16Implementation Name of the implementation fletcher16()
+ * selected: "avx2", "sse2" or "scalar".
+ */
+const char *fletcher16Implementation();
+
+/**
+ * @brief MipFrame Location of a complete frame in a buffer, from the sync
+ * bytes to the checksum.
+ */
+struct MipFrame {
+  size_t offset;
+  size_t length;
+};
+
+/**
+ * @brief findFrames Find the frames with a valid checksum in a buffer, in
+ * one pass. Bytes which are not part of a valid frame are skipped, a
+ * candidate whose checksum fails is skipped by one byte only, so a frame
+ * starting within it is still found.
+ * @param frames Receives up to maxFrames frames, in order.
+ * @param scanned Set to the offset up to which the buffer was searched:
+ * either the end of the buffer, the end of the last frame if maxFrames were
+ * found, or the start of a candidate which continues past the buffer.
+ * @return Number of frames found.
+ */
+size_t findFrames(const uint8_t *data, size_t length, MipFrame *frames,
+                  size_t maxFrames, size_t &scanned);
+
+} //  imu_3dm_gx4
+
+#endif // CHECKSUM_H_
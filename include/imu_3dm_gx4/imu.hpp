@@ -15,11 +15,23 @@
 #include <stdexcept>
 #include <memory>
 #include <string>
-#include <deque>
 #include <queue>
 #include <vector>
 #include <bitset>
 #include <map>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "imu_3dm_gx4/tx_scheduler.hpp"
+#include "imu_3dm_gx4/rtt_estimator.hpp"
+#include "imu_3dm_gx4/link_monitor.hpp"
+#include "imu_3dm_gx4/log_ring.hpp"
 
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ //  will fail outside of gcc/clang
 #define HOST_LITTLE_ENDIAN
@@ -38,6 +50,12 @@ namespace imu_3dm_gx4 {
  * can throw the exceptions below: io_error, timeout_error, command_error and
  * std::runtime_error. Additional exceptions are indicated on specific
  * functions.
+ *
+ * @note Threading: The device is owned by the thread which reads its input
+ * (runOnce() or readInput()), all methods must be called from that thread.
+ * Other threads submit work with post(), which is run by the owner on its
+ * next read. Poll submitFd() next to fileDescriptor() to wake up for it.
+ * Posted work is ordered and paced by a TxScheduler.
  */
 class Imu {
 public:
@@ -148,6 +166,18 @@ public:
     uint32_t totalIMUMessages;
     uint32_t lastIMUMessage;
 
+    static constexpr size_t kNumValues = 21;
+
+    /**
+     * @brief kNames Human readable names, in the order of values().
+     */
+    static const char *const kNames[kNumValues];
+
+    /**
+     * @brief values Copy all fields to an array, in the order of kNames.
+     */
+    void values(unsigned int (&output)[kNumValues]) const;
+
     /**
      * @brief Convert to map of human readable strings and integers.
      */
@@ -167,14 +197,14 @@ public:
       Barometer = (1 << 3),
     };
 
-    unsigned int fields; /**< Which fields are valid in the struct */
+    unsigned int fields; /**< Which fields are valid in the struct, the others are zero */
 
     float accel[3]; /**< Acceleration, units of G */
     float gyro[3];  /**< Angular rates, units of rad/s */
     float mag[3];   /**< Magnetic field, units of gauss */
     float pressure; /**< Pressure, units of pascal */
 
-    IMUData() : fields(0) {}
+    IMUData() : fields(0), accel(), gyro(), mag(), pressure(0) {}
   };
 
   /**
@@ -192,7 +222,7 @@ public:
       BiasUncertainty = (1 << 7),
     };
 
-    unsigned int fields; /**< Which fields are present in the struct. */
+    unsigned int fields; /**< Which fields are present in the struct, the others are zero. */
 
     float quaternion[4]; /**< Orientation quaternion (q0,q1,q2,q3) */
     uint16_t quaternionStatus; /**< 0 = invalid, 1 = valid, 2 = angles referenced to magnetic north */
@@ -220,7 +250,36 @@ public:
     float gyroBiasUncertainty[3];       /**< 1-sigma gyro bias uncertainty [radians/sec] */
     uint16_t gyroBiasUncertaintyStatus; /**< 0 = invalid, 1 = valid */
 
-    FilterData() : fields(0) {}
+    FilterData() : fields(0), quaternion(), quaternionStatus(0), eulerRPY(),
+        eulerRPYStatus(0), headingUpdate(0), headingUpdateUncertainty(0),
+        headingUpdateSource(0), headingUpdateFlags(0), acceleration(),
+        accelerationStatus(0), angularRate(), angularRateStatus(0),
+        eulerAngleUncertainty(), eulerAngleUncertaintyStatus(0), gyroBias(),
+        gyroBiasStatus(0), gyroBiasUncertainty(), gyroBiasUncertaintyStatus(0) {}
+  };
+
+  /**
+   * @brief DiagnosticSnapshot Last status report read from the device.
+   */
+  struct DiagnosticSnapshot {
+    DiagnosticFields fields;
+    LinkMonitor::Counters link; /**< Host counters when the report was read */
+    std::chrono::steady_clock::time_point received;
+    uint64_t reports;           /**< Reports read, 0 if fields is not valid */
+  };
+
+  /**
+   * @brief HeadingStats Statistics of the external heading updates.
+   */
+  struct HeadingStats {
+    uint64_t queued;    /**< Updates passed to setExternalHeading() */
+    uint64_t sent;      /**< Updates written to the device */
+    uint64_t coalesced; /**< Updates replaced by a newer one before sending */
+    uint64_t rejected;  /**< Updates NACKed by the device */
+    uint64_t dropped;   /**< Updates which could not be written in time */
+    double lastLatency; /**< Time from setExternalHeading() to write() [s] */
+    double meanLatency; /**< Mean of the above [s] */
+    double maxLatency;  /**< Maximum of the above [s] */
   };
 
   /* Exceptions */
@@ -278,20 +337,197 @@ public:
    */
   void runOnce();
 
+  /**
+   * @brief runOnce Like runOnce(), but packets and samples are passed to sink
+   * instead of the callbacks.
+   * @see readInput(Sink &)
+   */
+  template <typename Sink> void runOnce(Sink &sink);
+
+  /**
+   * @brief fileDescriptor Descriptor of the open serial device, for use in an
+   * external poll/epoll loop. Zero when not connected.
+   */
+  int fileDescriptor() const { return fd_; }
+
+  /**
+   * @brief readInput Read all bytes currently available and dispatch every
+   * complete packet. Never blocks, use instead of runOnce() when the
+   * descriptor is polled externally.
+   * @throw io_error if the device was disconnected.
+   */
+  void readInput();
+
+  /**
+   * @brief readInput Like readInput(), but packets and samples are passed to
+   * sink instead of the callbacks. The sink type is known at compile time,
+   * so its handlers are called directly and can be inlined.
+   * @param sink Provides onPacket(const Packet &), onIMUData(const IMUData &)
+   * and onFilterData(const FilterData &), see ImuSink and SinkSet.
+   *
+   * @note Packets read by posted calls while they wait for a reply are
+   * still passed to the callbacks.
+   */
+  template <typename Sink> void readInput(Sink &sink);
+
+  /**
+   * @brief feed Parse bytes which were not read from the device, eg. from a
+   * recording or a fuzzer, and pass the packets found in them to sink. Uses
+   * the parser, counters and state of readInput(), no device is needed.
+   * @throw std::runtime_error for data packets with unsupported or
+   * malformed fields. Input after that packet may not have been parsed.
+   */
+  template <typename Sink>
+  void feed(const uint8_t *data, size_t length, Sink &sink);
+
+  /**
+   * @brief feed Like feed(data, length, sink), through the callbacks.
+   */
+  void feed(const uint8_t *data, size_t length) {
+    feed(data, length, callbacks_);
+  }
+
+  /**
+   * @brief post Queue a call to be run on the thread which owns the device.
+   * Safe to call from any thread.
+   * @param command Called with this instance, may use any method.
+   * @param priority Priority of the commands it sends.
+   * @param key If not 0, replaces a waiting call with the same key and
+   * priority. The futures of both complete when the newer call has run.
+   * @return Future which completes once the call ran, and carries any
+   * exception it threw.
+   *
+   * @note Calls are run in priority order, then in submission order, by
+   * runOnce() and readInput(). Control and background calls are held back
+   * while the bytes recently written exceed their share of the link. The
+   * owner thread must not wait on the returned future itself.
+   */
+  std::future<void> post(const std::function<void(Imu &)> &command,
+                         TxScheduler::Priority priority = TxScheduler::Control,
+                         uint32_t key = 0);
+
+  /**
+   * @brief submitFd Descriptor which becomes readable when calls were posted,
+   * for use in an external poll/epoll loop together with fileDescriptor().
+   */
+  int submitFd() const { return submitFd_; }
+
+  /**
+   * @brief runPosted Run the posted calls which are due. Called by runOnce()
+   * and readInput(). Calls held back by the pacing are not signalled again,
+   * so the owner should call this every few milliseconds while
+   * pendingPosts() is not zero.
+   */
+  void runPosted();
+
+  /**
+   * @brief pendingPosts Number of posted calls which did not run yet.
+   */
+  size_t pendingPosts() const { return numSubmitted_; }
+
+  /**
+   * @brief txStats Statistics of the posted calls of one priority.
+   */
+  TxScheduler::Stats txStats(TxScheduler::Priority priority);
+
+  /**
+   * @brief setExternalHeading Queue an external heading update for the
+   * estimation filter. Safe to call from any thread, never waits for the
+   * device.
+   * @param heading Heading angle [radians]
+   * @param uncertainty 1-sigma heading uncertainty [radians]
+   * @param magnetic True if the heading is relative to magnetic north, false
+   * if it is relative to true north.
+   *
+   * @note Only the newest update is kept. It is written without waiting for
+   * the ACK by the owner thread on its next read, ahead of any posted call.
+   * The filter uses it only if the heading update source is "external".
+   */
+  void setExternalHeading(float heading, float uncertainty, bool magnetic);
+
+  /**
+   * @brief externalHeadingStats Statistics of the external heading updates.
+   */
+  HeadingStats externalHeadingStats();
+
+  /**
+   * @brief reconnect Reopen the device after it was disconnected, and restore
+   * its configuration.
+   *
+   * The device path is opened again, so a udev symlink is resolved to the
+   * new device node. The last selected baud rate is tried first. All
+   * settings applied since construction are replayed from their cached
+   * command packets, the message formats and stream enables are verified by
+   * reading them back, and streaming is resumed.
+   *
+   * @param probeBaudRates If false, only the last selected baud rate is
+   * tried, which bounds the time spent here to a single ping timeout when
+   * the device does not answer.
+   *
+   * @return False if the device did not answer at the last baud rate and
+   * probeBaudRates is false, true once the configuration is restored.
+   *
+   * @throw std::runtime_error if a setting could not be restored.
+   */
+  bool reconnect(bool probeBaudRates = true);
+
   /**
    * @brief disconnect Close the file descriptor, sending the IDLE command
    * first.
    */
   void disconnect();
 
+  /**
+   * @brief setCommandTimeouts Set the limits of the reply timeouts, which
+   * adapt to the measured round-trip time of each command type.
+   * @param floor Shortest timeout [s].
+   * @param ceiling Longest timeout, also of retries [s].
+   * @param initial Timeout of a command type before its RTT was measured [s].
+   * @param retries How often a command is sent again after a timeout.
+   */
+  void setCommandTimeouts(double floor, double ceiling, double initial,
+                          unsigned int retries);
+
+  /**
+   * @brief rtt Round-trip times and timeouts of the commands sent so far.
+   */
+  const RttEstimator &rtt() const { return rtt_; }
+
+  /**
+   * @brief pingRtt Smoothed round-trip time of the ping command, 0 if not
+   * measured at the current baud rate [s].
+   */
+  double pingRtt() const;
+
+  /**
+   * @brief link Bytes, packets and gaps seen by the host. Its counters() may
+   * be read from any thread.
+   *
+   * @note Gaps are detected once the base rates were read with
+   * getIMUDataBaseRate() and getFilterDataBaseRate().
+   */
+  const LinkMonitor &link() const { return link_; }
+
+  /**
+   * @brief setLogSink Set where the driver's messages go, std::cout by
+   * default. The sink is called from a background thread, messages are
+   * queued without blocking the reading thread and rate limited.
+   */
+  void setLogSink(const LogRing::Sink &sink) { log_.setSink(sink); }
+
+  /**
+   * @brief log Queued messages, and how many were dropped or suppressed.
+   */
+  LogRing &log() { return log_; }
+
   /**
    * @brief selectBaudRate Select baud rate.
    * @param baud The desired baud rate. Supported values are:
    * 9600,19200,115200,230400,460800,921600.
    *
    * @note This command will attempt to communicate w/ the device using all
-   * possible baud rates. Once the current baud rate is determined, it will
-   * switch to 'baud' and send the UART command.
+   * possible baud rates, starting with 'baud'. Once the current baud rate is
+   * determined, it will switch to 'baud' and send the UART command.
    *
    * @throw std::runtime_error for invalid baud rates.
    */
@@ -337,6 +573,23 @@ public:
    */
   void getDiagnosticInfo(Imu::DiagnosticFields &fields);
 
+  /**
+   * @brief requestDiagnosticInfo Ask the device for its diagnostic info
+   * without waiting for the reply. Safe to call from any thread.
+   *
+   * @note The request is posted as a background command, and replaces one
+   * which was not sent yet. The reply is decoded by the reading thread and
+   * published to diagnosticSnapshot().
+   */
+  void requestDiagnosticInfo();
+
+  /**
+   * @brief diagnosticSnapshot Last diagnostic info read from the device, by
+   * either requestDiagnosticInfo() or getDiagnosticInfo(). Safe to call from
+   * any thread, it never blocks the reading thread.
+   */
+  DiagnosticSnapshot diagnosticSnapshot() const;
+
   /**
    * @brief setIMUDataRate Set imu data rate for different sources.
    * @param decimation Denominator in the update rate value: 1000/x
@@ -357,6 +610,18 @@ public:
    */
   void setFilterDataRate(uint16_t decimation, const std::bitset<8> &sources);
 
+  /**
+   * @brief imuPacketSize Size of one IMU data packet carrying the given
+   * sources, including header and checksum. 0 if no source is selected.
+   */
+  static size_t imuPacketSize(const std::bitset<4> &sources);
+
+  /**
+   * @brief filterPacketSize Size of one filter data packet carrying the given
+   * sources, including header and checksum. 0 if no source is selected.
+   */
+  static size_t filterPacketSize(const std::bitset<8> &sources);
+
   /**
    * @brief enableMeasurements Set which measurements to enable in the filter
    * @param accel If true, acceleration measurements are enabled
@@ -408,6 +673,13 @@ public:
    */
   void setFilterDataCallback(const std::function<void(const Imu::FilterData &)> &);
 
+  /**
+   * @brief Set the raw packet callback.
+   * @note The packet callback is called with every packet that passes the
+   * checksum, before it is decoded.
+   */
+  void setPacketCallback(const std::function<void(const Imu::Packet &)> &);
+
   /**
    * @brief Save current settings as startup settings
    * @param command class command (3DM or Filter)
@@ -477,11 +749,17 @@ private:
 
   int pollInput(unsigned int to);
 
-  std::size_t handleByte(const uint8_t& byte, bool& found);
+  bool inputReady();
+
+  size_t readAvailable();
+
+  template <typename Sink> void dispatch(Sink &sink);
 
   int handleRead(size_t);
 
-  void processPacket();
+  enum PacketKind { OtherPacket = 0, IMUPacket, FilterPacket, };
+
+  PacketKind processPacket();
 
   int writePacket(const Packet &p, unsigned int to);
 
@@ -491,26 +769,148 @@ private:
 
   void sendCommand(const Packet &p, bool readReply = true);
 
+  void applyCommand(const Packet &p);
+
+  static uint32_t commandKey(const Packet &p);
+
+  void verifyCommand(const Packet &applied);
+
+  bool tryPing();
+
+  static uint16_t commandType(const Packet &p);
+
   bool termiosBaudRate(unsigned int baud);
 
+  void logPacket(LogRing::Level level, const char *what, const Packet &p);
+
+  void sendExternalHeading(const Packet &p,
+                           const std::chrono::steady_clock::time_point &queued);
+
+  std::future<void> submit(TxScheduler::Item &&item);
+
+  void runScheduled(TxScheduler::Priority maxPriority);
+
+  void storeDiagnosticInfo(const DiagnosticFields &fields);
+
   const std::string device_;
   const bool verbose_;
+  LogRing log_; /// declared early, so it outlives the members which log
   int fd_;
-  unsigned int rwTimeout_;
+  unsigned int rwTimeout_; /// write timeout [ms]
+  RttEstimator rtt_;       /// reply timeouts, reset when the baud rate changes
+  unsigned int retries_;
+  unsigned int baud_; /// last selected baud rate, 0 if none
+  uint16_t imuBaseRate_, filterBaseRate_; /// 0 until read from the device
 
-  std::vector<uint8_t> buffer_;
-  std::deque<uint8_t> queue_;
-  size_t srcIndex_, dstIndex_;
+  LinkMonitor link_;
+  LinkMonitor::Clock::time_point readStamp_; /// time of the last read
 
-  std::function<void(const Imu::IMUData &)>
-  imuDataCallback_; /// Called with IMU data is ready
-  std::function<void(const Imu::FilterData &)>
-  filterDataCallback_; /// Called when filter data is ready
+  std::vector<Packet> configCache_; /// applied settings, replayed on reconnect
+
+  std::vector<uint8_t> buffer_;
+  std::vector<uint8_t> queue_; /// unparsed input, fixed size
+  size_t queueStart_, queueEnd_;
+  size_t pendingSize_; /// size of the incomplete candidate at queueStart_, or 0
+
+  /// sink for the non-template readers, forwards to the callbacks
+  struct CallbackSink {
+    std::function<void(const Imu::IMUData &)>
+    imuData; /// Called with IMU data is ready
+    std::function<void(const Imu::FilterData &)>
+    filterData; /// Called when filter data is ready
+    std::function<void(const Imu::Packet &)>
+    packet; /// Called when a valid packet was read
+
+    void onPacket(const Packet &p) {
+      if (packet) {
+        packet(p);
+      }
+    }
+    void onIMUData(const IMUData &data) {
+      if (imuData) {
+        imuData(data);
+      }
+    }
+    void onFilterData(const FilterData &data) {
+      if (filterData) {
+        filterData(data);
+      }
+    }
+  } callbacks_;
 
-  enum { Idle = 0, Reading, } state_;
   Packet packet_;
+  IMUData imuData_;       /// decoded from packet_ by processPacket()
+  FilterData filterData_; /// decoded from packet_ by processPacket()
+
+  /// calls posted by other threads, taken one by one by the owner
+  std::mutex submitMutex_;
+  TxScheduler scheduler_; /// guarded by submitMutex_
+  std::atomic<size_t> numSubmitted_;
+  int submitFd_; /// eventfd signalled by post() and setExternalHeading()
+  bool runningPosted_;
+  bool txReady_; /// false while the baud rate is unknown
+
+  HeadingStats headingStats_; /// guarded by submitMutex_
+
+  /// written by the reading thread, odd sequence while it is being written
+  std::atomic<uint32_t> diagnosticSeq_;
+  DiagnosticSnapshot diagnostic_;
 };
 
+template <typename Sink>
+void Imu::runOnce(Sink &sink) {
+  runPosted();
+  const int sig = pollInput(5);
+  if (sig < 0) {
+    //  failure in poll/read, device disconnected
+    throw io_error(strerror(errno));
+  } else if (sig > 0) {
+    dispatch(sink);
+  }
+}
+
+template <typename Sink>
+void Imu::readInput(Sink &sink) {
+  runPosted();
+  if (!inputReady()) {
+    return;
+  }
+  for (size_t amt; (amt = readAvailable()) > 0;) {
+    //  dispatch all complete packets, not just the first one
+    for (int found = handleRead(amt); found; found = handleRead(0)) {
+      dispatch(sink);
+    }
+  }
+}
+
+template <typename Sink>
+void Imu::feed(const uint8_t *data, size_t length, Sink &sink) {
+  while (length > 0) {
+    const size_t amt = std::min(length, buffer_.size());
+    memcpy(&buffer_[0], data, amt);
+    data += amt;
+    length -= amt;
+    for (int found = handleRead(amt); found; found = handleRead(0)) {
+      dispatch(sink);
+    }
+  }
+}
+
+template <typename Sink>
+void Imu::dispatch(Sink &sink) {
+  sink.onPacket(packet_);
+  switch (processPacket()) {
+  case IMUPacket:
+    sink.onIMUData(imuData_);
+    break;
+  case FilterPacket:
+    sink.onFilterData(filterData_);
+    break;
+  default:
+    break;
+  }
+}
+
 } //  imu_3dm_gx4
 
 #endif // IMU_H_
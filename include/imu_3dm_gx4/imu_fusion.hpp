@@ -0,0 +1,125 @@
+/*
+ * imu_fusion.hpp
+ *
+ *  Resampling of several IMUs onto a common timeline, fused into a single
+ *  virtual IMU.
+ */
+
+#ifndef IMU_FUSION_H_
+#define IMU_FUSION_H_
+
+#include <vector>
+#include <cstdint>
+
+#include "imu_3dm_gx4/imu.hpp"
+
+namespace imu_3dm_gx4 {
+
+/**
+ * @brief ImuFusion Combine the samples of several rigidly mounted IMUs into
+ * one virtual IMU at the origin of the vehicle frame.
+ *
+ * Samples are rotated into the vehicle frame when they are added. On every
+ * tick of the common timeline, each unit is linearly interpolated between the
+ * two samples bracketing the tick, and its specific force is moved to the
+ * origin by removing the centripetal and tangential terms of its lever arm r:
+ *
+ *   a_origin = a - w x (w x r) - dw/dt x r
+ *
+ * The units are then combined per axis by their mean, or by their median to
+ * reject a single faulty unit.
+ *
+ * A tick is produced once every active unit has a sample at or after it. A
+ * unit which did not deliver samples for longer than the stale timeout is
+ * ignored until it delivers again, so a lost device does not stall the
+ * output.
+ *
+ * Per-tick data is kept as one array per axis with one entry per unit, so the
+ * inner loops run over contiguous memory and vectorize.
+ */
+class ImuFusion {
+public:
+  static constexpr size_t kMaxUnits = 8;
+
+  enum Voting {
+    Mean = 0,
+    Median,
+  };
+
+  struct Output {
+    int64_t stamp;     /**< Time of the tick [ns] */
+    float accel[3];    /**< Acceleration at the origin, units of G */
+    float gyro[3];     /**< Angular rates, units of rad/s */
+    uint32_t numUnits; /**< Number of units which contributed */
+  };
+
+  /**
+   * @brief ImuFusion Create a fusion stage.
+   * @param numUnits Number of IMUs, at most kMaxUnits.
+   * @param rate Rate of the common timeline [Hz].
+   * @param voting How the units are combined.
+   * @param staleTimeout Time after which a silent unit is ignored [s].
+   *
+   * @throw std::runtime_error for invalid arguments.
+   */
+  ImuFusion(size_t numUnits, double rate, Voting voting, double staleTimeout);
+
+  /**
+   * @brief setMounting Set the mounting of one unit in the vehicle frame.
+   * @param roll, pitch, yaw Orientation of the sensor frame in the vehicle
+   * frame [rad], applied in yaw, pitch, roll order.
+   * @param leverArm Position of the sensor in the vehicle frame [m].
+   */
+  void setMounting(size_t unit, float roll, float pitch, float yaw,
+                   const float leverArm[3]);
+
+  /**
+   * @brief addSample Add a sample of one unit. Samples of a unit must be
+   * added in order of their time stamps, samples without accelerometer and
+   * gyroscope are ignored.
+   * @param stamp Time of the sample [ns].
+   */
+  void addSample(size_t unit, int64_t stamp, const Imu::IMUData &data);
+
+  /**
+   * @brief next Produce the next fused sample, if all active units have
+   * delivered samples up to the next tick.
+   * @return False if no sample is ready.
+   */
+  bool next(Output &output);
+
+private:
+  struct Sample {
+    int64_t stamp;
+    float accel[3]; //  vehicle frame
+    float gyro[3];  //  vehicle frame
+  };
+
+  struct Unit {
+    float rotation[9]; //  sensor to vehicle, row major
+    float leverArm[3];
+    std::vector<Sample> samples; //  fixed-size ring
+    size_t head;  //  index of the oldest sample
+    size_t count; //  number of samples
+    int64_t lastStamp;
+
+    const Sample &at(size_t i) const {
+      return samples[(head + i) % samples.size()];
+    }
+  };
+
+  static float median(float *values, size_t count);
+
+  const double period_;  //  [ns]
+  const Voting voting_;
+  const int64_t staleTimeout_;  //  [ns]
+  std::vector<Unit> units_;
+  int64_t newest_; //  newest stamp of all units
+  int64_t tick_;   //  next tick to produce, 0 until started
+  uint64_t ticks_; //  ticks produced since start
+  int64_t start_;  //  first tick
+};
+
+} //  imu_3dm_gx4
+
+#endif // IMU_FUSION_H_
@@ -0,0 +1,84 @@
+/*
+ * imu_sink.hpp
+ *
+ *  Compile-time consumers of the packets and samples read by Imu.
+ */
+
+#ifndef IMU_SINK_H_
+#define IMU_SINK_H_
+
+#include "imu_3dm_gx4/imu.hpp"
+
+namespace imu_3dm_gx4 {
+
+/**
+ * @brief ImuSink Consumer which ignores everything. Derive from it and hide
+ * only the handlers of interest, then pass the derived type to
+ * Imu::readInput(Sink &). Nothing is virtual: the reader calls the handlers
+ * of the type it was instantiated with.
+ *
+ * The samples passed to onIMUData() and onFilterData() are decoded afresh
+ * from each packet: only the fields flagged in `fields` were received, all
+ * others are zero. The references are only valid during the call.
+ */
+struct ImuSink {
+  void onPacket(const Imu::Packet &) {}
+  void onIMUData(const Imu::IMUData &) {}
+  void onFilterData(const Imu::FilterData &) {}
+};
+
+/**
+ * @brief SinkSet Passes every packet and sample to several sinks, in the
+ * order they were given. The set only holds references, the sinks must
+ * outlive it.
+ *
+ * @code
+ * SinkSet<Publisher, Recorder> sinks(publisher, recorder);
+ * imu.readInput(sinks);
+ * @endcode
+ */
+template <typename... Sinks> class SinkSet;
+
+template <> class SinkSet<> {
+public:
+  void onPacket(const Imu::Packet &) {}
+  void onIMUData(const Imu::IMUData &) {}
+  void onFilterData(const Imu::FilterData &) {}
+};
+
+template <typename Head, typename... Tail>
+class SinkSet<Head, Tail...> {
+public:
+  SinkSet(Head &head, Tail &...tail) : head_(head), tail_(tail...) {}
+
+  void onPacket(const Imu::Packet &packet) {
+    head_.onPacket(packet);
+    tail_.onPacket(packet);
+  }
+
+  void onIMUData(const Imu::IMUData &data) {
+    head_.onIMUData(data);
+    tail_.onIMUData(data);
+  }
+
+  void onFilterData(const Imu::FilterData &data) {
+    head_.onFilterData(data);
+    tail_.onFilterData(data);
+  }
+
+private:
+  Head &head_;
+  SinkSet<Tail...> tail_;
+};
+
+/**
+ * @brief makeSinkSet Deduce the SinkSet for the given sinks.
+ */
+template <typename... Sinks>
+SinkSet<Sinks...> makeSinkSet(Sinks &...sinks) {
+  return SinkSet<Sinks...>(sinks...);
+}
+
+} //  imu_3dm_gx4
+
+#endif // IMU_SINK_H_
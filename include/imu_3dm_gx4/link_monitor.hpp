@@ -0,0 +1,121 @@
+/*
+ * link_monitor.hpp
+ *
+ *  Host-side accounting of lost and corrupted packets.
+ */
+
+#ifndef LINK_MONITOR_H_
+#define LINK_MONITOR_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace imu_3dm_gx4 {
+
+/**
+ * @brief LinkMonitor Counts what the host sees of the incoming byte stream:
+ * bytes discarded while resynchronizing, packets with bad checksums or
+ * malformed fields, and gaps in the IMU and filter streams.
+ *
+ * The data packets carry no sequence number or device time, so gaps are
+ * detected from the arrival times and the expected period of each stream.
+ * Packets which were buffered by the host, eg. while it was descheduled,
+ * arrive together after a long gap; they are taken back from the gap before
+ * it is counted.
+ *
+ * The counting methods must be called by the thread reading the device. They
+ * do not lock, every counter is an atomic with a single writer, so counters()
+ * can be called from any thread.
+ */
+class LinkMonitor {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  enum Stream {
+    ImuStream = 0,
+    FilterStream,
+    kNumStreams,
+  };
+
+  struct Counters {
+    uint64_t bytes;          /**< Bytes read */
+    uint64_t resyncBytes;    /**< Bytes discarded outside of valid packets */
+    uint64_t checksumErrors; /**< Packets with a mismatched checksum */
+    uint64_t parseErrors;    /**< Packets with unknown or malformed fields */
+    uint64_t packets[kNumStreams]; /**< Data packets received */
+    uint64_t gaps[kNumStreams];    /**< Gaps in the stream */
+    uint64_t missed[kNumStreams];  /**< Packets missing in those gaps */
+  };
+
+  /**
+   * @brief Losses Packets lost in an interval, by where they were lost.
+   */
+  struct Losses {
+    uint64_t device; /**< Dropped by the device, or overran its port */
+    uint64_t link;   /**< Corrupted on the serial link */
+    uint64_t host;   /**< Missing at the host without either explanation */
+  };
+
+  LinkMonitor();
+
+  /**
+   * @brief setPeriod Set the expected period of a stream [s], 0 disables gap
+   * detection. Restarts the stream.
+   */
+  void setPeriod(Stream stream, double period);
+
+  /**
+   * @brief restart Do not count a gap before the next packet of any stream,
+   * eg. after the device was idled.
+   */
+  void restart();
+
+  void countBytes(size_t count) { add(bytes_, count); }
+  void countResync(size_t count) { add(resyncBytes_, count); }
+  void countChecksumError() { add(checksumErrors_, 1); }
+  void countParseError() { add(parseErrors_, 1); }
+
+  /**
+   * @brief countPacket Count a data packet read at the given time.
+   */
+  void countPacket(Stream stream, const Clock::time_point &arrival);
+
+  /**
+   * @brief counters Snapshot of all counters. Safe to call from any thread.
+   */
+  Counters counters() const;
+
+  /**
+   * @brief attribute Split the packets lost between two snapshots.
+   * @param deviceDropped Packets the device reports as dropped in the same
+   * interval.
+   * @param deviceOverruns Write overruns of the device port in the interval.
+   */
+  static Losses attribute(const Counters &before, const Counters &after,
+                          uint64_t deviceDropped, uint64_t deviceOverruns);
+
+private:
+  //  single writer, so a load and a store replace the locked read-modify-write
+  static void add(std::atomic<uint64_t> &counter, uint64_t count) {
+    counter.store(counter.load(std::memory_order_relaxed) + count,
+                  std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> bytes_;
+  std::atomic<uint64_t> resyncBytes_;
+  std::atomic<uint64_t> checksumErrors_;
+  std::atomic<uint64_t> parseErrors_;
+  std::atomic<uint64_t> packets_[kNumStreams];
+  std::atomic<uint64_t> gaps_[kNumStreams];
+  std::atomic<uint64_t> missed_[kNumStreams];
+
+  //  reader thread only
+  double period_[kNumStreams];
+  Clock::time_point last_[kNumStreams]; //  epoch until the first packet
+  uint64_t pending_[kNumStreams]; //  missing packets of the last gap
+};
+
+} //  imu_3dm_gx4
+
+#endif // LINK_MONITOR_H_
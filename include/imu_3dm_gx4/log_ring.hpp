@@ -0,0 +1,152 @@
+/*
+ * log_ring.hpp
+ *
+ *  Bounded, non-blocking log queue drained by a background thread.
+ */
+
+#ifndef LOG_RING_H_
+#define LOG_RING_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace imu_3dm_gx4 {
+
+/**
+ * @brief LogRing Keeps logging off the thread which reads the device.
+ *
+ * log() and dump() only copy a format string, up to four integer arguments
+ * and optionally some raw bytes into a preallocated ring. They never block,
+ * never allocate and never format. A background thread formats the records
+ * with snprintf() and passes them to the sink every few milliseconds.
+ *
+ * Every format string is rate limited on its own: beyond the burst within
+ * one window, records are only counted. The drain thread logs the number of
+ * suppressed records at most once per window and format. Records which do
+ * not fit into the ring are counted as dropped and reported the same way.
+ *
+ * @note log() and dump() must be called by one thread at a time, the thread
+ * which reads the device. The format must be a string literal, it is
+ * formatted after the call returned.
+ */
+class LogRing {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  enum Level {
+    Debug = 0,
+    Info,
+    Warn,
+    Error,
+  };
+
+  typedef std::function<void(Level, const char *)> Sink;
+
+  static constexpr size_t kMaxDump = 4 + 255 + 2; /**< A full packet */
+
+  /**
+   * @brief LogRing Create the ring and start the drain thread.
+   * @param capacity Number of records, rounded up to a power of two.
+   * @param burst Records per format string and window before suppressing.
+   * @param window Length of the rate limiting window [s].
+   */
+  LogRing(size_t capacity, unsigned int burst, double window);
+
+  /**
+   * @brief ~LogRing Drain what is left, then stop the thread.
+   */
+  ~LogRing();
+
+  /**
+   * @brief setSink Set where formatted records go, std::cout by default.
+   * Called from the drain thread.
+   */
+  void setSink(const Sink &sink);
+
+  /**
+   * @brief log Queue a message with up to four integer arguments, for %u,
+   * %x, %d and the like.
+   */
+  void log(Level level, const char *format, uint32_t a0 = 0, uint32_t a1 = 0,
+           uint32_t a2 = 0, uint32_t a3 = 0) {
+    dump(level, format, nullptr, 0, a0, a1, a2, a3);
+  }
+
+  /**
+   * @brief dump Queue a message followed by a hex dump of data, truncated to
+   * kMaxDump bytes.
+   */
+  void dump(Level level, const char *format, const uint8_t *data,
+            size_t length, uint32_t a0 = 0, uint32_t a1 = 0, uint32_t a2 = 0,
+            uint32_t a3 = 0);
+
+  /**
+   * @brief flush Format and pass on all queued records before returning.
+   */
+  void flush();
+
+  uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+  uint64_t suppressed() const {
+    return suppressed_.load(std::memory_order_relaxed);
+  }
+
+private:
+  LogRing(const LogRing &) = delete;
+  LogRing &operator=(const LogRing &) = delete;
+
+  struct Record {
+    Level level;
+    const char *format;
+    uint32_t args[4];
+    uint16_t length;        //  bytes in data
+    uint8_t data[kMaxDump];
+  };
+
+  struct Limit {
+    std::atomic<const char *> format; //  published once by the producer
+    Level level;
+    Clock::time_point start;          //  producer, current window
+    unsigned int count;               //  producer, records in the window
+    std::atomic<uint64_t> suppressed; //  producer, records not queued
+    uint64_t reportedSuppressed;      //  drain thread, already summarized
+    Clock::time_point reported;       //  drain thread, last summary
+  };
+
+  static constexpr size_t kMaxLimits = 32;
+
+  bool admit(Level level, const char *format);
+  void run();
+  void drain();
+  void emit(Level level, const char *text);
+
+  std::vector<Record> ring_;
+  const size_t mask_;
+  const unsigned int burst_;
+  const Clock::duration window_;
+
+  std::atomic<uint64_t> head_;  //  written by the producer
+  std::atomic<uint64_t> tail_;  //  written by the drain thread
+  std::atomic<uint64_t> dropped_;
+  std::atomic<uint64_t> suppressed_;
+  uint64_t reportedDrops_;      //  drain thread only
+  Clock::time_point dropsReported_;
+
+  Limit limits_[kMaxLimits];
+  std::atomic<size_t> numLimits_; //  entries with a format
+
+  std::mutex mutex_;            //  sink, drain and stop
+  std::condition_variable wake_;
+  Sink sink_;
+  bool stop_;
+  std::thread thread_;
+};
+
+} //  imu_3dm_gx4
+
+#endif // LOG_RING_H_
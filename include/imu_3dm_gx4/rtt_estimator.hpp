@@ -0,0 +1,88 @@
+/*
+ * rtt_estimator.hpp
+ *
+ *  Command timeouts derived from measured round-trip times.
+ */
+
+#ifndef RTT_ESTIMATOR_H_
+#define RTT_ESTIMATOR_H_
+
+#include <map>
+#include <cstdint>
+
+namespace imu_3dm_gx4 {
+
+/**
+ * @brief RttEstimator Tracks the round-trip time of each command type, and
+ * derives the time to wait for its reply.
+ *
+ * Follows the TCP retransmission timer (RFC 6298): a smoothed RTT and its
+ * mean deviation are updated with every sample, and the timeout is
+ * srtt + 4 * rttvar, clamped between a floor and a ceiling. Types without
+ * samples use the initial timeout. Samples must only be taken from commands
+ * answered on their first attempt, as the reply to a retry cannot be told
+ * apart from a late reply to the original.
+ */
+class RttEstimator {
+public:
+  struct Stats {
+    uint64_t samples;  /**< RTT samples taken */
+    uint64_t timeouts; /**< Replies which did not arrive in time */
+    uint64_t retries;  /**< Commands sent again after a timeout */
+  };
+
+  /**
+   * @brief RttEstimator Create an estimator without samples.
+   * @param floor Shortest timeout [s].
+   * @param ceiling Longest timeout [s].
+   * @param initial Timeout of types without samples [s].
+   */
+  RttEstimator(double floor, double ceiling, double initial);
+
+  void setLimits(double floor, double ceiling, double initial);
+
+  /**
+   * @brief reset Forget all samples, eg. after the baud rate changed.
+   */
+  void reset();
+
+  /**
+   * @brief sample Add a measured round trip of a command type [s].
+   */
+  void sample(uint16_t type, double rtt);
+
+  /**
+   * @brief timeout Time to wait for the reply to a command type [ms].
+   */
+  unsigned int timeout(uint16_t type) const;
+
+  /**
+   * @brief backoff Timeout of a retry after a timeout of the given length,
+   * doubled up to the ceiling [ms].
+   */
+  unsigned int backoff(unsigned int timeout) const;
+
+  /**
+   * @brief srtt Smoothed RTT of a command type, 0 without samples [s].
+   */
+  double srtt(uint16_t type) const;
+
+  void countTimeout() { stats_.timeouts++; }
+  void countRetry() { stats_.retries++; }
+
+  const Stats &stats() const { return stats_; }
+
+private:
+  struct Entry {
+    double srtt;
+    double rttvar;
+  };
+
+  double floor_, ceiling_, initial_;
+  std::map<uint16_t, Entry> entries_;
+  Stats stats_;
+};
+
+} //  imu_3dm_gx4
+
+#endif // RTT_ESTIMATOR_H_
@@ -0,0 +1,190 @@
+/*
+ * shm_ring.hpp
+ *
+ *  Shared-memory ring buffer of decoded IMU and filter samples, for local
+ *  consumers which do not use ROS.
+ */
+
+#ifndef SHM_RING_H_
+#define SHM_RING_H_
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+
+#include "imu_3dm_gx4/imu.hpp"
+
+namespace imu_3dm_gx4 {
+
+/**
+ * @brief ShmRing Layout of the shared-memory ring.
+ *
+ * One writer (the driver) stores records into a power-of-two number of
+ * slots. Every slot is protected by its own sequence lock, so readers never
+ * block the writer: a reader copies a slot and retries if the sequence
+ * changed while copying. Readers which fall more than one ring behind skip
+ * ahead and count the lost records.
+ *
+ * Readers poll writeIndex, or sleep on the futex word which the writer bumps
+ * after every record. The writer only issues the FUTEX_WAKE syscall when a
+ * reader has announced itself in waiters.
+ *
+ * @note The layout embeds Imu::IMUData and Imu::FilterData, so reader and
+ * writer must be built against the same imu.hpp. The header stores the
+ * version and record sizes, and readers refuse mismatching rings.
+ */
+struct ShmRing {
+  static constexpr uint32_t kMagic = 0x494d5552; //  'IMUR'
+  static constexpr uint32_t kVersion = 1;
+  static constexpr size_t kCacheLine = 64;
+
+  enum Type : uint32_t {
+    IMUData = 1,
+    FilterData = 2,
+  };
+
+  struct alignas(kCacheLine) Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotSize;     /**< sizeof(Slot) */
+    uint32_t capacity;     /**< Number of slots, power of two */
+    uint32_t imuDataSize;  /**< sizeof(Imu::IMUData) */
+    uint32_t filterDataSize; /**< sizeof(Imu::FilterData) */
+
+    alignas(kCacheLine) std::atomic<uint64_t> writeIndex; /**< Records written */
+
+    alignas(kCacheLine) std::atomic<uint32_t> futex;   /**< Bumped per record */
+    std::atomic<uint32_t> waiters; /**< Readers sleeping on futex */
+  };
+
+  struct alignas(kCacheLine) Slot {
+    std::atomic<uint32_t> seq; /**< Odd while the slot is being written */
+    uint32_t type;             /**< One of Type */
+    uint64_t index;            /**< Index of the record in this slot */
+    int64_t stamp;             /**< Receive time [ns since epoch] */
+    union {
+      Imu::IMUData imu;
+      Imu::FilterData filter;
+    };
+  };
+
+  /**
+   * @brief Record Copy of one slot, as returned to readers.
+   */
+  struct Record {
+    uint32_t type;  /**< One of Type */
+    uint64_t index; /**< Index of the record, increments by one per record */
+    int64_t stamp;  /**< Receive time [ns since epoch] */
+    Imu::IMUData imu;       /**< Valid if type == IMUData */
+    Imu::FilterData filter; /**< Valid if type == FilterData */
+  };
+
+  /**
+   * @brief Size of the mapping for a ring with the given capacity.
+   */
+  static size_t mappingSize(uint32_t capacity) {
+    return sizeof(Header) + capacity * sizeof(Slot);
+  }
+};
+
+/**
+ * @brief ShmRingWriter Creates the ring and writes records into it.
+ * @note Not thread safe, there must be a single writer.
+ */
+class ShmRingWriter {
+public:
+  /**
+   * @brief ShmRingWriter Create (or replace) the shared-memory object.
+   * @param name Name of the object, eg. /imu_3dm_gx4.
+   * @param capacity Number of slots, rounded up to a power of two.
+   *
+   * @throw std::runtime_error if the object cannot be created or mapped.
+   */
+  ShmRingWriter(const std::string &name, uint32_t capacity);
+
+  /**
+   * @brief ~ShmRingWriter Unmap and unlink the shared-memory object.
+   */
+  ~ShmRingWriter();
+
+  /**
+   * @brief write Append an IMU sample.
+   * @param stamp Receive time [ns since epoch]
+   */
+  void write(const Imu::IMUData &data, int64_t stamp);
+
+  /**
+   * @brief write Append a filter sample.
+   * @param stamp Receive time [ns since epoch]
+   */
+  void write(const Imu::FilterData &data, int64_t stamp);
+
+private:
+  ShmRingWriter(const ShmRingWriter &) = delete;
+  ShmRingWriter &operator=(const ShmRingWriter &) = delete;
+
+  ShmRing::Slot &beginSlot(uint32_t type, int64_t stamp);
+  void commitSlot(ShmRing::Slot &slot);
+
+  const std::string name_;
+  size_t size_;
+  ShmRing::Header *header_;
+  ShmRing::Slot *slots_;
+  uint64_t mask_;
+  uint64_t next_;
+};
+
+/**
+ * @brief ShmRingReader Attaches to an existing ring and reads records.
+ * @note Each reader keeps its own position, any number of readers may be
+ * attached at once. A single reader must not be shared between threads.
+ */
+class ShmRingReader {
+public:
+  /**
+   * @brief ShmRingReader Attach to the ring. Reading starts at the newest
+   * record.
+   * @param name Name of the shared-memory object, eg. /imu_3dm_gx4.
+   *
+   * @throw std::runtime_error if the object does not exist, or has an
+   * incompatible layout.
+   */
+  explicit ShmRingReader(const std::string &name);
+
+  ~ShmRingReader();
+
+  /**
+   * @brief poll Read the next record without blocking.
+   * @return True if a record was read, false if none is available.
+   */
+  bool poll(ShmRing::Record &record);
+
+  /**
+   * @brief wait Read the next record, sleeping on the futex if none is
+   * available.
+   * @param timeout Time-out in milliseconds.
+   * @return True if a record was read, false on time-out.
+   */
+  bool wait(ShmRing::Record &record, unsigned int timeout);
+
+  /**
+   * @brief dropped Number of records that were overwritten before this
+   * reader got to them.
+   */
+  uint64_t dropped() const { return dropped_; }
+
+private:
+  ShmRingReader(const ShmRingReader &) = delete;
+  ShmRingReader &operator=(const ShmRingReader &) = delete;
+
+  size_t size_;
+  ShmRing::Header *header_;
+  const ShmRing::Slot *slots_;
+  uint64_t mask_;
+  uint64_t next_;
+  uint64_t dropped_;
+};
+
+} //  imu_3dm_gx4
+
+#endif // SHM_RING_H_
@@ -0,0 +1,176 @@
+/*
+ * stream_server.hpp
+ *
+ *  Unix-domain socket server streaming raw MIP frames and decoded samples to
+ *  local clients which do not use ROS.
+ */
+
+#ifndef STREAM_SERVER_H_
+#define STREAM_SERVER_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "imu_3dm_gx4/imu.hpp"
+
+namespace imu_3dm_gx4 {
+
+/**
+ * @brief StreamServer Local socket server for raw and decoded samples.
+ *
+ * Clients connect to a SOCK_STREAM Unix-domain socket and write a single
+ * subscription byte, a bitwise combination of Subscription. They may write
+ * another byte at any time to change their subscription. The server then
+ * sends a stream of messages, each made of a MessageHeader followed by
+ * MessageHeader::length bytes of payload:
+ *
+ * - RawFrame: the MIP frame as received, from sync bytes to checksum.
+ * - IMUSample: an IMURecord.
+ * - FilterSample: a FilterRecord.
+ *
+ * All multi-byte values are in host byte order.
+ *
+ * Every client has a bounded send queue. Sockets are never written to in a
+ * blocking manner; when a client does not keep up, its oldest queued
+ * messages are dropped so the serial reader is never stalled.
+ */
+class StreamServer {
+public:
+  enum Subscription : uint8_t {
+    Raw = (1 << 0),
+    Decoded = (1 << 1),
+  };
+
+  enum MessageType : uint16_t {
+    RawFrame = 1,
+    IMUSample = 2,
+    FilterSample = 3,
+  };
+
+  struct MessageHeader {
+    uint16_t type;   /**< One of MessageType */
+    uint16_t length; /**< Length of the payload following the header */
+    uint32_t dropped; /**< Messages dropped for this client so far */
+    int64_t stamp;   /**< Receive time [ns since epoch] */
+  } __attribute__((packed));
+
+  struct IMURecord {
+    uint32_t fields; /**< Imu::IMUData::fields */
+    float accel[3];  /**< Acceleration [G] */
+    float gyro[3];   /**< Angular rates [rad/s] */
+    float mag[3];    /**< Magnetic field [gauss] */
+    float pressure;  /**< Pressure [pascal] */
+  } __attribute__((packed));
+
+  struct FilterRecord {
+    uint32_t fields; /**< Imu::FilterData::fields */
+    float quaternion[4];
+    uint16_t quaternionStatus;
+    float eulerRPY[3];
+    uint16_t eulerRPYStatus;
+    float headingUpdate;
+    float headingUpdateUncertainty;
+    uint16_t headingUpdateSource;
+    uint16_t headingUpdateFlags;
+    float acceleration[3];
+    uint16_t accelerationStatus;
+    float angularRate[3];
+    uint16_t angularRateStatus;
+    float eulerAngleUncertainty[3];
+    uint16_t eulerAngleUncertaintyStatus;
+    float gyroBias[3];
+    uint16_t gyroBiasStatus;
+    float gyroBiasUncertainty[3];
+    uint16_t gyroBiasUncertaintyStatus;
+  } __attribute__((packed));
+
+  /// Largest message: a full MIP frame plus the header
+  static constexpr size_t kMaxMessageLength =
+      sizeof(MessageHeader) + Imu::Packet::kHeaderLength + 255 + 2;
+
+  /**
+   * @brief StreamServer Create the listening socket.
+   * @param path Path of the socket in the file system. A stale socket at
+   * this path is removed.
+   * @param queueLength Number of messages queued per client before the oldest
+   * are dropped, at least 2. A partially sent message is never dropped, so a
+   * single slot would leave no room for new messages.
+   *
+   * @throw std::runtime_error if the socket cannot be created.
+   */
+  StreamServer(const std::string &path, size_t queueLength);
+
+  /**
+   * @brief ~StreamServer Close all clients and remove the socket.
+   */
+  ~StreamServer();
+
+  /**
+   * @brief service Accept new clients, read subscriptions and flush send
+   * queues. Never blocks.
+   */
+  void service();
+
+  /**
+   * @brief publish Queue a raw frame for clients subscribed to Raw.
+   */
+  void publish(const Imu::Packet &packet, int64_t stamp);
+
+  /**
+   * @brief publish Queue an IMU sample for clients subscribed to Decoded.
+   */
+  void publish(const Imu::IMUData &data, int64_t stamp);
+
+  /**
+   * @brief publish Queue a filter sample for clients subscribed to Decoded.
+   */
+  void publish(const Imu::FilterData &data, int64_t stamp);
+
+  /**
+   * @brief numClients Number of connected clients.
+   */
+  size_t numClients() const { return clients_.size(); }
+
+  /**
+   * @brief dropped Total number of messages dropped for slow clients.
+   */
+  uint64_t dropped() const { return dropped_; }
+
+private:
+  StreamServer(const StreamServer &) = delete;
+  StreamServer &operator=(const StreamServer &) = delete;
+
+  struct Message {
+    uint16_t size;
+    uint8_t data[kMaxMessageLength];
+  };
+
+  struct Client {
+    int fd;
+    uint8_t subscription;
+    uint32_t dropped;
+    std::vector<Message> queue; /// fixed-size ring of messages
+    size_t head;   /// index of the oldest message
+    size_t count;  /// number of queued messages
+    size_t offset; /// bytes of the oldest message already sent
+  };
+
+  void publish(uint8_t subscription, MessageType type, const void *payload,
+               uint16_t length, int64_t stamp);
+  void enqueue(Client &client, MessageType type, const void *payload,
+               uint16_t length, int64_t stamp);
+  bool flush(Client &client);
+  bool readSubscription(Client &client);
+  void closeClient(size_t index);
+
+  const std::string path_;
+  const size_t queueLength_;
+  int fd_;
+  std::vector<Client> clients_;
+  uint64_t dropped_;
+};
+
+} //  imu_3dm_gx4
+
+#endif // STREAM_SERVER_H_
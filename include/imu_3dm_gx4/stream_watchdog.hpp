@@ -0,0 +1,113 @@
+/*
+ * stream_watchdog.hpp
+ *
+ *  Detection of stalled data streams, with staged recovery.
+ */
+
+#ifndef STREAM_WATCHDOG_H_
+#define STREAM_WATCHDOG_H_
+
+#include <chrono>
+#include <cstdint>
+
+namespace imu_3dm_gx4 {
+
+/**
+ * @brief StreamWatchdog Flags a stream which stopped delivering samples.
+ *
+ * The watchdog does not run on its own. The owner reports every sample with
+ * sample(), and uses deadline() to bound how long it waits for input, eg. as
+ * the timeout of poll(). Once the deadline passed, expired() returns true and
+ * escalate() selects the next recovery action. Every action re-arms the
+ * watchdog for the recovery window; a sample resets the escalation.
+ */
+class StreamWatchdog {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  enum Action {
+    None = 0,
+    Resume,        /**< Resume the device */
+    EnableStreams, /**< Enable the data streams again, then resume */
+    Reconnect,     /**< Reopen and reconfigure the device */
+  };
+
+  struct Stats {
+    uint64_t samples;      /**< Samples reported */
+    uint64_t lateSamples;  /**< Samples later than 1.5 periods */
+    uint64_t stalls;       /**< Number of detected stalls */
+    uint64_t recoveries;   /**< Recovery actions taken */
+    double lastGap;        /**< Last gap between samples [s] */
+    double maxGap;         /**< Largest gap between samples [s] */
+    double meanGap;        /**< Mean gap between samples [s] */
+    double lastStallGap;   /**< Duration of the last stall [s] */
+  };
+
+  /**
+   * @brief StreamWatchdog Create a disarmed watchdog.
+   * @param missedPeriods Number of periods without samples before the stream
+   * is considered stalled.
+   * @param recoveryWindow Time given to each recovery action [s].
+   */
+  StreamWatchdog(unsigned int missedPeriods, double recoveryWindow);
+
+  /**
+   * @brief arm Start watching a stream with the given period [s].
+   */
+  void arm(double period, const Clock::time_point &now);
+
+  /**
+   * @brief disarm Stop watching, eg. while the device is disconnected.
+   */
+  void disarm();
+
+  bool armed() const { return armed_; }
+
+  /**
+   * @brief stalled True from a detected stall until the next sample.
+   */
+  bool stalled() const { return stalled_; }
+
+  /**
+   * @brief sample Report the arrival of a sample.
+   */
+  void sample(const Clock::time_point &now);
+
+  /**
+   * @brief deadline Time at which the stream is considered stalled.
+   */
+  const Clock::time_point &deadline() const { return deadline_; }
+
+  /**
+   * @brief expired True if armed and the deadline has passed.
+   */
+  bool expired(const Clock::time_point &now) const {
+    return armed_ && now >= deadline_;
+  }
+
+  /**
+   * @brief escalate Select the next recovery action after the deadline
+   * expired, and re-arm for the recovery window. Repeats Reconnect once all
+   * stages were tried.
+   */
+  Action escalate(const Clock::time_point &now);
+
+  const Stats &stats() const { return stats_; }
+
+private:
+  const unsigned int missedPeriods_;
+  const Clock::duration recoveryWindow_;
+  Clock::duration window_;
+  Clock::time_point last_;
+  Clock::time_point deadline_;
+  double period_;
+  bool armed_;
+  bool stalled_;
+  Action stage_;
+  Stats stats_;
+  uint64_t gaps_;
+};
+
+} //  imu_3dm_gx4
+
+#endif // STREAM_WATCHDOG_H_
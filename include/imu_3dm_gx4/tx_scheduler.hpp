@@ -0,0 +1,112 @@
+/*
+ * tx_scheduler.hpp
+ *
+ *  Prioritized, coalescing and paced queue of outbound commands.
+ */
+
+#ifndef TX_SCHEDULER_H_
+#define TX_SCHEDULER_H_
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <vector>
+
+namespace imu_3dm_gx4 {
+
+/**
+ * @brief TxScheduler Orders the commands written to a device.
+ *
+ * Commands are queued per priority and taken strictly in priority order.
+ * Queueing a command with the key of one that is still waiting replaces the
+ * waiting one, which then completes together with its replacement.
+ *
+ * Aiding commands are never held back. Control and background commands are
+ * paced by a token bucket of bytes, which all written bytes are charged
+ * against, including those of aiding commands. Bursts of commands thus cannot
+ * fill the transmit direction of the link ahead of time-critical writes.
+ *
+ * The scheduler does no locking and no IO, the owner does both.
+ */
+class TxScheduler {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  enum Priority {
+    Aiding = 0,  /**< Real-time aiding inputs, eg. external heading */
+    Control,     /**< Commands changing the device configuration */
+    Background,  /**< Queries, eg. diagnostics */
+    kNumPriorities,
+  };
+
+  struct Item {
+    Priority priority;
+    uint32_t key;  /**< Coalescing key, 0 never coalesces */
+    std::function<void()> run;
+    std::vector<std::promise<void>> done;  /**< Completed after run */
+    Clock::time_point queued;  /**< Time the oldest coalesced item was queued */
+  };
+
+  struct Stats {
+    uint64_t queued;     /**< Items pushed */
+    uint64_t sent;       /**< Items popped */
+    uint64_t coalesced;  /**< Items replaced by a newer one */
+    uint64_t deferred;   /**< Pops held back by the pacing */
+    double meanDelay;    /**< Moving average of the queue delay [s] */
+    double maxDelay;     /**< Largest queue delay [s] */
+  };
+
+  /**
+   * @brief TxScheduler Create an empty scheduler.
+   * @param rate Byte rate available to control and background commands.
+   * @param burst Bytes which may be written back to back [bytes].
+   */
+  TxScheduler(double rate, double burst);
+
+  /**
+   * @brief setRate Change the pacing, eg. after a baud rate change.
+   */
+  void setRate(double rate, double burst);
+
+  /**
+   * @brief push Queue an item.
+   * @return True if it replaced a waiting item with the same key.
+   */
+  bool push(Item &&item);
+
+  /**
+   * @brief pop Take the next item which may be written now.
+   * @param maxPriority Lowest priority to consider, eg. Aiding to take only
+   * aiding items.
+   * @return False if nothing is queued, or the pacing holds back the rest.
+   */
+  bool pop(const Clock::time_point &now, Item &item,
+           Priority maxPriority = Background);
+
+  /**
+   * @brief charge Account for bytes written to the link.
+   */
+  void charge(size_t bytes);
+
+  size_t size() const { return size_; }
+
+  const Stats &stats(Priority priority) const { return stats_[priority]; }
+
+private:
+  void refill(const Clock::time_point &now);
+
+  std::deque<Item> queues_[kNumPriorities];
+  Stats stats_[kNumPriorities];
+  size_t size_;
+
+  double rate_;    //  [bytes/s]
+  double burst_;   //  [bytes]
+  double tokens_;  //  may go negative after a large write
+  Clock::time_point lastRefill_;
+};
+
+} //  imu_3dm_gx4
+
+#endif // TX_SCHEDULER_H_
@@ -0,0 +1,189 @@
+/*
+ * checksum.cpp
+ *
+ *  Fletcher checksum of MIP packets, and bulk validation of frames.
+ */
+
+#include "imu_3dm_gx4/checksum.hpp"
+#include <cstring>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace imu_3dm_gx4;
+
+#define kSyncMSB    (0x75)
+#define kSyncLSB    (0x65)
+#define kHeaderSize (4)
+#define kCheckSize  (2)
+
+//  below this many bytes the vector setup costs more than it saves
+#define kMinVectorLength (32)
+
+//  Both sums are taken modulo 256. Wider accumulators which wrap modulo a
+//  multiple of 256 give the same low bytes, so the vector versions sum whole
+//  blocks: over a block x[0..n-1] the first sum grows by sum(x) and the
+//  second by n * first + sum((n - j) * x[j]).
+
+uint16_t imu_3dm_gx4::fletcher16Scalar(const uint8_t *data, size_t length) {
+  uint32_t sum1 = 0, sum2 = 0;
+  for (size_t i = 0; i < length; i++) {
+    sum1 += data[i];
+    sum2 += sum1;
+  }
+  return static_cast<uint16_t>(((sum1 & 0xff) << 8) | (sum2 & 0xff));
+}
+
+#ifdef HAVE_X86_SIMD
+
+static uint32_t horizontalSum(__m128i v) {
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return static_cast<uint32_t>(_mm_cvtsi128_si32(v));
+}
+
+//  finishes the bytes after the last whole block
+static uint16_t finish(const uint8_t *data, size_t length, uint32_t sum1,
+                       uint32_t sum2) {
+  for (size_t i = 0; i < length; i++) {
+    sum1 += data[i];
+    sum2 += sum1;
+  }
+  return static_cast<uint16_t>(((sum1 & 0xff) << 8) | (sum2 & 0xff));
+}
+
+static uint16_t fletcher16Sse2(const uint8_t *data, size_t length) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i weightsLow = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+  const __m128i weightsHigh = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+  __m128i sum1 = zero;     //  byte sums, in the low half of each 64-bit lane
+  __m128i prefix = zero;   //  sum1 before each block
+  __m128i weighted = zero; //  sum((n - j) * x[j]) of each block
+
+  const size_t blocks = length / 16;
+  for (size_t i = 0; i < blocks; i++) {
+    const __m128i x =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16 * i));
+    prefix = _mm_add_epi32(prefix, sum1);
+    sum1 = _mm_add_epi32(sum1, _mm_sad_epu8(x, zero));
+    weighted = _mm_add_epi32(
+        weighted, _mm_madd_epi16(_mm_unpacklo_epi8(x, zero), weightsLow));
+    weighted = _mm_add_epi32(
+        weighted, _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), weightsHigh));
+  }
+  return finish(data + 16 * blocks, length - 16 * blocks, horizontalSum(sum1),
+                16 * horizontalSum(prefix) + horizontalSum(weighted));
+}
+
+__attribute__((target("avx2")))
+static uint16_t fletcher16Avx2(const uint8_t *data, size_t length) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  const __m256i weights = _mm256_setr_epi8(
+      32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+      16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  __m256i sum1 = zero;
+  __m256i prefix = zero;
+  __m256i weighted = zero;
+
+  const size_t blocks = length / 32;
+  for (size_t i = 0; i < blocks; i++) {
+    const __m256i x =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + 32 * i));
+    prefix = _mm256_add_epi32(prefix, sum1);
+    sum1 = _mm256_add_epi32(sum1, _mm256_sad_epu8(x, zero));
+    //  pairs of products fit into 16 bits: 2 * 32 * 255
+    weighted = _mm256_add_epi32(
+        weighted, _mm256_madd_epi16(_mm256_maddubs_epi16(x, weights), ones));
+  }
+  const __m128i s1 = _mm_add_epi32(_mm256_castsi256_si128(sum1),
+                                   _mm256_extracti128_si256(sum1, 1));
+  const __m128i p = _mm_add_epi32(_mm256_castsi256_si128(prefix),
+                                  _mm256_extracti128_si256(prefix, 1));
+  const __m128i w = _mm_add_epi32(_mm256_castsi256_si128(weighted),
+                                  _mm256_extracti128_si256(weighted, 1));
+  return finish(data + 32 * blocks, length - 32 * blocks, horizontalSum(s1),
+                32 * horizontalSum(p) + horizontalSum(w));
+}
+
+#endif
+
+typedef uint16_t (*Fletcher16Function)(const uint8_t *, size_t);
+
+struct Fletcher16Choice {
+  Fletcher16Function function;
+  const char *name;
+};
+
+static Fletcher16Choice chooseFletcher16() {
+  Fletcher16Choice choice = {&fletcher16Scalar, "scalar"};
+#ifdef HAVE_X86_SIMD
+  choice.function = &fletcher16Sse2;
+  choice.name = "sse2";
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    choice.function = &fletcher16Avx2;
+    choice.name = "avx2";
+  }
+#endif
+  return choice;
+}
+
+static const Fletcher16Choice &fletcher16Choice() {
+  static const Fletcher16Choice choice = chooseFletcher16();
+  return choice;
+}
+
+uint16_t imu_3dm_gx4::fletcher16(const uint8_t *data, size_t length) {
+  if (length < kMinVectorLength) {
+    return fletcher16Scalar(data, length);
+  }
+  return fletcher16Choice().function(data, length);
+}
+
+const char *imu_3dm_gx4::fletcher16Implementation() {
+  return fletcher16Choice().name;
+}
+
+size_t imu_3dm_gx4::findFrames(const uint8_t *data, size_t length,
+                               MipFrame *frames, size_t maxFrames,
+                               size_t &scanned) {
+  size_t num = 0;
+  size_t pos = 0;
+  while (num < maxFrames) {
+    const uint8_t *sync = static_cast<const uint8_t *>(
+        memchr(data + pos, kSyncMSB, length - pos));
+    if (!sync) {
+      pos = length;
+      break;
+    }
+    const size_t start = sync - data;
+    if (start + kHeaderSize > length) {
+      pos = start; //  the header is incomplete
+      break;
+    }
+    if (data[start + 1] != kSyncLSB) {
+      pos = start + 1;
+      continue;
+    }
+    const size_t size = kHeaderSize + data[start + 3] + kCheckSize;
+    if (start + size > length) {
+      pos = start; //  may be completed by more data
+      break;
+    }
+    const uint16_t received = static_cast<uint16_t>(
+        (data[start + size - 2] << 8) | data[start + size - 1]);
+    if (fletcher16(data + start, size - kCheckSize) == received) {
+      frames[num].offset = start;
+      frames[num].length = size;
+      num++;
+      pos = start + size;
+    } else {
+      pos = start + 1;
+    }
+  }
+  scanned = pos;
+  return num;
+}
@@ -10,8 +10,10 @@
  */
 
 #include "imu_3dm_gx4/imu.hpp"
+#include "imu_3dm_gx4/checksum.hpp"
 #include <chrono>
 #include <locale>
+#include <cctype>
 #include <tuple>
 #include <algorithm>
 #include <iostream>
@@ -19,8 +21,6 @@
 #include <sstream>
 #include <stdexcept>
 #include <boost/assert.hpp>
-#include <ros/ros.h>
-#include <ros/console.h>
 
 extern "C" {
 #include <fcntl.h>
@@ -30,13 +30,35 @@ extern "C" {
 #include <errno.h>
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
 #include <assert.h>
 #include <unistd.h> //  close
 #include <string.h> //  strerror
 }
 
 #define kDefaultTimeout    (300)
+#define kDefaultRetries    (2)
+#define kTimeoutFloor      (0.01)  //  [s], margin for host scheduling jitter
+#define kTimeoutCeiling    (1.0)   //  [s]
 #define kBufferSize        (10) //  keep this small, or 1000Hz is not attainable
+//  unparsed input: several maximum size packets, so a resync after a bad
+//  checksum never runs out of room
+#define kQueueCapacity     (4 * (Packet::kHeaderLength + 255 + 2))
+#define kHeadingWriteTimeout (5)
+
+//  a device sends a packet without pausing, so a candidate whose input pauses
+//  for longer than this is dropped [ms]
+#define kPartialPacketTimeout (50)
+
+//  queued log records, and how many of one kind are logged per window
+#define kLogCapacity (256)
+#define kLogBurst    (10)
+#define kLogWindow   (1.0)  //  [s]
+
+//  share of the transmit bandwidth available to posted control and background
+//  commands, and how many bytes of them may be written back to back
+#define kCommandLinkShare (0.5)
+#define kCommandBurst (2 * (Packet::kHeaderLength + 255 + 2))
 #define PI (3.141592653)
 
 #define u8(x) static_cast<uint8_t>((x))
@@ -80,7 +102,10 @@ extern "C" {
 #define DATA_3DM_BAROMETER           u8(0x17)
 
 // 3DM Command Reply Fields
+#define REPLY_FIELD_3DM_IMU_MESSAGE_FORMAT   u8(0x80)
+#define REPLY_FIELD_3DM_FILTER_MESSAGE_FORMAT u8(0x82)
 #define REPLY_FIELD_3DM_IMU_BASE_RATE        u8(0x83)
+#define REPLY_FIELD_3DM_DATA_STREAM          u8(0x85)
 #define REPLY_FIELD_3DM_FILTER_BASE_RATE     u8(0x8A)
 #define REPLY_FIELD_3DM_STATUS_REPORT        u8(0x90)
 #define REPLY_FIELD_3DM_LPF_BANDWIDTH        u8(0x8B)
@@ -95,6 +120,7 @@ extern "C" {
 #define COMMAND_FILTER_ENABLE_MEASUREMENTS     u8(0x41)
 #define COMMAND_FILTER_SENSOR_TO_VEHICLE_TF    u8(0x11)
 #define COMMAND_FILTER_HEADING_UPDATE_CONTROL  u8(0x18)
+#define COMMAND_FILTER_EXTERNAL_HEADING        u8(0x17)
 #define COMMAND_FILTER_REFERENCE_POSITION      u8(0x26)
 #define COMMAND_FILTER_DECLINATION_SOURCE      u8(0x43)
 #define COMMAND_FILTER_MAG_ERR_ADAPT_MSMT      u8(0x45)
@@ -129,9 +155,9 @@ using namespace imu_3dm_gx4;
 
 // trim from start
 static inline std::string ltrim(std::string s) {
-  s.erase(s.begin(),
-          std::find_if(s.begin(), s.end(),
-                       std::not1(std::ptr_fun<int, int>(std::isspace))));
+  s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](unsigned char c) {
+    return !std::isspace(c);
+  }));
   return s;
 }
 
@@ -237,28 +263,37 @@ private:
 
 /**
  * @brief Tool for decoding packets by iterating through fields.
+ * @note The lengths come from the device, so every access is checked against
+ * the packet length. Iteration stops at the first field which does not fit,
+ * malformed() tells this apart from the end of the packet. Reading past the
+ * end of a field yields zeros and sets failed().
  */
 class PacketDecoder {
 public:
-  PacketDecoder(const Imu::Packet& p) : p_(p), fs_(0), pos_(2) {
-    assert(p.length > 0);
-  }
+  PacketDecoder(const Imu::Packet& p) : p_(p), fs_(0), pos_(2),
+    failed_(false) {}
 
   int fieldDescriptor() const {
-    if (fs_ > sizeof(p_.payload)-2) {
-      return -1;
-    }
-    if (p_.payload[fs_] == 0) {
+    if (!fieldValid()) {
       return -1;  //  no field
     }
     return p_.payload[fs_ + 1]; //  descriptor after length
   }
 
   int fieldLength() const {
-    assert(fs_ < sizeof(p_.payload));
-    return p_.payload[fs_];
+    return fieldValid() ? p_.payload[fs_] : 0;
+  }
+
+  //  bytes left which do not form a complete field
+  bool malformed() const {
+    return fs_ < p_.length && !fieldValid();
   }
 
+  //  an extract() ran past the end of its field
+  bool failed() const { return failed_; }
+
+  size_t fieldStart() const { return fs_; }
+
   bool fieldIsAckOrNack() const {
     const int desc = fieldDescriptor();
     if (desc == static_cast<int>(FIELD_ACK_OR_NACK)) {
@@ -277,23 +312,62 @@ public:
   }
 
   void advance() {
-    fs_ += p_.payload[fs_];
+    if (fieldValid()) {
+      fs_ += p_.payload[fs_];
+    } else {
+      fs_ = p_.length; //  nothing more to read
+    }
     pos_ = 2;  //  skip length and descriptor
   }
 
   template <typename T>
   void extract(size_t count, T* output) {
-    BOOST_VERIFY(fs_ + pos_ + sizeof(T) * count <= sizeof(p_.payload));
+    if (pos_ + sizeof(T) * count > static_cast<size_t>(fieldLength())) {
+      std::fill(output, output + count, T());
+      failed_ = true;
+      return;
+    }
     decode(&p_.payload[fs_ + pos_], count, output);
     pos_ += sizeof(T) * count;
   }
 
 private:
+  //  at least length and descriptor, and within the packet
+  bool fieldValid() const {
+    if (fs_ + 2 > p_.length) {
+      return false;
+    }
+    const size_t length = p_.payload[fs_];
+    return length >= 2 && fs_ + length <= p_.length;
+  }
+
   const Imu::Packet& p_;
-  uint8_t fs_;
-  uint8_t pos_;
+  size_t fs_;
+  size_t pos_;
+  bool failed_;
 };
 
+//  decodes the status report field the decoder is at
+static void decodeStatusReport(PacketDecoder &decoder,
+                               Imu::DiagnosticFields &fields) {
+  //  the fields are packed, decode into aligned values and copy them over
+  uint16_t modelNumber;
+  uint8_t selector;
+  uint32_t status[4];  //  statusFlags to last1PPSPulse
+  uint8_t streams[2];  //  imuStreamEnabled, filterStreamEnabled
+  uint32_t counts[13]; //  imuPacketsDropped to lastIMUMessage
+  decoder.extract(1, &modelNumber);
+  decoder.extract(1, &selector);
+  decoder.extract(4, &status[0]);
+  decoder.extract(2, &streams[0]);
+  decoder.extract(13, &counts[0]);
+  fields.modelNumber = modelNumber;
+  fields.selector = selector;
+  memcpy(&fields.statusFlags, status, sizeof(status));
+  memcpy(&fields.imuStreamEnabled, streams, sizeof(streams));
+  memcpy(&fields.imuPacketsDropped, counts, sizeof(counts));
+}
+
 bool Imu::Packet::isIMUData() const {
   return descriptor == DATA_CLASS_IMU;
 }
@@ -314,7 +388,7 @@ int Imu::Packet::ackErrorCodeFor(const Packet &command) const {
 
   //  look for a matching ACK
   for (int d; (d = decoder.fieldDescriptor()) > 0; decoder.advance()) {
-    if (decoder.fieldIsAckOrNack()) {
+    if (decoder.fieldIsAckOrNack() && decoder.fieldLength() >= 4) {
       uint8_t cmd, code;
       decoder.extract(1, &cmd);
       decoder.extract(1, &code);
@@ -329,23 +403,8 @@ int Imu::Packet::ackErrorCodeFor(const Packet &command) const {
 }
 
 void Imu::Packet::calcChecksum() {
-  uint8_t byte1 = 0, byte2 = 0;
-
-#define add_byte(x)  \
-  byte1 += (x);      \
-  byte2 += byte1;
-
-  add_byte(syncMSB);
-  add_byte(syncLSB);
-  add_byte(descriptor);
-  add_byte(length);
-
-  for (size_t i = 0; i < length; i++) {
-    add_byte(payload[i]);
-  }
-#undef add_byte
-
-  checksum = (static_cast<uint16_t>(byte1) << 8) + static_cast<uint16_t>(byte2);
+  //  the struct is packed, so header and payload are contiguous
+  checksum = fletcher16(&syncMSB, kHeaderLength + length);
 #ifdef HOST_LITTLE_ENDIAN
   uint8_t temp = checkLSB;
   checkLSB = checkMSB;
@@ -386,29 +445,34 @@ std::map <std::string, std::string> Imu::Info::toMap() const {
   return map;
 }
 
+const char *const Imu::DiagnosticFields::kNames[kNumValues] = {
+  "Model number", "Selector", "Status flags", "System timer",
+  "Num 1PPS Pulses", "Last 1PPS Pulse", "Imu stream enabled",
+  "Filter stream enabled", "Imu packets dropped", "Filter packets dropped",
+  "Com bytes written", "Com bytes read", "Com num write overruns",
+  "Com num read overruns", "Usb bytes written", "Usb bytes read",
+  "Usb num write overruns", "Usb num read overruns", "Num imu parse errors",
+  "Total imu messages", "Last imu message"
+};
+
+void Imu::DiagnosticFields::values(unsigned int (&output)[kNumValues]) const {
+  const unsigned int v[kNumValues] = {
+    modelNumber, selector, statusFlags, systemTimer, num1PPSPulses,
+    last1PPSPulse, imuStreamEnabled, filterStreamEnabled, imuPacketsDropped,
+    filterPacketsDropped, comBytesWritten, comBytesRead, comNumWriteOverruns,
+    comNumReadOverruns, usbBytesWritten, usbBytesRead, usbNumWriteOverruns,
+    usbNumReadOverruns, numIMUParseErrors, totalIMUMessages, lastIMUMessage
+  };
+  memcpy(output, v, sizeof(v));
+}
+
 std::map <std::string, unsigned int> Imu::DiagnosticFields::toMap() const {
+  unsigned int v[kNumValues];
+  values(v);
   std::map<std::string, unsigned int> map;
-  map["Model number"] = modelNumber;
-  map["Selector"] = selector;
-  map["Status flags"] = statusFlags;
-  map["System timer"] = systemTimer;
-  map["Num 1PPS Pulses"] = num1PPSPulses;
-  map["Last 1PPS Pulse"] = last1PPSPulse;
-  map["Imu stream enabled"] = imuStreamEnabled;
-  map["Filter stream enabled"] = filterStreamEnabled;
-  map["Imu packets dropped"] = imuPacketsDropped;
-  map["Filter packets dropped"] = filterPacketsDropped;
-  map["Com bytes written"] = comBytesWritten;
-  map["Com bytes read"] = comBytesRead;
-  map["Com num write overruns"] = comNumReadOverruns;
-  map["Com num read overruns"] = comNumReadOverruns;
-  map["Usb bytes written"] = usbBytesWritten;
-  map["Usb bytes read"] = usbBytesRead;
-  map["Usb num write overruns"] = usbNumWriteOverruns;
-  map["Usb num read overruns"] = usbNumReadOverruns;
-  map["Num imu parse errors"] = numIMUParseErrors;
-  map["Total imu messages"] = totalIMUMessages;
-  map["Last imu message"] = lastIMUMessage;
+  for (size_t i = 0; i < kNumValues; i++) {
+    map[kNames[i]] = v[i];
+  }
   return map;
 }
 
@@ -434,15 +498,33 @@ std::string Imu::timeout_error::generateString(bool write,
 }
 
 Imu::Imu(const std::string &device, bool verbose) : device_(device), verbose_(verbose),
+  log_(kLogCapacity, kLogBurst, kLogWindow),
   fd_(0),
   rwTimeout_(kDefaultTimeout),
-  srcIndex_(0), dstIndex_(0),
-  state_(Idle) {
+  rtt_(kTimeoutFloor, kTimeoutCeiling, kDefaultTimeout * 1e-3),
+  retries_(kDefaultRetries), baud_(0), imuBaseRate_(0), filterBaseRate_(0),
+  queueStart_(0), queueEnd_(0), pendingSize_(0),
+  scheduler_(115200 / 10 * kCommandLinkShare, kCommandBurst),
+  numSubmitted_(0), runningPosted_(false), txReady_(false),
+  diagnosticSeq_(0) {
   //  buffer for storing reads
   buffer_.resize(kBufferSize);
+  queue_.resize(kQueueCapacity);
+  memset(&headingStats_, 0, sizeof(headingStats_));
+  memset(&diagnostic_.fields, 0, sizeof(diagnostic_.fields));
+  memset(&diagnostic_.link, 0, sizeof(diagnostic_.link));
+  diagnostic_.reports = 0;
+
+  submitFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (submitFd_ < 0) {
+    throw io_error(strerror(errno));
+  }
 }
 
-Imu::~Imu() { disconnect(); }
+Imu::~Imu() {
+  disconnect();
+  close(submitFd_);
+}
 
 void Imu::connect() {
   if (fd_ > 0) {
@@ -531,12 +613,59 @@ void Imu::connect() {
 void Imu::disconnect() {
   if (fd_ > 0) {
     //  send the idle command first
-    idle(false);  //  we don't care about reply here
+    try {
+      idle(false);  //  we don't care about reply here
+    } catch (io_error&) {
+      //  device is gone already
+    } catch (timeout_error&) {
+    }
     close(fd_);
   }
   fd_ = 0;
 }
 
+bool Imu::reconnect(bool probeBaudRates) {
+  //  the old descriptor is dead, close it without sending idle
+  if (fd_ > 0) {
+    close(fd_);
+  }
+  fd_ = 0;
+  queueStart_ = queueEnd_ = 0;
+  pendingSize_ = 0;
+  txReady_ = false;
+
+  //  opening by path follows a udev symlink to the new device node
+  connect();
+
+  //  the device keeps its baud rate unless it was power cycled, so try the
+  //  cached rate before probing all of them
+  bool reached = false;
+  if (baud_ != 0) {
+    if (!termiosBaudRate(baud_)) {
+      throw io_error(strerror(errno));
+    }
+    reached = tryPing();
+    txReady_ = reached;
+  }
+  if (!reached) {
+    if (!probeBaudRates) {
+      return false;
+    }
+    selectBaudRate(baud_ ? baud_ : 115200);
+  }
+  idle();
+
+  //  replay the configuration, then check that it was applied
+  for (const Packet &p : configCache_) {
+    sendCommand(p);
+  }
+  for (const Packet &p : configCache_) {
+    verifyCommand(p);
+  }
+  resume();
+  return true;
+}
+
 bool Imu::termiosBaudRate(unsigned int baud) {
   struct termios toptions;
   if (tcgetattr(fd_, &toptions) < 0) {
@@ -581,11 +710,186 @@ bool Imu::termiosBaudRate(unsigned int baud) {
 }
 
 void Imu::runOnce() {
-  int sig = pollInput(5);
-  if (sig < 0) {
-    //  failure in poll/read, device disconnected
+  runOnce(callbacks_);
+}
+
+void Imu::readInput() {
+  readInput(callbacks_);
+}
+
+bool Imu::inputReady() {
+  //  with VMIN = 0 a tty returns 0 instead of EAGAIN once it is drained, so
+  //  a hang-up is detected by poll() rather than by end-of-file
+  struct pollfd p;
+  p.fd = fd_;
+  p.events = POLLIN;
+  if (poll(&p, 1, 0) < 0) {
+    if (errno == EINTR) {
+      return false;
+    }
     throw io_error(strerror(errno));
   }
+  if (p.revents & (POLLHUP | POLLERR | POLLNVAL)) {
+    throw io_error("Device disconnected");
+  }
+  return p.revents & POLLIN; //  otherwise woken up for posted calls only
+}
+
+size_t Imu::readAvailable() {
+  const ssize_t amt = ::read(fd_, &buffer_[0], buffer_.size());
+  if (amt > 0) {
+    return amt;
+  } else if (amt == 0 || errno == EAGAIN || errno == EINTR) {
+    return 0; //  nothing left to read
+  }
+  throw io_error(strerror(errno));
+}
+
+std::future<void> Imu::post(const std::function<void(Imu &)> &command,
+                            TxScheduler::Priority priority, uint32_t key) {
+  TxScheduler::Item item;
+  item.priority = priority;
+  item.key = key;
+  item.run = std::bind(command, std::ref(*this));
+  return submit(std::move(item));
+}
+
+std::future<void> Imu::submit(TxScheduler::Item &&item) {
+  const TxScheduler::Priority priority = item.priority;
+  std::future<void> future;
+  if (priority != TxScheduler::Aiding) {
+    item.done.resize(1);
+    future = item.done[0].get_future();
+  }
+  item.queued = TxScheduler::Clock::now();
+
+  //  every submission signals the eventfd, and the owner drains it under the
+  //  same lock before taking items, so a wakeup is never lost
+  std::lock_guard<std::mutex> lock(submitMutex_);
+  const uint64_t one = 1;
+  if (::write(submitFd_, &one, sizeof(one)) < 0) {
+    throw io_error(strerror(errno));
+  }
+  if (scheduler_.push(std::move(item)) && priority == TxScheduler::Aiding) {
+    headingStats_.coalesced++;
+  }
+  numSubmitted_.store(scheduler_.size(), std::memory_order_release);
+  return future;
+}
+
+void Imu::runPosted() {
+  //  the streaming path only pays for an atomic load
+  if (numSubmitted_.load(std::memory_order_acquire) == 0 || runningPosted_) {
+    return; //  nothing posted, or called from within a posted call
+  }
+  {
+    std::lock_guard<std::mutex> lock(submitMutex_);
+    uint64_t count;
+    if (::read(submitFd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+      throw io_error(strerror(errno));
+    }
+  }
+  runningPosted_ = true;
+  try {
+    runScheduled(TxScheduler::Background);
+  }
+  catch (...) {
+    runningPosted_ = false;
+    throw;
+  }
+  runningPosted_ = false;
+}
+
+void Imu::runScheduled(TxScheduler::Priority maxPriority) {
+  for (;;) {
+    TxScheduler::Item item;
+    {
+      std::lock_guard<std::mutex> lock(submitMutex_);
+      if (!scheduler_.pop(TxScheduler::Clock::now(), item, maxPriority)) {
+        return; //  empty, or the rest is held back by the pacing
+      }
+      numSubmitted_.store(scheduler_.size(), std::memory_order_release);
+    }
+
+    std::exception_ptr error;
+    try {
+      item.run();
+    }
+    catch (...) {
+      error = std::current_exception();
+    }
+    if (item.done.empty()) {
+      //  nobody waits for aiding input, errors go to the owner
+      if (error) {
+        std::rethrow_exception(error);
+      }
+      continue;
+    }
+    for (std::promise<void> &done : item.done) {
+      if (error) {
+        done.set_exception(error);
+      } else {
+        done.set_value();
+      }
+    }
+  }
+}
+
+TxScheduler::Stats Imu::txStats(TxScheduler::Priority priority) {
+  std::lock_guard<std::mutex> lock(submitMutex_);
+  return scheduler_.stats(priority);
+}
+
+void Imu::setExternalHeading(float heading, float uncertainty, bool magnetic) {
+  Packet p(COMMAND_CLASS_FILTER);
+  PacketEncoder encoder(p);
+  encoder.beginField(COMMAND_FILTER_EXTERNAL_HEADING);
+  encoder.append(heading, uncertainty, u8(magnetic ? 0x02 : 0x01));
+  encoder.endField();
+  p.calcChecksum();
+  const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+
+  //  a newer update replaces one which was not sent yet
+  TxScheduler::Item item;
+  item.priority = TxScheduler::Aiding;
+  item.key = commandKey(p);
+  item.run = [this, p, now]() { sendExternalHeading(p, now); };
+  {
+    std::lock_guard<std::mutex> lock(submitMutex_);
+    headingStats_.queued++;
+  }
+  submit(std::move(item));
+}
+
+Imu::HeadingStats Imu::externalHeadingStats() {
+  std::lock_guard<std::mutex> lock(submitMutex_);
+  return headingStats_;
+}
+
+void Imu::sendExternalHeading(
+    const Packet &p, const std::chrono::steady_clock::time_point &queued) {
+  if (verbose_) {
+    logPacket(LogRing::Info, "Sending external heading", p);
+  }
+  //  the ACK is not awaited, a NACK is counted when it is read
+  const int wrote = writePacket(p, kHeadingWriteTimeout);
+  if (wrote < 0) {
+    throw io_error(strerror(errno));
+  }
+  const double latency = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - queued).count();
+
+  std::lock_guard<std::mutex> lock(submitMutex_);
+  if (wrote == 0) {
+    headingStats_.dropped++;
+    return;
+  }
+  headingStats_.sent++;
+  headingStats_.lastLatency = latency;
+  headingStats_.meanLatency +=
+      (latency - headingStats_.meanLatency) / headingStats_.sent;
+  headingStats_.maxLatency = std::max(headingStats_.maxLatency, latency);
 }
 
 void Imu::selectBaudRate(unsigned int baud) {
@@ -610,39 +914,47 @@ void Imu::selectBaudRate(unsigned int baud) {
   }
   pp.calcChecksum();
 
+  //  the device is usually still on the rate selected by a previous run, try
+  //  that one before probing the others
+  std::rotate(rates, std::find(rates, rates + num_rates, baud),
+              rates + num_rates);
+
+  //  round-trip times measured at another baud rate do not apply
+  rtt_.reset();
+
   size_t i;
   bool foundRate = false;
   for (i = 0; i < num_rates; i++) {
     if (verbose_){
-      std::cout << "Switching to baud rate " << rates[i] << std::endl;
+      log_.log(LogRing::Info, "Switching to baud rate %u", rates[i]);
     }
     if (!termiosBaudRate(rates[i])) {
       throw io_error(strerror(errno));
     }
 
     if (verbose_) {
-      std::cout << "Switched baud rate to " << rates[i] << std::endl;
-      std::cout << "Sending a ping packet.\n" << std::flush;
+      log_.log(LogRing::Info, "Switched baud rate to %u", rates[i]);
+      log_.log(LogRing::Info, "Sending a ping packet.");
     }
 
     //  send ping and wait for first response
     sendPacket(pp, 100);
     try {
-      receiveResponse(pp, 500);
+      receiveResponse(pp, rtt_.timeout(commandType(pp)));
     } catch (timeout_error&) {
       if (verbose_) {
-        std::cout << "Timed out waiting for ping response.\n" << std::flush;
+        log_.log(LogRing::Info, "Timed out waiting for ping response.");
       }
       continue;
     } catch (command_error&) {
       if (verbose_) {
-        std::cout << "IMU returned error code for ping.\n" << std::flush;
+        log_.log(LogRing::Info, "IMU returned error code for ping.");
       }
       continue;
     } //  do not catch io_error
 
     if (verbose_) {
-      std::cout << "Found correct baudrate.\n" << std::flush;
+      log_.log(LogRing::Info, "Found correct baudrate.");
     }
 
     //  no error in receiveResponse, this is correct baud rate
@@ -668,8 +980,7 @@ void Imu::selectBaudRate(unsigned int baud) {
 
   try {
     if (verbose_) {
-      std::cout << "Instructing device to change to " << baud << std::endl
-                << std::flush;
+      log_.log(LogRing::Info, "Instructing device to change to %u", baud);
     }
     sendCommand(comm);
   } catch (std::exception& e) {
@@ -683,6 +994,7 @@ void Imu::selectBaudRate(unsigned int baud) {
   if (!termiosBaudRate(baud)) {
     throw io_error(strerror(errno));
   }
+  rtt_.reset();
 
   //  ping
   try {
@@ -692,6 +1004,10 @@ void Imu::selectBaudRate(unsigned int baud) {
     err += e.what();
     throw std::runtime_error(err);
   }
+  baud_ = baud;
+  txReady_ = true;
+  std::lock_guard<std::mutex> lock(submitMutex_);
+  scheduler_.setRate(baud / 10 * kCommandLinkShare, kCommandBurst);
 }
 
 void Imu::ping() {
@@ -712,6 +1028,7 @@ void Imu::idle(bool needReply) {
   p.calcChecksum();
   assert(p.checkMSB == 0xE1 && p.checkLSB == 0xC7);
   sendCommand(p, needReply);
+  link_.restart();
 }
 
 void Imu::resume() {
@@ -722,6 +1039,7 @@ void Imu::resume() {
   p.calcChecksum();
   assert(p.checkMSB == 0xE5 && p.checkLSB == 0xCB);
   sendCommand(p);
+  link_.restart();
 }
 
 void Imu::getDeviceInfo(Imu::Info &info) {
@@ -766,6 +1084,7 @@ void Imu::getIMUDataBaseRate(uint16_t &baseRate) {
     BOOST_VERIFY(decoder.advanceTo(REPLY_FIELD_3DM_IMU_BASE_RATE));
     decoder.extract(1, &baseRate);
   }
+  imuBaseRate_ = baseRate;
 }
 
 void Imu::getFilterDataBaseRate(uint16_t &baseRate) {
@@ -784,6 +1103,7 @@ void Imu::getFilterDataBaseRate(uint16_t &baseRate) {
     BOOST_VERIFY(decoder.advanceTo(REPLY_FIELD_3DM_FILTER_BASE_RATE));
     decoder.extract(1, &baseRate);
   }
+  filterBaseRate_ = baseRate;
 }
 
 void Imu::getDiagnosticInfo(Imu::DiagnosticFields &fields) {
@@ -799,15 +1119,60 @@ void Imu::getDiagnosticInfo(Imu::DiagnosticFields &fields) {
   {
     PacketDecoder decoder(packet_);
     BOOST_VERIFY(decoder.advanceTo(REPLY_FIELD_3DM_STATUS_REPORT));
+    decodeStatusReport(decoder, fields);
+  }
+}
+
+void Imu::requestDiagnosticInfo() {
+  Packet p(COMMAND_CLASS_3DM);
+  PacketEncoder encoder(p);
+  encoder.beginField(COMMAND_3DM_DEVICE_STATUS);
+  encoder.append(static_cast<uint16_t>(6234));  //  device model number
+  encoder.append(u8(0x02)); //  diagnostic mode
+  encoder.endField();
+  p.calcChecksum();
 
-    decoder.extract(1, &fields.modelNumber);
-    decoder.extract(1, &fields.selector);
-    decoder.extract(4, &fields.statusFlags);
-    decoder.extract(2, &fields.imuStreamEnabled);
-    decoder.extract(13, &fields.imuPacketsDropped);
+  //  the reply is picked up by processPacket
+  TxScheduler::Item item;
+  item.priority = TxScheduler::Background;
+  item.key = commandKey(p);
+  item.run = [this, p]() {
+    if (writePacket(p, rwTimeout_) < 0) {
+      throw io_error(strerror(errno));
+    }
+  };
+  submit(std::move(item));
+}
+
+Imu::DiagnosticSnapshot Imu::diagnosticSnapshot() const {
+  DiagnosticSnapshot snapshot;
+  for (;;) {
+    const uint32_t seq = diagnosticSeq_.load(std::memory_order_acquire);
+    if (seq & 1) {
+      continue; //  being written, try again
+    }
+    memcpy(&snapshot, &diagnostic_, sizeof(snapshot));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (diagnosticSeq_.load(std::memory_order_relaxed) == seq) {
+      return snapshot;
+    }
   }
 }
 
+void Imu::storeDiagnosticInfo(const DiagnosticFields &fields) {
+  const LinkMonitor::Counters link = link_.counters();
+  const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+  const uint32_t seq = diagnosticSeq_.load(std::memory_order_relaxed);
+  diagnosticSeq_.store(seq + 1, std::memory_order_relaxed); //  odd = writing
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(&diagnostic_.fields, &fields, sizeof(fields));
+  diagnostic_.link = link;
+  diagnostic_.received = now;
+  diagnostic_.reports++;
+  diagnosticSeq_.store(seq + 2, std::memory_order_release);
+}
+
 void Imu::setIMUDataRate(uint16_t decimation,
                         const std::bitset<4> &sources) {
   Imu::Packet p(COMMAND_CLASS_3DM);  //  was 0x04
@@ -835,7 +1200,11 @@ void Imu::setIMUDataRate(uint16_t decimation,
 
   encoder.endField();
   p.calcChecksum();
-  sendCommand(p);
+  applyCommand(p);
+  if (imuBaseRate_ && decimation) {
+    link_.setPeriod(LinkMonitor::ImuStream,
+                    decimation / static_cast<double>(imuBaseRate_));
+  }
 }
 
 void Imu::setFilterDataRate(uint16_t decimation, const std::bitset<8> &sources) {
@@ -867,7 +1236,42 @@ void Imu::setFilterDataRate(uint16_t decimation, const std::bitset<8> &sources)
   }
   encoder.endField();
   p.calcChecksum();
-  sendCommand(p);
+  applyCommand(p);
+  if (filterBaseRate_ && decimation) {
+    link_.setPeriod(LinkMonitor::FilterStream,
+                    decimation / static_cast<double>(filterBaseRate_));
+  }
+}
+
+size_t Imu::imuPacketSize(const std::bitset<4> &sources) {
+  //  field length and descriptor, then the data decoded in processPacket:
+  //  accel, gyro, mag (3 floats each), pressure (1 float)
+  static const size_t fieldSizes[] = { 2 + 12, 2 + 12, 2 + 12, 2 + 4 };
+  static_assert(sizeof(fieldSizes) / sizeof(fieldSizes[0]) == 4,
+                "one size per IMU source");
+  size_t size = 0;
+  for (size_t i = 0; i < sources.size(); i++) {
+    if (sources[i]) {
+      size += fieldSizes[i];
+    }
+  }
+  return size ? Packet::kHeaderLength + size + 2 : 0;
+}
+
+size_t Imu::filterPacketSize(const std::bitset<8> &sources) {
+  //  same order as setFilterDataRate: quaternion (4 floats), heading update
+  //  (2 floats, 2 flags), the others 3 floats, each with a status word
+  static const size_t fieldSizes[] = { 2 + 18, 2 + 14, 2 + 12, 2 + 14,
+                                       2 + 14, 2 + 14, 2 + 14, 2 + 14 };
+  static_assert(sizeof(fieldSizes) / sizeof(fieldSizes[0]) == 8,
+                "one size per filter source");
+  size_t size = 0;
+  for (size_t i = 0; i < sources.size(); i++) {
+    if (sources[i]) {
+      size += fieldSizes[i];
+    }
+  }
+  return size ? Packet::kHeaderLength + size + 2 : 0;
 }
 
 void Imu::enableMeasurements(bool accel, bool magnetometer) {
@@ -884,7 +1288,7 @@ void Imu::enableMeasurements(bool accel, bool magnetometer) {
   encoder.append(COMMAND_FUNCTION_APPLY, flag);
   encoder.endField();
   p.calcChecksum();
-  sendCommand(p);
+  applyCommand(p);
 }
 
 void Imu::enableBiasEstimation(bool enabled) {
@@ -898,7 +1302,7 @@ void Imu::enableBiasEstimation(bool enabled) {
   encoder.append(COMMAND_FUNCTION_APPLY, flag);
   encoder.endField();
   p.calcChecksum();
-  sendCommand(p);
+  applyCommand(p);
 }
 
 void Imu::setHardIronOffset(float offset[3]) {
@@ -909,7 +1313,7 @@ void Imu::setHardIronOffset(float offset[3]) {
   encoder.endField();
   assert(p.length == 0x0F);
   p.calcChecksum();
-  sendCommand(p);
+  applyCommand(p);
 
   saveCurrentSettings(COMMAND_CLASS_3DM, COMMAND_3DM_SET_HARD_IRON);
 }
@@ -925,7 +1329,7 @@ void Imu::setSoftIronMatrix(float matrix[9]) {
   encoder.endField();
   assert(p.length == 0x27);
   p.calcChecksum();
-  sendCommand(p);
+  applyCommand(p);
 
   saveCurrentSettings(COMMAND_CLASS_3DM, COMMAND_3DM_SET_SOFT_IRON);
 }
@@ -941,7 +1345,7 @@ void Imu::enableIMUStream(bool enabled) {
   if (enabled) {
     assert(p.checkMSB == 0x04 && p.checkLSB == 0x1A);
   }
-  sendCommand(p);
+  applyCommand(p);
 }
 
 void Imu::enableFilterStream(bool enabled) {
@@ -955,16 +1359,21 @@ void Imu::enableFilterStream(bool enabled) {
   if (enabled) {
     assert(p.checkMSB == 0x06 && p.checkLSB == 0x1E);
   }
-  sendCommand(p);
+  applyCommand(p);
 }
 
 void Imu::setIMUDataCallback(const std::function<void(const Imu::IMUData &)> &cb) {
-  imuDataCallback_ = cb;
+  callbacks_.imuData = cb;
 }
 
 void Imu::setFilterDataCallback(
     const std::function<void(const Imu::FilterData &)> &cb) {
-  filterDataCallback_ = cb;
+  callbacks_.filterData = cb;
+}
+
+void Imu::setPacketCallback(
+    const std::function<void(const Imu::Packet &)> &cb) {
+  callbacks_.packet = cb;
 }
 
 void Imu::saveCurrentSettings(uint8_t command, uint8_t field) {
@@ -984,7 +1393,7 @@ void Imu::setSensorToVehicleTF(float roll1, float pitch1, float yaw1) {
   encoder.append(COMMAND_FUNCTION_APPLY, roll1, pitch1, yaw1);
   encoder.endField();
   p.calcChecksum();
-  sendCommand(p);
+  applyCommand(p);
 
   saveCurrentSettings(COMMAND_CLASS_FILTER, COMMAND_FILTER_SENSOR_TO_VEHICLE_TF);
 }
@@ -1031,7 +1440,7 @@ void Imu::setHeadingUpdateSource(std::string headingSource1) {
   encoder.append(COMMAND_FUNCTION_APPLY, flag);
   encoder.endField();
   p.calcChecksum();
-  sendCommand(p);
+  applyCommand(p);
 
   saveCurrentSettings(COMMAND_CLASS_FILTER, COMMAND_FILTER_HEADING_UPDATE_CONTROL);
 }
@@ -1077,7 +1486,7 @@ void Imu::setReferencePosition(double latitude1, double longitude1, double altit
   encoder.append(latitude1, longitude1, altitude1);
   encoder.endField();
   p.calcChecksum();
-  sendCommand(p);
+  applyCommand(p);
 
   saveCurrentSettings(COMMAND_CLASS_FILTER, COMMAND_FILTER_REFERENCE_POSITION);
 }
@@ -1132,7 +1541,7 @@ void Imu::setDeclinationSource(std::string declinationSource1, double manualDecl
 
   encoder.endField();
   p.calcChecksum();
-  sendCommand(p);
+  applyCommand(p);
 
   saveCurrentSettings(COMMAND_CLASS_FILTER, COMMAND_FILTER_DECLINATION_SOURCE);
 }
@@ -1225,7 +1634,7 @@ void Imu::setLPFBandwidth(std::string dataType, std::string filterType,
   encoder.append(COMMAND_FUNCTION_APPLY, descriptor, type, cfg, LPFBandwidth, reserved);
   encoder.endField();
   p.calcChecksum();
-  sendCommand(p);
+  applyCommand(p);
 
   //saveCurrentSettings(COMMAND_CLASS_3DM, COMMAND_3DM_SET_LPF_BANDWIDTH);
 }
@@ -1300,130 +1709,130 @@ int Imu::pollInput(unsigned int to) {
   return -1;
 }
 
-/**
- * @note handleByte will interpret a single byte. It will return the number
- *  of bytes which can be cleared from the queue. On early failure, this will
- *  always be 1 - ie. kSyncMSB should be cleared from the queue. On success, the
- *  total length of the valid packet should be cleared.
- */
-std::size_t Imu::handleByte(const uint8_t& byte, bool& found) {
-  found = false;
-  if (state_ == Idle) {
-    //  reset dstIndex_ to start of packet
-    dstIndex_ = 0;
-    if (byte == Imu::Packet::kSyncMSB) {
-      packet_.syncMSB = byte;
-      state_ = Reading;
-      //  clear previous packet out
-      memset(&packet_.payload[0], 0, sizeof(packet_.payload));
-    } else {
-      //  byte is no good, stay in idle
-      return 1;
+//  parses packets out of the input buffer
+int Imu::handleRead(size_t bytes_transferred) {
+  bool paused = false;
+  if (bytes_transferred) {
+    const LinkMonitor::Clock::time_point now = LinkMonitor::Clock::now();
+    paused = now - readStamp_ >
+        std::chrono::milliseconds(kPartialPacketTimeout);
+    readStamp_ = now;
+    link_.countBytes(bytes_transferred);
+  }
+
+  if (verbose_ && bytes_transferred) {
+    log_.dump(LogRing::Info, "Handling read", &buffer_[0], bytes_transferred);
+  }
+
+  //  read data into queue, moving the unparsed bytes to the front if needed
+  if (bytes_transferred && queueEnd_ + bytes_transferred > queue_.size()) {
+    memmove(&queue_[0], &queue_[queueStart_], queueEnd_ - queueStart_);
+    queueEnd_ -= queueStart_;
+    queueStart_ = 0;
+    if (queueEnd_ + bytes_transferred > queue_.size()) {
+      //  unreachable unless reads outpace parsing, start over
+      link_.countResync(queueEnd_);
+      queueEnd_ = 0;
+      pendingSize_ = 0;
     }
   }
-  else if (state_ == Reading) {
-    const size_t end = Packet::kHeaderLength + packet_.length;
-    //  fill out fields of packet structure
-    if (dstIndex_ == 1) {
-      if (byte != Imu::Packet::kSyncLSB) {
-        //  not a true header, throw away and go back to idle
-        state_ = Idle;
-        return 1;
+  if (bytes_transferred) {
+    memcpy(&queue_[queueEnd_], &buffer_[0], bytes_transferred);
+    queueEnd_ += bytes_transferred;
+  }
+
+  //  the candidate at the front is only looked at again once all of it arrived
+  if (pendingSize_) {
+    if (queueEnd_ - queueStart_ < pendingSize_) {
+      if (!paused) {
+        return false;
       }
-      packet_.syncLSB = byte;
+      log_.log(LogRing::Warn, "Dropped incomplete packet of %u bytes after "
+               "the input paused", static_cast<unsigned int>(pendingSize_));
+      link_.countResync(1);
+      queueStart_++;
     }
-    else if (dstIndex_ == 2) {
-      packet_.descriptor = byte;
+    pendingSize_ = 0;
+  }
+
+  //  Every byte is looked at once while searching for a sync byte, and a
+  //  candidate which fails is dropped by one byte only, so a packet which
+  //  starts within it is still found. Cost is linear in the garbage.
+  bool found = false;
+  while (queueStart_ < queueEnd_) {
+    const uint8_t *head = &queue_[queueStart_];
+    const size_t available = queueEnd_ - queueStart_;
+
+    const uint8_t *sync = static_cast<const uint8_t *>(
+        memchr(head, Packet::kSyncMSB, available));
+    if (sync != head) {
+      const size_t skip = sync ? static_cast<size_t>(sync - head) : available;
+      link_.countResync(skip);
+      queueStart_ += skip;
+      continue;
     }
-    else if (dstIndex_ == 3) {
-      packet_.length = byte;
+    if (available < 2) {
+      break;
     }
-    else if (dstIndex_ < end) {
-      packet_.payload[dstIndex_ - Packet::kHeaderLength] = byte;
+    if (head[1] != Packet::kSyncLSB) {
+      //  not a true header
+      link_.countResync(1);
+      queueStart_++;
+      continue;
     }
-    else if (dstIndex_ == end) {
-      packet_.checkMSB = byte;
+    if (available < Packet::kHeaderLength) {
+      break;
     }
-    else if (dstIndex_ == end + 1) {
-      state_ = Idle; //  finished packet
-      packet_.checkLSB = byte;
-
-      //  check checksum
-      const uint16_t sum = packet_.checksum;
-      packet_.calcChecksum();
-
-      if (sum != packet_.checksum) {
-        //  invalid, go back to waiting for a marker in the stream
-        std::cout << "Warning: Dropped packet with mismatched checksum\n"
-                  << std::flush;
-        if (verbose_) {
-          std::cout << "Expected " << std::hex <<
-                       static_cast<int>(packet_.checksum) << " but received " <<
-                       static_cast<int>(sum) << std::endl;
-          std::cout << "Packet content:\n" << packet_.toString() << std::endl;
-          std::cout << "Queue content: \n";
-          for (const uint8_t& q : queue_) {
-            std::cout << static_cast<int>(q) << " ";
-          }
-          std::cout << "\n" << std::flush;
-        }
-        return 1;
-      } else {
-        //  successfully read a packet
-        processPacket();
-        found = true;
-        return end+2;
-      }
+
+    const size_t size = Packet::kHeaderLength + head[3] + 2;
+    if (available < size) {
+      //  wait for the rest, only the checksum tells a packet from garbage
+      pendingSize_ = size;
+      break;
     }
-  }
 
-  //  advance to next byte in packet
-  dstIndex_++;
-  return 0;
-}
+    const uint16_t received =
+        static_cast<uint16_t>((head[size - 2] << 8) | head[size - 1]);
+    const uint16_t sum = fletcher16(head, size - 2);
+    if (sum != received) {
+      //  invalid, go back to waiting for a marker in the stream
+      link_.countChecksumError();
+      log_.log(LogRing::Warn, "Dropped packet with mismatched checksum "
+               "(expected %04x, received %04x)", sum, received);
+      if (verbose_) {
+        log_.dump(LogRing::Info, "Queue content", head, available);
+      }
+      link_.countResync(1);
+      queueStart_++;
+      continue;
+    }
 
-//  parses packets out of the input buffer
-int Imu::handleRead(size_t bytes_transferred) {
-  //  read data into queue
-  std::stringstream ss;
-  ss << "Handling read : " << std::hex;
-  for (size_t i = 0; i < bytes_transferred; i++) {
-    queue_.push_back(buffer_[i]);
-    ss << static_cast<int>(buffer_[i]) << " ";
-  }
-  ss << std::endl;
-  if (verbose_) {
-    std::cout << ss.str() << std::flush;
+    //  successfully read a packet, the reader dispatches it
+    const size_t length = head[3];
+    memcpy(&packet_.syncMSB, head, Packet::kHeaderLength + length);
+    memset(&packet_.payload[length], 0, sizeof(packet_.payload) - length);
+    packet_.checkMSB = head[size - 2];
+    packet_.checkLSB = head[size - 1];
+    queueStart_ += size;
+    found = true;
+    break;
   }
-
-  bool found = false;
-  while (srcIndex_ < queue_.size() && !found) {
-    const uint8_t head = queue_[srcIndex_];
-    const size_t clear = handleByte(head, found);
-    //  pop 'clear' bytes from the queue
-    for (size_t i=0; i < clear; i++) {
-      queue_.pop_front();
-    }
-    if (clear) {
-      //  queue was shortened, return to head
-      srcIndex_=0;
-    } else {
-      //  continue up the queue
-      srcIndex_++;
-    }
+  if (queueStart_ == queueEnd_) {
+    queueStart_ = queueEnd_ = 0;
   }
-
-  //  no packet
   return found;
 }
 
 //Process IMU Data Packets and sort thru information based on type of packet
-void Imu::processPacket() {
-  IMUData data;
-  FilterData filterData;
+Imu::PacketKind Imu::processPacket() {
+  IMUData &data = imuData_;
+  FilterData &filterData = filterData_;
   PacketDecoder decoder(packet_);
 
+  //  fields missing from this packet must not keep the values of earlier ones
   if (packet_.isIMUData()) {
+    data = IMUData();
+    link_.countPacket(LinkMonitor::ImuStream, readStamp_);
     //  process all fields in the packet
     for (int d; (d = decoder.fieldDescriptor()) > 0; decoder.advance()) {
       switch (u8(d)) {
@@ -1444,17 +1853,22 @@ void Imu::processPacket() {
         data.fields |= IMUData::Barometer;
         break;
       default:
+        link_.countParseError();
         std::stringstream ss;
         ss << "Unsupported field in IMU packet: " << std::hex << d;
         throw std::runtime_error(ss.str());
         break;
       }
     }
-
-    if (imuDataCallback_) {
-      imuDataCallback_(data);
+    if (decoder.malformed() || decoder.failed() || !data.fields) {
+      link_.countParseError();
+      throw std::runtime_error("Malformed IMU packet");
     }
+
+    return IMUPacket;
   } else if (packet_.isFilterData()) {
+    filterData = FilterData();
+    link_.countPacket(LinkMonitor::FilterStream, readStamp_);
     for (int d; (d = decoder.fieldDescriptor()) > 0; decoder.advance()) {
       switch (u8(d)) {
       case DATA_FILTER_ORIENTATION_QUATERNION:
@@ -1500,57 +1914,71 @@ void Imu::processPacket() {
         filterData.fields |= FilterData::BiasUncertainty;
         break;
       default:
+        link_.countParseError();
         std::stringstream ss;
         ss << "Unsupported field in filter packet: " << std::hex << d;
         throw std::runtime_error(ss.str());
         break;
       }
     }
-
-    if (filterDataCallback_) {
-      filterDataCallback_(filterData);
+    if (decoder.malformed() || decoder.failed() || !filterData.fields) {
+      link_.countParseError();
+      throw std::runtime_error("Malformed filter packet");
     }
+
+    return FilterPacket;
   } else {
-    //  find any NACK fields and log them
+    //  find any NACK fields and log them, keep status reports
     for (int d; (d = decoder.fieldDescriptor()) > 0; decoder.advance()) {
-      if (decoder.fieldIsAckOrNack()) {
+      if (d == REPLY_FIELD_3DM_STATUS_REPORT &&
+          packet_.descriptor == COMMAND_CLASS_3DM) {
+        if (decoder.fieldLength() < static_cast<int>(
+                2 + sizeof(DiagnosticFields))) {
+          link_.countParseError();
+          continue;
+        }
+        DiagnosticFields fields;
+        decodeStatusReport(decoder, fields);
+        storeDiagnosticInfo(fields);
+      } else if (decoder.fieldIsAckOrNack()) {
         uint8_t cmd_code[2];  //  0 = command echo, 1 = command code
         decoder.extract(2, &cmd_code[0]);
-        if (cmd_code[1] != 0) {
+        if (cmd_code[1] != 0 && packet_.descriptor == COMMAND_CLASS_FILTER &&
+            cmd_code[0] == COMMAND_FILTER_EXTERNAL_HEADING) {
+          std::lock_guard<std::mutex> lock(submitMutex_);
+          headingStats_.rejected++;
+        } else if (cmd_code[1] != 0) {
           //  error occurred
-          std::cout << "Received NACK packet (class, command, code): ";
-          std::cout << std::hex << static_cast<int>(packet_.descriptor) << ", ";
-          std::cout << static_cast<int>(cmd_code[0]) << ", ";
-          std::cout << static_cast<int>(cmd_code[1]) << "\n" << std::flush;
+          log_.log(LogRing::Warn,
+                   "Received NACK packet (class, command, code): %x, %x, %x",
+                   packet_.descriptor, cmd_code[0], cmd_code[1]);
         }
       }
     }
   }
+  return OtherPacket;
 }
 
 int Imu::writePacket(const Packet &p, unsigned int to) {
   using namespace std::chrono;
 
   //  place into buffer
-  std::vector<uint8_t> v;
-  v.reserve(Packet::kHeaderLength + sizeof(Packet::payload) + 2);
-
-  v.push_back(p.syncMSB);
-  v.push_back(p.syncLSB);
-  v.push_back(p.descriptor);
-  v.push_back(p.length);
-  for (size_t i = 0; i < p.length; i++) {
-    v.push_back(p.payload[i]);
-  }
-  v.push_back(p.checkMSB);
-  v.push_back(p.checkLSB);
+  uint8_t v[Packet::kHeaderLength + sizeof(Packet::payload) + 2];
+  const size_t size = Packet::kHeaderLength + p.length + 2;
+  v[0] = p.syncMSB;
+  v[1] = p.syncLSB;
+  v[2] = p.descriptor;
+  v[3] = p.length;
+  memcpy(&v[Packet::kHeaderLength], p.payload, p.length);
+  v[Packet::kHeaderLength + p.length] = p.checkMSB;
+  v[Packet::kHeaderLength + p.length + 1] = p.checkLSB;
 
   auto tstart = high_resolution_clock::now();
   auto tstop = tstart + milliseconds(to);
 
   size_t written = 0;
-  while (written < v.size()) {
-    const ssize_t amt = ::write(fd_, &v[written], v.size() - written);
+  while (written < size) {
+    const ssize_t amt = ::write(fd_, &v[written], size - written);
     if (amt > 0) {
       written += amt;
     } else if (amt < 0) {
@@ -1566,9 +1994,21 @@ int Imu::writePacket(const Packet &p, unsigned int to) {
     }
   }
 
+  //  every write counts against the pacing of posted commands
+  std::lock_guard<std::mutex> lock(submitMutex_);
+  scheduler_.charge(written);
   return static_cast<int>(written); //  wrote w/o issue
 }
 
+void Imu::logPacket(LogRing::Level level, const char *what, const Packet &p) {
+  uint8_t v[Packet::kHeaderLength + sizeof(Packet::payload) + 2];
+  memcpy(v, &p.syncMSB, Packet::kHeaderLength);
+  memcpy(&v[Packet::kHeaderLength], p.payload, p.length);
+  v[Packet::kHeaderLength + p.length] = p.checkMSB;
+  v[Packet::kHeaderLength + p.length + 1] = p.checkLSB;
+  log_.dump(level, what, v, Packet::kHeaderLength + p.length + 2);
+}
+
 void Imu::sendPacket(const Packet &p, unsigned int to) {
   const int wrote = writePacket(p, to);
   if (wrote < 0) {
@@ -1584,8 +2024,13 @@ void Imu::receiveResponse(const Packet &command, unsigned int to) {
   const auto tend = tstart + std::chrono::milliseconds(to);
 
   while (std::chrono::high_resolution_clock::now() <= tend) {
+    //  aiding input does not wait for the response
+    if (txReady_ && numSubmitted_.load(std::memory_order_acquire) > 0) {
+      runScheduled(TxScheduler::Aiding);
+    }
     const int resp = pollInput(1);
     if (resp > 0) {
+      dispatch(callbacks_);
       //  check if this is an ack
       const int ack = packet_.ackErrorCodeFor(command);
 
@@ -1595,8 +2040,7 @@ void Imu::receiveResponse(const Packet &command, unsigned int to) {
         throw command_error(command, ack);
       } else {
         if (verbose_) {
-          std::cout << "Not interested in this [N]ACK!\n";
-          std::cout << packet_.toString() << "\n";
+          logPacket(LogRing::Info, "Not interested in this [N]ACK", packet_);
         }
         //  this ack was not for us, keep spinning until timeout
       }
@@ -1607,8 +2051,7 @@ void Imu::receiveResponse(const Packet &command, unsigned int to) {
     }
   }
   if (verbose_) {
-    std::cout << "Timed out reading response to:\n";
-    std::cout << command.toString() << std::endl << std::flush;
+    logPacket(LogRing::Info, "Timed out reading response to", command);
   }
   //  timed out
   throw timeout_error(false, to);
@@ -1616,11 +2059,151 @@ void Imu::receiveResponse(const Packet &command, unsigned int to) {
 
 void Imu::sendCommand(const Packet &p, bool readReply) {
   if (verbose_) {
-    std::cout << "Sending command:\n";
-    std::cout << p.toString() << std::endl;
+    logPacket(LogRing::Info, "Sending command", p);
   }
+  if (!readReply) {
+    sendPacket(p, rwTimeout_);
+    return;
+  }
+
+  //  commands are idempotent, so a lost command or reply is simply retried
+  const uint16_t type = commandType(p);
+  unsigned int to = rtt_.timeout(type);
+  for (unsigned int attempt = 0;; attempt++) {
+    sendPacket(p, rwTimeout_);
+    const auto start = std::chrono::steady_clock::now();
+    try {
+      receiveResponse(p, to);
+    } catch (timeout_error&) {
+      rtt_.countTimeout();
+      if (attempt >= retries_) {
+        throw;
+      }
+      rtt_.countRetry();
+      to = rtt_.backoff(to);
+      continue;
+    } catch (command_error&) {
+      if (attempt == 0) {
+        rtt_.sample(type, std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count());
+      }
+      throw;
+    }
+    //  a reply after a retry may belong to either attempt, do not sample it
+    if (attempt == 0) {
+      rtt_.sample(type, std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - start).count());
+    }
+    return;
+  }
+}
+
+void Imu::setCommandTimeouts(double floor, double ceiling, double initial,
+                             unsigned int retries) {
+  rtt_.setLimits(floor, ceiling, initial);
+  retries_ = retries;
+}
+
+double Imu::pingRtt() const {
+  Packet p(COMMAND_CLASS_BASE);
+  p.payload[1] = COMMAND_BASE_DEVICE_PING;
+  return rtt_.srtt(commandType(p));
+}
+
+uint16_t Imu::commandType(const Packet &p) {
+  //  payload: field length, field descriptor, ...
+  return (static_cast<uint16_t>(p.descriptor) << 8) | p.payload[1];
+}
+
+void Imu::applyCommand(const Packet &p) {
+  sendCommand(p);
+
+  //  cache the command once the device accepted it, replacing any previous
+  //  command for the same setting
+  const uint32_t key = commandKey(p);
+  for (Packet &cached : configCache_) {
+    if (commandKey(cached) == key) {
+      cached = p;
+      return;
+    }
+  }
+  configCache_.push_back(p);
+}
+
+uint32_t Imu::commandKey(const Packet &p) {
+  //  payload: field length, field descriptor, function, arguments...
+  const uint8_t field = p.payload[1];
+  uint8_t selector = 0;
+  if ((p.descriptor == COMMAND_CLASS_3DM &&
+       field == COMMAND_3DM_ENABLE_DATA_STREAM) ||
+      (p.descriptor == COMMAND_CLASS_3DM &&
+       field == COMMAND_3DM_SET_LPF_BANDWIDTH)) {
+    selector = p.payload[3]; //  device selector or data descriptor
+  }
+  return (static_cast<uint32_t>(p.descriptor) << 16) |
+      (static_cast<uint32_t>(field) << 8) | selector;
+}
+
+void Imu::verifyCommand(const Packet &applied) {
+  //  only the settings which determine what is streamed are read back
+  const uint8_t field = applied.payload[1];
+  uint8_t replyField;
+  if (applied.descriptor != COMMAND_CLASS_3DM) {
+    return;
+  } else if (field == COMMAND_3DM_IMU_MESSAGE_FORMAT) {
+    replyField = REPLY_FIELD_3DM_IMU_MESSAGE_FORMAT;
+  } else if (field == COMMAND_FILTER_MESSAGE_FORMAT) {
+    replyField = REPLY_FIELD_3DM_FILTER_MESSAGE_FORMAT;
+  } else if (field == COMMAND_3DM_ENABLE_DATA_STREAM) {
+    replyField = REPLY_FIELD_3DM_DATA_STREAM;
+  } else {
+    return;
+  }
+
+  Packet p(applied.descriptor);
+  {
+    PacketEncoder encoder(p);
+    encoder.beginField(field);
+    encoder.append(COMMAND_FUNCTION_READ);
+    if (field == COMMAND_3DM_ENABLE_DATA_STREAM) {
+      encoder.append(applied.payload[3]);
+    }
+    encoder.endField();
+  }
+  p.calcChecksum();
+  sendCommand(p);
+
+  //  the reply repeats the arguments of the apply command, minus the function
+  PacketDecoder decoder(packet_);
+  const size_t length = applied.payload[0] - 3;
+  if (!decoder.advanceTo(replyField) ||
+      static_cast<size_t>(decoder.fieldLength()) != length + 2 ||
+      memcmp(&packet_.payload[decoder.fieldStart() + 2], &applied.payload[3],
+             length) != 0) {
+    std::stringstream ss;
+    ss << "Device did not restore setting " << std::hex
+       << static_cast<int>(applied.descriptor) << ", "
+       << static_cast<int>(field);
+    throw std::runtime_error(ss.str());
+  }
+}
+
+bool Imu::tryPing() {
+  Imu::Packet p(COMMAND_CLASS_BASE);
+  {
+    PacketEncoder encoder(p);
+    encoder.beginField(COMMAND_BASE_DEVICE_PING);
+    encoder.endField();
+  }
+  p.calcChecksum();
   sendPacket(p, rwTimeout_);
-  if (readReply) {
-    receiveResponse(p, rwTimeout_);
+  try {
+    //  the RTT of the last session applies while the baud rate is the same
+    receiveResponse(p, rtt_.timeout(commandType(p)));
+  } catch (timeout_error&) {
+    return false;
+  } catch (command_error&) {
+    return false;
   }
+  return true;
 }
@@ -1,5 +1,6 @@
 #include <ros/ros.h>
 #include <ros/node_handle.h>
+#include <ros/callback_queue.h>
 #include <diagnostic_updater/diagnostic_updater.h>
 #include <diagnostic_updater/publisher.h>
 
@@ -8,33 +9,184 @@
 #include <geometry_msgs/Vector3Stamped.h>
 #include <geometry_msgs/QuaternionStamped.h>
 #include <string>
+#include <vector>
+#include <memory>
+#include <bitset>
 #include <cmath>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <limits>
 
 #include <imu_3dm_gx4/FilterOutput.h>
+#include <imu_3dm_gx4/FilterOutputCompact.h>
 #include <imu_3dm_gx4/MagFieldCF.h>
+#include <imu_3dm_gx4/IMUBatch.h>
+#include <imu_3dm_gx4/SetRates.h>
+#include <imu_3dm_gx4/HeadingUpdate.h>
 #include "imu_3dm_gx4/imu.hpp"
+#include "imu_3dm_gx4/imu_sink.hpp"
+#include "imu_3dm_gx4/imu_fusion.hpp"
+#include "imu_3dm_gx4/shm_ring.hpp"
+#include "imu_3dm_gx4/stream_server.hpp"
+#include "imu_3dm_gx4/stream_watchdog.hpp"
+
+extern "C" {
+#include <sys/epoll.h>
+#include <errno.h>
+#include <unistd.h> //  close
+#include <string.h> //  strerror
+}
 
 using namespace imu_3dm_gx4;
 
 #define kEarthGravity (9.80665)
 #define PI (3.141592653)
 
-ros::Publisher pubIMU;
-ros::Publisher pubMag;
-ros::Publisher pubPressure;
-ros::Publisher pubFilter;
-std::string frameId;
+//  per-device state, one instance for every IMU handled by this process
+struct Device {
+  std::string name;
+  size_t index;        //  position in the list of devices
+  ros::NodeHandle nh;  //  namespace of the topics and parameters
+  std::shared_ptr<Imu> imu;
+  bool running;
+
+  //  parameters
+  std::string device;
+  int baudrate;
+  int requestedImuRate, requestedFilterRate;
+  bool verbose;
+  std::string headingUpdateSource, declinationSource;
+  float rollDeg, pitchDeg, yawDeg;
+  double latitude, longitude, altitude, declinationDeg;
+  int magLPFBandwidth3DM, accelLPFBandwidth3DM, gyroLPFBandwidth3DM;
+  bool enableIronOffset;
+  float hardOffset[3];
+  float softMatrix[9];
+  float leverArm[3];   //  position in the vehicle frame, for fusion
+  double timeoutFloor, timeoutCeiling, timeoutInitial;  //  [s]
+  int commandRetries;
+  std::string linkPolicy;      //  auto_baud, reject or degrade
+  double linkMaxUtilization;   //  share of the link the streams may use
+
+  ros::Publisher pubIMU;
+  ros::Publisher pubMag;
+  ros::Publisher pubPressure;
+  ros::Publisher pubFilter;
+  ros::Publisher pubIMUBatch;
+  ros::Publisher pubFilterCompact;
+  std::string frameId;
+
+  //  messages reused for every sample, their frame_id is set once
+  sensor_msgs::Imu imuMsg;
+  imu_3dm_gx4::MagFieldCF magMsg;
+  sensor_msgs::FluidPressure pressureMsg;
+  imu_3dm_gx4::FilterOutput filterMsg;
+  imu_3dm_gx4::FilterOutputCompact filterCompactMsg;
+
+  //  batched output, disabled when both limits are zero
+  imu_3dm_gx4::IMUBatch imuBatch;
+  int imuBatchSize;
+  double imuBatchPeriod;
+
+  //  filter output mode: full, compact or both
+  bool filterOutputFull;
+  bool filterOutputCompact;
+
+  Imu::Info info;
+  std::vector<std::pair<std::string, std::string>> infoValues; //  from info
+
+  //  device status, polled without blocking the streaming path
+  double statusPollPeriod;         //  [s], 0 disables polling
+  std::chrono::steady_clock::time_point nextStatusRequest;
+
+  //  device-side field selection, disabled when the timeout is zero
+  double unsubscribedTimeout;
+  uint16_t imuDecimation, filterDecimation;
+  std::bitset<4> imuSources;    //  fields currently streamed by the device
+  std::bitset<8> filterSources;
+  bool filterStreamEnabled;     //  off while no filter field is wanted
+  ros::Time lastMagWanted, lastPressureWanted, lastFilterWanted;
+  ros::Time lastFieldSelection;
+
+  //  runtime rate changes through the set_rates service
+  uint16_t imuBaseRate, filterBaseRate;
+  std::bitset<4> imuFieldMask;     //  fields allowed by the service
+  std::bitset<8> filterFieldMask;
+  ros::ServiceServer setRatesServer;
+  std::chrono::steady_clock::time_point lastSample;  //  of the IMU stream
+  bool awaitingRateSample;         //  first sample after a rate change
+  std::chrono::steady_clock::time_point rateChangeDeadline;
+  unsigned int rateChanges;
+  double rateChangeGap;            //  data gap of the last change [s]
+
+  float magBX, magBY, magBZ; // Body-frame magnetic field components
+  double declinationRad;
+
+  //  optional shared-memory output for non-ROS consumers
+  std::shared_ptr<ShmRingWriter> shmRing;
+
+  //  optional local socket server for non-ROS consumers
+  std::shared_ptr<StreamServer> streamServer;
+
+  //  external heading updates, forwarded if the heading source is external
+  ros::Subscriber subHeading;
+
+  //  stall detection of the IMU stream, disabled if null
+  std::shared_ptr<StreamWatchdog> watchdog;
+
+  //  hot reconnect after the device disappeared
+  bool reconnecting;
+  bool awaitingSample;           //  first sample after a reconnect
+  unsigned int reconnects;
+  double reconnectDuration;      //  from reappearance to first sample [s]
+  std::chrono::steady_clock::time_point lastAttempt, reappeared;
+
+  //  probing all baud rates takes seconds, so it runs on its own thread; the
+  //  Imu belongs to that thread while probing is set
+  std::thread prober;
+  std::atomic<bool> probing;
+  bool probeFailed;              //  written by the prober before probing
+  std::string probeError;
+
+  //  the last two status reports, with the host counters read alongside
+  Imu::DiagnosticSnapshot linkPrevious, linkLatest;
+  LinkMonitor::Losses lastLosses; //  between those reports
+  LinkMonitor::Losses losses;     //  totals since startup
+
+  //  diagnostic_updater resources, the rates are the frequency targets
+  double imuRate, filterRate;
+  std::shared_ptr<diagnostic_updater::Updater> updater;
+  std::shared_ptr<diagnostic_updater::TopicDiagnostic> imuDiag;
+  std::shared_ptr<diagnostic_updater::TopicDiagnostic> filterDiag;
+
+  Device() : index(0), running(false), imuBatchSize(0), imuBatchPeriod(0),
+      filterOutputFull(true), filterOutputCompact(false), statusPollPeriod(0),
+      unsubscribedTimeout(0), imuDecimation(1), filterDecimation(1),
+      filterStreamEnabled(true), imuBaseRate(0), filterBaseRate(0), imuFieldMask(0xF),
+      filterFieldMask(0xFF), awaitingRateSample(false), rateChanges(0),
+      rateChangeGap(0), magBX(0), magBY(0), magBZ(0), declinationRad(0), reconnecting(false),
+      awaitingSample(false), reconnects(0), reconnectDuration(0),
+      probing(false), probeFailed(false),
+      imuRate(0), filterRate(0) {
+    linkPrevious.reports = linkLatest.reports = 0;
+    memset(&lastLosses, 0, sizeof(lastLosses));
+    memset(&losses, 0, sizeof(losses));
+  }
+};
 
-Imu::Info info;
-Imu::DiagnosticFields fields;
+//  interval between attempts to reopen a disconnected device [ms]
+#define kReconnectInterval (20)
 
-float magBX, magBY, magBZ; // Body-frame magnetic field components
-double declinationRad;
+//  longest wait for the first sample after a rate change [ms]
+#define kRateChangeSampleTimeout (500)
 
-//  diagnostic_updater resources
-std::shared_ptr<diagnostic_updater::Updater> updater;
-std::shared_ptr<diagnostic_updater::TopicDiagnostic> imuDiag;
-std::shared_ptr<diagnostic_updater::TopicDiagnostic> filterDiag;
+//  optional virtual IMU fused from all devices
+std::shared_ptr<ImuFusion> fusion;
+ros::Publisher pubFusion;
+std::string fusionFrameId;
+sensor_msgs::Imu fusionMsg; //  reused, frame_id is set once
 
 // Normalize vector components, and write new values to specified address
 void normalize(float v1, float v2, float v3, float *x, float *y, float *z) {
@@ -44,104 +196,165 @@ void normalize(float v1, float v2, float v3, float *x, float *y, float *z) {
   *z = v3/magnitude;
 }
 
-void publishData(const Imu::IMUData &data) {
-  sensor_msgs::Imu imu;
-  imu_3dm_gx4::MagFieldCF field;
-  sensor_msgs::FluidPressure pressure;
-
-  //  assume we have all of these since they were requested
-  /// @todo: Replace this with a mode graceful failure...
-  assert(data.fields & Imu::IMUData::Accelerometer);
-  assert(data.fields & Imu::IMUData::Magnetometer);
-  assert(data.fields & Imu::IMUData::Barometer);
-  assert(data.fields & Imu::IMUData::Gyroscope);
+// Reserve space for a full batch, so appending samples does not reallocate
+void resetBatch(Device &dev) {
+  dev.imuBatch.count = 0;
+  dev.imuBatch.time_offsets.clear();
+  dev.imuBatch.linear_acceleration.clear();
+  dev.imuBatch.angular_velocity.clear();
+  dev.imuBatch.magnetic_field.clear();
+  dev.imuBatch.fluid_pressure.clear();
+
+  const size_t capacity = (dev.imuBatchSize > 0) ? dev.imuBatchSize : 1;
+  dev.imuBatch.time_offsets.reserve(capacity);
+  dev.imuBatch.linear_acceleration.reserve(capacity * 3);
+  dev.imuBatch.angular_velocity.reserve(capacity * 3);
+  dev.imuBatch.magnetic_field.reserve(capacity * 3);
+  dev.imuBatch.fluid_pressure.reserve(capacity);
+}
 
-  //  timestamp identically
-  imu.header.stamp = ros::Time::now();
-  imu.header.frame_id = frameId;
-  field.header.stamp = imu.header.stamp;
-  field.header.frame_id = frameId;
-  pressure.header.stamp = imu.header.stamp;
-  pressure.header.frame_id = frameId;
-
-  imu.orientation_covariance[0] =
-      -1; //  orientation data is on a separate topic
+// Append one sample to the batch, and publish once the size or period limit
+// is reached. Magnetometer and pressure are NaN when not streamed.
+void batchData(Device &dev, const Imu::IMUData &data,
+               const ros::Time &stamp) {
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  const bool haveMag = data.fields & Imu::IMUData::Magnetometer;
+  if (dev.imuBatch.count == 0) {
+    dev.imuBatch.header.stamp = stamp;
+    dev.imuBatch.header.frame_id = dev.frameId;
+  }
+  const double offset = (stamp - dev.imuBatch.header.stamp).toSec();
+  dev.imuBatch.time_offsets.push_back(offset);
+  for (int i = 0; i < 3; i++) {
+    dev.imuBatch.linear_acceleration.push_back(data.accel[i] * kEarthGravity);
+    dev.imuBatch.angular_velocity.push_back(data.gyro[i]);
+    dev.imuBatch.magnetic_field.push_back(haveMag ? data.mag[i] : nan);
+  }
+  dev.imuBatch.fluid_pressure.push_back(
+      (data.fields & Imu::IMUData::Barometer) ? data.pressure : nan);
+  dev.imuBatch.count++;
+
+  const bool full = (dev.imuBatchSize > 0 &&
+                     dev.imuBatch.count >= static_cast<uint32_t>(dev.imuBatchSize));
+  const bool expired = (dev.imuBatchPeriod > 0 && offset >= dev.imuBatchPeriod);
+  if (full || expired) {
+    dev.pubIMUBatch.publish(dev.imuBatch);
+    resetBatch(dev);
+  }
+}
 
-  imu.linear_acceleration.x = data.accel[0] * kEarthGravity;
-  imu.linear_acceleration.y = data.accel[1] * kEarthGravity;
-  imu.linear_acceleration.z = data.accel[2] * kEarthGravity;
-  imu.angular_velocity.x = data.gyro[0];
-  imu.angular_velocity.y = data.gyro[1];
-  imu.angular_velocity.z = data.gyro[2];
-
-  field.components.x = data.mag[0];
-  field.components.y = data.mag[1];
-  field.components.z = data.mag[2];
-  //field.magnitude = sqrt(pow(data.mag[0], 2) + pow(data.mag[1], 2) + pow(data.mag[2], 2));
-  field.magnitude = sqrt(data.mag[0]*data.mag[0] + data.mag[1]*data.mag[1] + data.mag[2]*data.mag[2]);
-  magBX = data.mag[0];
-  magBY = data.mag[1];
-  magBZ = data.mag[2];
-
-  pressure.fluid_pressure = data.pressure;
-
-  //  publish
-  pubIMU.publish(imu);
-  pubMag.publish(field);
-  pubPressure.publish(pressure);
-  if (imuDiag) {
-    imuDiag->tick(imu.header.stamp);
-  }
-}
-
-void publishFilter(const Imu::FilterData &data) {
-  assert(data.fields & Imu::FilterData::Quaternion);
-  assert(data.fields & Imu::FilterData::OrientationEuler);
-  assert(data.fields & Imu::FilterData::Acceleration);
-  assert(data.fields & Imu::FilterData::AngularRate);
-  assert(data.fields & Imu::FilterData::Bias);
-  assert(data.fields & Imu::FilterData::AngleUnertainty);
-  assert(data.fields & Imu::FilterData::BiasUncertainty);
-
-  imu_3dm_gx4::FilterOutput output;
-  output.header.stamp = ros::Time::now();
-  output.header.frame_id = frameId;
+// Publish all fused samples which are ready
+void publishFusion() {
+  ImuFusion::Output output;
+  while (fusion->next(output)) {
+    if (pubFusion.getNumSubscribers() == 0) {
+      continue;
+    }
+    sensor_msgs::Imu &imu = fusionMsg;
+    imu.header.stamp.fromNSec(output.stamp);
+    imu.linear_acceleration.x = output.accel[0] * kEarthGravity;
+    imu.linear_acceleration.y = output.accel[1] * kEarthGravity;
+    imu.linear_acceleration.z = output.accel[2] * kEarthGravity;
+    imu.angular_velocity.x = output.gyro[0];
+    imu.angular_velocity.y = output.gyro[1];
+    imu.angular_velocity.z = output.gyro[2];
+    pubFusion.publish(imu);
+  }
+}
 
-  output.quaternion.w = data.quaternion[0];
-  output.quaternion.x = data.quaternion[1];
-  output.quaternion.y = data.quaternion[2];
-  output.quaternion.z = data.quaternion[3];
-  output.quaternion_status = data.quaternionStatus;
+void publishData(Device &dev, const Imu::IMUData &data) {
+  const bool haveImu = (data.fields & Imu::IMUData::Accelerometer) &&
+      (data.fields & Imu::IMUData::Gyroscope);
+  const bool haveMag = data.fields & Imu::IMUData::Magnetometer;
+  const bool havePressure = data.fields & Imu::IMUData::Barometer;
 
-  output.euler_rpy.x = data.eulerRPY[0];
-  output.euler_rpy.y = data.eulerRPY[1];
-  output.euler_rpy.z = data.eulerRPY[2];
-  output.euler_rpy_status = data.eulerRPYStatus;
+  //  timestamp identically
+  const ros::Time stamp = ros::Time::now();
+  const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+  if (dev.watchdog) {
+    dev.watchdog->sample(now);
+  }
+  if (dev.awaitingRateSample) {
+    dev.awaitingRateSample = false;
+    dev.rateChangeGap =
+        std::chrono::duration<double>(now - dev.lastSample).count();
+    ROS_INFO("%s: First sample after the rate change, data gap of %.1f ms",
+             dev.name.c_str(), dev.rateChangeGap * 1e3);
+  }
+  dev.lastSample = now;
+  if (dev.awaitingSample) {
+    dev.awaitingSample = false;
+    dev.reconnects++;
+    dev.reconnectDuration =
+        std::chrono::duration<double>(now - dev.reappeared).count();
+    ROS_INFO("%s: Streaming again, %.3f s after the device reappeared",
+             dev.name.c_str(), dev.reconnectDuration);
+  }
+  if (dev.shmRing) {
+    dev.shmRing->write(data, stamp.toNSec());
+  }
+  if (dev.streamServer) {
+    dev.streamServer->publish(data, stamp.toNSec());
+  }
+  //  the fusion stage is shared, only fed from the event loop
+  if (fusion && dev.running && haveImu) {
+    fusion->addSample(dev.index, stamp.toNSec(), data);
+    publishFusion();
+  }
 
-  output.euler_angle_covariance[0] = data.eulerAngleUncertainty[0]*
-      data.eulerAngleUncertainty[0];
-  output.euler_angle_covariance[4] = data.eulerAngleUncertainty[1]*
-      data.eulerAngleUncertainty[1];
-  output.euler_angle_covariance[8] = data.eulerAngleUncertainty[2]*
-      data.eulerAngleUncertainty[2];
-  output.euler_angle_covariance_status = data.eulerAngleUncertaintyStatus;
+  //  only build messages for topics somebody listens to
+  if (haveImu && dev.pubIMU.getNumSubscribers() > 0) {
+    sensor_msgs::Imu &imu = dev.imuMsg;
+    imu.header.stamp = stamp;
+    imu.linear_acceleration.x = data.accel[0] * kEarthGravity;
+    imu.linear_acceleration.y = data.accel[1] * kEarthGravity;
+    imu.linear_acceleration.z = data.accel[2] * kEarthGravity;
+    imu.angular_velocity.x = data.gyro[0];
+    imu.angular_velocity.y = data.gyro[1];
+    imu.angular_velocity.z = data.gyro[2];
+    dev.pubIMU.publish(imu);
+  }
 
-  output.gyro_bias.x = data.gyroBias[0];
-  output.gyro_bias.y = data.gyroBias[1];
-  output.gyro_bias.z = data.gyroBias[2];
-  output.gyro_bias_status = data.gyroBiasStatus;
+  if (haveMag) {
+    //  always keep the latest field for the alternate heading update
+    dev.magBX = data.mag[0];
+    dev.magBY = data.mag[1];
+    dev.magBZ = data.mag[2];
+
+    if (dev.pubMag.getNumSubscribers() > 0) {
+      imu_3dm_gx4::MagFieldCF &field = dev.magMsg;
+      field.header.stamp = stamp;
+      field.components.x = data.mag[0];
+      field.components.y = data.mag[1];
+      field.components.z = data.mag[2];
+      field.magnitude = sqrt(data.mag[0]*data.mag[0] + data.mag[1]*data.mag[1] + data.mag[2]*data.mag[2]);
+      dev.pubMag.publish(field);
+    }
+  }
 
-  output.gyro_bias_covariance[0] = data.gyroBiasUncertainty[0]*data.gyroBiasUncertainty[0];
-  output.gyro_bias_covariance[4] = data.gyroBiasUncertainty[1]*data.gyroBiasUncertainty[1];
-  output.gyro_bias_covariance[8] = data.gyroBiasUncertainty[2]*data.gyroBiasUncertainty[2];
-  output.gyro_bias_covariance_status = data.gyroBiasUncertaintyStatus;
+  if (havePressure && dev.pubPressure.getNumSubscribers() > 0) {
+    sensor_msgs::FluidPressure &pressure = dev.pressureMsg;
+    pressure.header.stamp = stamp;
+    pressure.fluid_pressure = data.pressure;
+    dev.pubPressure.publish(pressure);
+  }
 
-  output.heading_update_LORD = data.headingUpdate;
-  output.heading_update_uncertainty = data.headingUpdateUncertainty;
-  output.heading_update_source = data.headingUpdateSource;
-  output.heading_update_flags = data.headingUpdateFlags;
+  //  batches carry every field, those not streamed as NaN
+  if ((dev.imuBatchSize > 0 || dev.imuBatchPeriod > 0) && haveImu) {
+    if (dev.pubIMUBatch.getNumSubscribers() > 0) {
+      batchData(dev, data, stamp);
+    } else if (dev.imuBatch.count > 0) {
+      resetBatch(dev); //  drop stale samples
+    }
+  }
+  if (dev.imuDiag) {
+    dev.imuDiag->tick(stamp);
+  }
+}
 
-  // Perform Alternate Heading Update ////////////////////////////
+// Compute the alternate heading update from the latest magnetometer reading
+float alternateHeading(const Device &dev, const Imu::FilterData &data) {
   float roll = data.eulerRPY[0] * 180/PI;
   float pitch = data.eulerRPY[1] * 180/PI;
 
@@ -156,7 +369,7 @@ void publishFilter(const Imu::FilterData &data) {
   pitch *= PI/180;
 
   float mBX = 0, mBY = 0, mBZ = 0; // Normalized body-frame component variables
-  normalize(magBX, magBY, magBZ, &mBX, &mBY, &mBZ); // Normalize components
+  normalize(dev.magBX, dev.magBY, dev.magBZ, &mBX, &mBY, &mBZ); // Normalize components
 
   // Calculate x and y mag components in world frame using rotation matrix
   float mWX = mBX * cos(pitch) + mBY * sin(roll) * sin(pitch) + mBZ * sin(pitch) * cos(roll);
@@ -166,7 +379,7 @@ void publishFilter(const Imu::FilterData &data) {
   float heading_alt = atan2(mWY, mWX);
 
   // Account for declination
-  heading_alt += declinationRad; // Add declination value
+  heading_alt += dev.declinationRad; // Add declination value
   heading_alt *= 180/PI;
   if (heading_alt > 180.0) // Keep heading in the range [-180, 180] deg
   {
@@ -176,8 +389,49 @@ void publishFilter(const Imu::FilterData &data) {
   {
     heading_alt += 360;
   }
-  output.heading_update_alt = heading_alt*PI/180;
-  ////////////////////////////////////////////////////////
+  return heading_alt*PI/180;
+}
+
+void publishFilterOutput(Device &dev, const Imu::FilterData &data,
+                         float headingAlt, const ros::Time &stamp) {
+  imu_3dm_gx4::FilterOutput &output = dev.filterMsg;
+  output.header.stamp = stamp;
+
+  output.quaternion.w = data.quaternion[0];
+  output.quaternion.x = data.quaternion[1];
+  output.quaternion.y = data.quaternion[2];
+  output.quaternion.z = data.quaternion[3];
+  output.quaternion_status = data.quaternionStatus;
+
+  output.euler_rpy.x = data.eulerRPY[0];
+  output.euler_rpy.y = data.eulerRPY[1];
+  output.euler_rpy.z = data.eulerRPY[2];
+  output.euler_rpy_status = data.eulerRPYStatus;
+
+  output.euler_angle_covariance[0] = data.eulerAngleUncertainty[0]*
+      data.eulerAngleUncertainty[0];
+  output.euler_angle_covariance[4] = data.eulerAngleUncertainty[1]*
+      data.eulerAngleUncertainty[1];
+  output.euler_angle_covariance[8] = data.eulerAngleUncertainty[2]*
+      data.eulerAngleUncertainty[2];
+  output.euler_angle_covariance_status = data.eulerAngleUncertaintyStatus;
+
+  output.gyro_bias.x = data.gyroBias[0];
+  output.gyro_bias.y = data.gyroBias[1];
+  output.gyro_bias.z = data.gyroBias[2];
+  output.gyro_bias_status = data.gyroBiasStatus;
+
+  output.gyro_bias_covariance[0] = data.gyroBiasUncertainty[0]*data.gyroBiasUncertainty[0];
+  output.gyro_bias_covariance[4] = data.gyroBiasUncertainty[1]*data.gyroBiasUncertainty[1];
+  output.gyro_bias_covariance[8] = data.gyroBiasUncertainty[2]*data.gyroBiasUncertainty[2];
+  output.gyro_bias_covariance_status = data.gyroBiasUncertaintyStatus;
+
+  output.heading_update_LORD = data.headingUpdate;
+  output.heading_update_uncertainty = data.headingUpdateUncertainty;
+  output.heading_update_source = data.headingUpdateSource;
+  output.heading_update_flags = data.headingUpdateFlags;
+
+  output.heading_update_alt = headingAlt;
 
   output.linear_acceleration.x = data.acceleration[0];
   output.linear_acceleration.y = data.acceleration[1];
@@ -189,293 +443,1479 @@ void publishFilter(const Imu::FilterData &data) {
   output.angular_velocity.z = data.angularRate[2];
   output.angular_velocity_status = data.angularRateStatus;
 
-  pubFilter.publish(output);
-  if (filterDiag) {
-    filterDiag->tick(output.header.stamp);
+  dev.pubFilter.publish(output);
+}
+
+void publishFilterCompact(Device &dev, const Imu::FilterData &data,
+                          float headingAlt, const ros::Time &stamp) {
+  imu_3dm_gx4::FilterOutputCompact &output = dev.filterCompactMsg;
+  output.header.stamp = stamp;
+
+  for (int i = 0; i < 4; i++) {
+    output.quaternion[i] = data.quaternion[i];
+  }
+  output.quaternion_status = data.quaternionStatus;
+
+  for (int i = 0; i < 3; i++) {
+    output.euler_rpy[i] = data.eulerRPY[i];
+    output.euler_angle_sigma[i] = data.eulerAngleUncertainty[i];
+    output.gyro_bias[i] = data.gyroBias[i];
+    output.gyro_bias_sigma[i] = data.gyroBiasUncertainty[i];
+    output.linear_acceleration[i] = data.acceleration[i];
+    output.angular_velocity[i] = data.angularRate[i];
+  }
+  output.euler_rpy_status = data.eulerRPYStatus;
+  output.euler_angle_sigma_status = data.eulerAngleUncertaintyStatus;
+  output.gyro_bias_status = data.gyroBiasStatus;
+  output.gyro_bias_sigma_status = data.gyroBiasUncertaintyStatus;
+  output.linear_acceleration_status = data.accelerationStatus;
+  output.angular_velocity_status = data.angularRateStatus;
+
+  output.heading_update_alt = headingAlt;
+  output.heading_update_LORD = data.headingUpdate;
+  output.heading_update_uncertainty = data.headingUpdateUncertainty;
+  output.heading_update_source = data.headingUpdateSource;
+  output.heading_update_flags = data.headingUpdateFlags;
+
+  dev.pubFilterCompact.publish(output);
+}
+
+void publishFilter(Device &dev, const Imu::FilterData &data) {
+  const ros::Time stamp = ros::Time::now();
+  if (dev.shmRing) {
+    dev.shmRing->write(data, stamp.toNSec());
+  }
+  if (dev.streamServer) {
+    dev.streamServer->publish(data, stamp.toNSec());
+  }
+  const bool full = dev.filterOutputFull && dev.pubFilter.getNumSubscribers() > 0;
+  const bool compact = dev.filterOutputCompact &&
+      dev.pubFilterCompact.getNumSubscribers() > 0;
+
+  //  skip the messages and the alternate heading update if nobody listens
+  if (full || compact) {
+    //  fields masked out through set_rates are zero, with an invalid status;
+    //  the alternate heading needs roll and pitch
+    const float headingAlt =
+        (data.fields & Imu::FilterData::OrientationEuler) ?
+            alternateHeading(dev, data) : 0.0f;
+    if (full) {
+      publishFilterOutput(dev, data, headingAlt, stamp);
+    }
+    if (compact) {
+      publishFilterCompact(dev, data, headingAlt, stamp);
+    }
+  }
+  if (dev.filterDiag) {
+    dev.filterDiag->tick(stamp);
+  }
+}
+
+void publishPacket(Device &dev, const Imu::Packet &packet) {
+  dev.streamServer->publish(packet, ros::Time::now().toNSec());
+}
+
+//  consumer of a device's input, called directly by Imu::readInput()
+struct DeviceSink : public ImuSink {
+  Device &dev;
+
+  explicit DeviceSink(Device &device) : dev(device) {}
+
+  void onPacket(const Imu::Packet &packet) {
+    if (dev.streamServer) {
+      publishPacket(dev, packet);
+    }
+  }
+  void onIMUData(const Imu::IMUData &data) { publishData(dev, data); }
+  void onFilterData(const Imu::FilterData &data) { publishFilter(dev, data); }
+};
+
+// Stop streaming fields whose topics have had no subscribers for longer than
+// unsubscribedTimeout, and re-enable them as soon as somebody subscribes
+void updateFieldSelection(Device &dev) {
+  const ros::Time now = ros::Time::now();
+  const bool batching = (dev.imuBatchSize > 0 || dev.imuBatchPeriod > 0) &&
+      dev.pubIMUBatch.getNumSubscribers() > 0;
+
+  //  the alternate heading update in the filter output needs the magnetometer
+  if (dev.pubMag.getNumSubscribers() > 0 || dev.pubFilter.getNumSubscribers() > 0 ||
+      dev.pubFilterCompact.getNumSubscribers() > 0 || batching) {
+    dev.lastMagWanted = now;
+  }
+  if (dev.pubPressure.getNumSubscribers() > 0 || batching) {
+    dev.lastPressureWanted = now;
+  }
+  if ((dev.filterOutputFull && dev.pubFilter.getNumSubscribers() > 0) ||
+      (dev.filterOutputCompact && dev.pubFilterCompact.getNumSubscribers() > 0)) {
+    dev.lastFilterWanted = now;
+  }
+
+  //  accelerometer and gyroscope are always streamed, they drive the
+  //  frequency diagnostic of the imu topic
+  std::bitset<4> imuWanted(Imu::IMUData::Accelerometer |
+                           Imu::IMUData::Gyroscope);
+  if ((now - dev.lastMagWanted).toSec() < dev.unsubscribedTimeout) {
+    imuWanted |= Imu::IMUData::Magnetometer;
+  }
+  if ((now - dev.lastPressureWanted).toSec() < dev.unsubscribedTimeout) {
+    imuWanted |= Imu::IMUData::Barometer;
+  }
+  imuWanted &= dev.imuFieldMask;
+
+  std::bitset<8> filterWanted;
+  if ((now - dev.lastFilterWanted).toSec() < dev.unsubscribedTimeout) {
+    filterWanted = Imu::FilterData::Quaternion |
+        Imu::FilterData::OrientationEuler |
+        Imu::FilterData::HeadingUpdate |
+        Imu::FilterData::Acceleration |
+        Imu::FilterData::AngularRate |
+        Imu::FilterData::Bias |
+        Imu::FilterData::AngleUnertainty |
+        Imu::FilterData::BiasUncertainty;
+  }
+  filterWanted &= dev.filterFieldMask;
+
+  try {
+    if (imuWanted != dev.imuSources) {
+      ROS_INFO("%s: Selecting IMU fields: %s", dev.name.c_str(),
+               imuWanted.to_string().c_str());
+      dev.imu->setIMUDataRate(dev.imuDecimation, imuWanted);
+      dev.imuSources = imuWanted;
+    }
+    //  a format without fields is not a valid way to stop the stream, the
+    //  last format is kept and used again when fields are wanted
+    if (filterWanted.none()) {
+      if (dev.filterStreamEnabled) {
+        ROS_INFO("%s: Disabling filter data stream", dev.name.c_str());
+        dev.imu->enableFilterStream(false);
+        dev.filterStreamEnabled = false;
+      }
+    } else {
+      if (filterWanted != dev.filterSources) {
+        ROS_INFO("%s: Selecting filter fields: %s", dev.name.c_str(),
+                 filterWanted.to_string().c_str());
+        dev.imu->setFilterDataRate(dev.filterDecimation, filterWanted);
+        dev.filterSources = filterWanted;
+      }
+      if (!dev.filterStreamEnabled) {
+        ROS_INFO("%s: Enabling filter data stream", dev.name.c_str());
+        dev.imu->enableFilterStream(true);
+        dev.filterStreamEnabled = true;
+      }
+    }
+  }
+  catch (Imu::command_error &e) {
+    ROS_WARN("%s: Failed to change field selection: %s", dev.name.c_str(),
+             e.what());
+  }
+  catch (Imu::timeout_error &e) {
+    ROS_WARN("%s: Failed to change field selection: %s", dev.name.c_str(),
+             e.what());
   }
 }
 
 std::shared_ptr<diagnostic_updater::TopicDiagnostic> configTopicDiagnostic(
-    const std::string& name, double * target) {
+    diagnostic_updater::Updater &updater, const std::string& name,
+    double * target) {
   std::shared_ptr<diagnostic_updater::TopicDiagnostic> diag;
   const double period = 1.0 / *target;  //  for 1000Hz, period is 1e-3
 
   diagnostic_updater::FrequencyStatusParam freqParam(target, target, 0.01, 10);
   diagnostic_updater::TimeStampStatusParam timeParam(0, period * 0.5);
   diag.reset(new diagnostic_updater::TopicDiagnostic(name,
-                                                     *updater,
+                                                     updater,
                                                      freqParam,
                                                      timeParam));
   return diag;
 }
 
+// Bytes per second the device streams with the given decimations and fields
+double streamLoad(const Device &dev, uint16_t imuDecimation,
+                  uint16_t filterDecimation,
+                  const std::bitset<4> &imuSources,
+                  const std::bitset<8> &filterSources) {
+  return Imu::imuPacketSize(imuSources) * dev.imuBaseRate /
+      static_cast<double>(imuDecimation) +
+      Imu::filterPacketSize(filterSources) * dev.filterBaseRate /
+      static_cast<double>(filterDecimation);
+}
+
+// Bytes per second a UART carries with 8N1 framing
+double linkCapacity(unsigned int baud) {
+  return baud / 10.0;
+}
+
 void updateDiagnosticInfo(diagnostic_updater::DiagnosticStatusWrapper& stat,
-                          imu_3dm_gx4::Imu* imu) {
+                          Device* dev) {
   //  add base device info
-  std::map<std::string,std::string> map = info.toMap();
-  for (const std::pair<std::string,std::string>& p : map) {
+  for (const std::pair<std::string,std::string>& p : dev->infoValues) {
     stat.add(p.first, p.second);
   }
+  stat.add("Reconnects", dev->reconnects);
+  stat.add("Last reconnect duration [s]", dev->reconnectDuration);
+  const RttEstimator::Stats &rtt = dev->imu->rtt().stats();
+  stat.add("Command RTT samples", rtt.samples);
+  stat.add("Command timeouts", rtt.timeouts);
+  stat.add("Command retries", rtt.retries);
+  stat.add("Ping RTT [ms]", dev->imu->pingRtt() * 1e3);
+  const double load = streamLoad(*dev, dev->imuDecimation,
+                                 dev->filterDecimation, dev->imuSources,
+                                 dev->filterSources);
+  stat.add("Baud rate", dev->baudrate);
+  stat.add("Link load [B/s]", load);
+  stat.add("Link capacity [B/s]", linkCapacity(dev->baudrate));
+  stat.add("Link utilization [%]", 100 * load / linkCapacity(dev->baudrate));
+  stat.add("Rate changes", dev->rateChanges);
+  stat.add("Last rate change gap [s]", dev->rateChangeGap);
+
+  if (dev->reconnecting) {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::ERROR,
+                 "Disconnected, waiting for the device.");
+    return;
+  }
+  if (dev->statusPollPeriod <= 0) {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::OK,
+                 "Diagnostic info polling disabled.");
+    return;
+  }
 
-  try {
-    //  try to read diagnostic info
-    imu->getDiagnosticInfo(fields);
+  //  the device is polled from the main loop, only the last reply is shown
+  const Imu::DiagnosticSnapshot snapshot = dev->imu->diagnosticSnapshot();
+  if (snapshot.reports == 0) {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
+                 "No diagnostic info received yet.");
+    return;
+  }
+  unsigned int values[Imu::DiagnosticFields::kNumValues];
+  snapshot.fields.values(values);
+  for (size_t i = 0; i < Imu::DiagnosticFields::kNumValues; i++) {
+    stat.add(Imu::DiagnosticFields::kNames[i], values[i]);
+  }
+  const double age = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - snapshot.received).count();
+  stat.add("Diagnostic info age [s]", age);
+  if (age > 3 * dev->statusPollPeriod) {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
+                 "Diagnostic info is stale.");
+  } else {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::OK,
+                 "Read diagnostic info.");
+  }
+}
+
+// Increase of a device counter, which restarts from 0 after a power cycle
+uint64_t counterDelta(uint32_t before, uint32_t after) {
+  return (after >= before) ? after - before : after;
+}
 
-    auto map = fields.toMap();
-    for (const std::pair<std::string, unsigned int>& p : map) {
-      stat.add(p.first, p.second);
+// Host counters and the attribution of lost packets to the device, the link or
+// the host, between the last two status reports of the device
+void updateLinkDiagnostic(diagnostic_updater::DiagnosticStatusWrapper& stat,
+                          Device* dev) {
+  const LinkMonitor::Counters now = dev->imu->link().counters();
+
+  stat.add("Bytes read", now.bytes);
+  stat.add("Resync bytes", now.resyncBytes);
+  stat.add("Checksum errors", now.checksumErrors);
+  stat.add("Parse errors", now.parseErrors);
+  stat.add("IMU packets", now.packets[LinkMonitor::ImuStream]);
+  stat.add("IMU gaps", now.gaps[LinkMonitor::ImuStream]);
+  stat.add("IMU packets missed", now.missed[LinkMonitor::ImuStream]);
+  stat.add("Filter packets", now.packets[LinkMonitor::FilterStream]);
+  stat.add("Filter gaps", now.gaps[LinkMonitor::FilterStream]);
+  stat.add("Filter packets missed", now.missed[LinkMonitor::FilterStream]);
+
+  //  the host counters are read along with each report, so both cover the
+  //  same interval
+  const Imu::DiagnosticSnapshot snapshot = dev->imu->diagnosticSnapshot();
+  if (snapshot.reports != dev->linkLatest.reports) {
+    dev->linkPrevious = dev->linkLatest;
+    dev->linkLatest = snapshot;
+    memset(&dev->lastLosses, 0, sizeof(dev->lastLosses));
+    if (dev->linkPrevious.reports > 0) {
+      const Imu::DiagnosticFields &a = dev->linkPrevious.fields;
+      const Imu::DiagnosticFields &b = dev->linkLatest.fields;
+      const uint64_t dropped =
+          counterDelta(a.imuPacketsDropped, b.imuPacketsDropped) +
+          counterDelta(a.filterPacketsDropped, b.filterPacketsDropped);
+      const uint64_t overruns =
+          counterDelta(a.comNumWriteOverruns, b.comNumWriteOverruns) +
+          counterDelta(a.usbNumWriteOverruns, b.usbNumWriteOverruns);
+      dev->lastLosses = LinkMonitor::attribute(dev->linkPrevious.link,
+                                               dev->linkLatest.link, dropped,
+                                               overruns);
+      dev->losses.device += dev->lastLosses.device;
+      dev->losses.link += dev->lastLosses.link;
+      dev->losses.host += dev->lastLosses.host;
     }
-    stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "Read diagnostic info.");
   }
-  catch (std::exception& e) {
-    const std::string message = std::string("Failed: ") + e.what();
-    stat.summary(diagnostic_msgs::DiagnosticStatus::ERROR, message);
+
+  const LinkMonitor::Losses &losses = dev->lastLosses;
+  if (dev->linkPrevious.reports > 0) {
+    const LinkMonitor::Counters &a = dev->linkPrevious.link;
+    const LinkMonitor::Counters &b = dev->linkLatest.link;
+    const double dt = std::chrono::duration<double>(
+        dev->linkLatest.received - dev->linkPrevious.received).count();
+    if (dt > 0) {
+      stat.add("Resync bytes/s", (b.resyncBytes - a.resyncBytes) / dt);
+      stat.add("Checksum errors/s", (b.checksumErrors - a.checksumErrors) / dt);
+      stat.add("Device losses/s", losses.device / dt);
+      stat.add("Link losses/s", losses.link / dt);
+      stat.add("Host losses/s", losses.host / dt);
+    }
+  }
+  stat.add("Device losses", dev->losses.device);
+  stat.add("Link losses", dev->losses.link);
+  stat.add("Host losses", dev->losses.host);
+
+  if (losses.device || losses.link || losses.host) {
+    std::stringstream ss;
+    ss << "Lost packets: " << losses.device << " device, " << losses.link <<
+          " link, " << losses.host << " host.";
+    stat.summary(diagnostic_msgs::DiagnosticStatus::WARN, ss.str());
+  } else {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "No losses.");
   }
 }
 
-int main(int argc, char **argv) {
-  ros::init(argc, argv, "imu_3dm_gx4");
-  ros::NodeHandle nh;
+void updateWatchdogDiagnostic(diagnostic_updater::DiagnosticStatusWrapper& stat,
+                              Device* dev) {
+  const StreamWatchdog::Stats &stats = dev->watchdog->stats();
+  stat.add("Samples", stats.samples);
+  stat.add("Late samples", stats.lateSamples);
+  stat.add("Stalls", stats.stalls);
+  stat.add("Recovery actions", stats.recoveries);
+  stat.add("Last gap [ms]", stats.lastGap * 1e3);
+  stat.add("Max gap [ms]", stats.maxGap * 1e3);
+  stat.add("Mean gap [ms]", stats.meanGap * 1e3);
+  stat.add("Last stall [ms]", stats.lastStallGap * 1e3);
+  if (dev->watchdog->stalled()) {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::ERROR, "Stream stalled.");
+  } else {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "Streaming.");
+  }
+}
 
-  std::string name, device;
-  int baudrate;
-  int requestedImuRate, requestedFilterRate;
-  bool verbose;
+void updateHeadingDiagnostic(diagnostic_updater::DiagnosticStatusWrapper& stat,
+                             Device* dev) {
+  const Imu::HeadingStats stats = dev->imu->externalHeadingStats();
+  stat.add("Queued", stats.queued);
+  stat.add("Sent", stats.sent);
+  stat.add("Coalesced", stats.coalesced);
+  stat.add("Rejected", stats.rejected);
+  stat.add("Dropped", stats.dropped);
+  stat.add("Last latency [us]", stats.lastLatency * 1e6);
+  stat.add("Mean latency [us]", stats.meanLatency * 1e6);
+  stat.add("Max latency [us]", stats.maxLatency * 1e6);
+  if (stats.rejected > 0 || stats.dropped > 0) {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::WARN,
+                 "Updates were rejected or dropped.");
+  } else {
+    stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "Forwarding updates.");
+  }
+}
 
-  // Variables for IMU Reference Position
-  std::string headingUpdateSource, declinationSource;
-  float rollDeg, rollRad, pitchDeg, pitchRad, yawDeg, yawRad;
-  double latitude, longitude, altitude, declinationDeg;
+void updateCommandQueueDiagnostic(
+    diagnostic_updater::DiagnosticStatusWrapper& stat, Device* dev) {
+  static const char *names[TxScheduler::kNumPriorities] = {
+    "Aiding", "Control", "Background"
+  };
+  for (int p = 0; p < TxScheduler::kNumPriorities; p++) {
+    const TxScheduler::Stats stats =
+        dev->imu->txStats(static_cast<TxScheduler::Priority>(p));
+    const std::string name(names[p]);
+    stat.add(name + " queued", stats.queued);
+    stat.add(name + " sent", stats.sent);
+    stat.add(name + " coalesced", stats.coalesced);
+    stat.add(name + " deferred", stats.deferred);
+    stat.add(name + " mean delay [ms]", stats.meanDelay * 1e3);
+    stat.add(name + " max delay [ms]", stats.maxDelay * 1e3);
+  }
+  stat.add("Pending", dev->imu->pendingPosts());
+  stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "Command queue.");
+}
 
-  // Sensor LPF Bandwidths
-  int magLPFBandwidth3DM, accelLPFBandwidth3DM, gyroLPFBandwidth3DM;
+// Read a device parameter from the device namespace, falling back to the node
+// namespace so that settings shared by all devices need only be given once
+template <typename T>
+void deviceParam(const Device &dev, const ros::NodeHandle &nh,
+                 const std::string &key, T &value, const T &def) {
+  if (!dev.nh.getParam(key, value)) {
+    nh.param<T>(key, value, def);
+  }
+}
 
-  // Hard and Soft Iron Offset
-  bool enable_iron_offset;
-  float hx, hy, hz, m11, m12, m13, m21, m22, m23, m31, m32, m33;
+// Load the parameters of one device, returns false if they are invalid
+bool loadParameters(Device &dev, const ros::NodeHandle &nh,
+                    const std::string &defaultFrameId) {
+  std::string filterOutput;
 
   // Load Main Parameters from Launch File
-  nh.param<std::string>("name", name, (std::string)"imu");
-  nh.param<std::string>("device", device, "/dev/imu");
-  nh.param<int>("baudrate", baudrate, 115200);
-  nh.param<std::string>("frame_id", frameId, std::string("imu"));
-  nh.param<int>("imu_rate", requestedImuRate, 100);
-  nh.param<int>("filter_rate", requestedFilterRate, 100);
-  nh.param<bool>("verbose", verbose, false);
+  //  device, frame and outputs must be unique, they are never shared
+  dev.nh.param<std::string>("device", dev.device, "/dev/imu");
+  dev.nh.param<std::string>("frame_id", dev.frameId, defaultFrameId);
+  dev.imuMsg.header.frame_id = dev.frameId;
+  dev.imuMsg.orientation_covariance[0] =
+      -1; //  orientation data is on a separate topic
+  dev.magMsg.header.frame_id = dev.frameId;
+  dev.pressureMsg.header.frame_id = dev.frameId;
+  dev.filterMsg.header.frame_id = dev.frameId;
+  dev.filterCompactMsg.header.frame_id = dev.frameId;
+  deviceParam<int>(dev, nh, "baudrate", dev.baudrate, 115200);
+  deviceParam<int>(dev, nh, "imu_rate", dev.requestedImuRate, 100);
+  deviceParam<int>(dev, nh, "filter_rate", dev.requestedFilterRate, 100);
+  deviceParam<bool>(dev, nh, "verbose", dev.verbose, false);
+  deviceParam<int>(dev, nh, "imu_batch_size", dev.imuBatchSize, 0);
+  deviceParam<double>(dev, nh, "imu_batch_period", dev.imuBatchPeriod, 0.0);
+  deviceParam<double>(dev, nh, "unsubscribed_timeout", dev.unsubscribedTimeout,
+                      0.0);
+  deviceParam<std::string>(dev, nh, "filter_output", filterOutput,
+                           std::string("full"));
 
   // Parameters for IMU Reference Position
-  nh.param<double>("latitude", latitude, 39.9984f); //Default is Columbus latitude
-  nh.param<double>("longitude", longitude, -83.0179f); //Default is Columbus longitude
-  nh.param<double>("altitude", altitude, 224.0f); //Default is Columbus altitude
-  nh.param<double>("declination", declinationDeg, 7.01f); //Default is Columbus declination
-  nh.param<float>("roll", rollDeg, 0.0f); //Default is 0.0 deg
-  nh.param<float>("pitch", pitchDeg, 0.0f); //Default is 0.0 deg
-  nh.param<float>("yaw", yawDeg, 0.0f); //Default is 0.0 deg
-  nh.param<std::string>("heading_update_source", headingUpdateSource, std::string("magnetometer")); //Default is magnetometer
-  nh.param<std::string>("declination_source", declinationSource, std::string("manual")); //Default is World Magnetic Model
-
-  nh.param<int>("mag_LPF_bandwidth", magLPFBandwidth3DM, 15);
-  nh.param<int>("accel_LPF_bandwidth", accelLPFBandwidth3DM, 50);
-  nh.param<int>("gyro_LPF_bandwidth", gyroLPFBandwidth3DM, 50);
-
-  nh.param<bool>("enable_iron_offset", enable_iron_offset, false);
-  nh.param<float>("hx", hx, 0.0);
-  nh.param<float>("hy", hy, 0.0);
-  nh.param<float>("hz", hz, 0.0);
-  nh.param<float>("m11", m11, 1.0);
-  nh.param<float>("m12", m12, 0.0);
-  nh.param<float>("m13", m13, 0.0);
-  nh.param<float>("m21", m21, 0.0);
-  nh.param<float>("m22", m22, 1.0);
-  nh.param<float>("m23", m23, 0.0);
-  nh.param<float>("m31", m31, 0.0);
-  nh.param<float>("m32", m32, 0.0);
-  nh.param<float>("m33", m33, 1.0);
-  float hard_offset[3] = {hx, hy, hz};
-  float soft_matrix[9] = {m11, m12, m13, m21, m22, m23, m31, m32, m33};
-
-  if (requestedFilterRate < 0 || requestedImuRate < 0) {
-    ROS_ERROR("imu_rate and filter_rate must be > 0");
-    return -1;
+  deviceParam<double>(dev, nh, "latitude", dev.latitude, 39.9984f); //Default is Columbus latitude
+  deviceParam<double>(dev, nh, "longitude", dev.longitude, -83.0179f); //Default is Columbus longitude
+  deviceParam<double>(dev, nh, "altitude", dev.altitude, 224.0f); //Default is Columbus altitude
+  deviceParam<double>(dev, nh, "declination", dev.declinationDeg, 7.01f); //Default is Columbus declination
+  deviceParam<float>(dev, nh, "roll", dev.rollDeg, 0.0f); //Default is 0.0 deg
+  deviceParam<float>(dev, nh, "pitch", dev.pitchDeg, 0.0f); //Default is 0.0 deg
+  deviceParam<float>(dev, nh, "yaw", dev.yawDeg, 0.0f); //Default is 0.0 deg
+  deviceParam<std::string>(dev, nh, "heading_update_source", dev.headingUpdateSource, std::string("magnetometer")); //Default is magnetometer
+  deviceParam<std::string>(dev, nh, "declination_source", dev.declinationSource, std::string("manual")); //Default is World Magnetic Model
+
+  deviceParam<int>(dev, nh, "mag_LPF_bandwidth", dev.magLPFBandwidth3DM, 15);
+  deviceParam<int>(dev, nh, "accel_LPF_bandwidth", dev.accelLPFBandwidth3DM, 50);
+  deviceParam<int>(dev, nh, "gyro_LPF_bandwidth", dev.gyroLPFBandwidth3DM, 50);
+
+  deviceParam<bool>(dev, nh, "enable_iron_offset", dev.enableIronOffset, false);
+  const char *hardKeys[3] = {"hx", "hy", "hz"};
+  for (int i = 0; i < 3; i++) {
+    deviceParam<float>(dev, nh, hardKeys[i], dev.hardOffset[i], 0.0);
   }
+  const char *softKeys[9] = {"m11", "m12", "m13", "m21", "m22", "m23",
+                             "m31", "m32", "m33"};
+  for (int i = 0; i < 9; i++) {
+    deviceParam<float>(dev, nh, softKeys[i], dev.softMatrix[i],
+                       (i % 4 == 0) ? 1.0 : 0.0);
+  }
+
+  deviceParam<double>(dev, nh, "command_timeout_floor", dev.timeoutFloor, 0.01);
+  deviceParam<double>(dev, nh, "command_timeout_ceiling", dev.timeoutCeiling,
+                      1.0);
+  deviceParam<double>(dev, nh, "command_timeout_initial", dev.timeoutInitial,
+                      0.3);
+  deviceParam<int>(dev, nh, "command_retries", dev.commandRetries, 2);
+  if (!(dev.timeoutFloor > 0) || dev.timeoutCeiling < dev.timeoutFloor ||
+      dev.commandRetries < 0) {
+    ROS_ERROR("%s: Invalid command timeouts", dev.name.c_str());
+    return false;
+  }
+
+  deviceParam<std::string>(dev, nh, "link_policy", dev.linkPolicy,
+                           std::string("auto_baud"));
+  deviceParam<double>(dev, nh, "link_max_utilization", dev.linkMaxUtilization,
+                      0.8);
+  if (dev.linkPolicy != "auto_baud" && dev.linkPolicy != "reject" &&
+      dev.linkPolicy != "degrade") {
+    ROS_ERROR("%s: link_policy must be one of: auto_baud, reject, degrade",
+              dev.name.c_str());
+    return false;
+  }
+  if (!(dev.linkMaxUtilization > 0) || dev.linkMaxUtilization > 1) {
+    ROS_ERROR("%s: link_max_utilization must be in (0, 1]", dev.name.c_str());
+    return false;
+  }
+
+  deviceParam<double>(dev, nh, "status_poll_period", dev.statusPollPeriod, 1.0);
+
+  int stallPeriods;
+  double stallRecoveryWindow;
+  deviceParam<int>(dev, nh, "stall_periods", stallPeriods, 10);
+  deviceParam<double>(dev, nh, "stall_recovery_window", stallRecoveryWindow,
+                      0.2);
+  if (stallPeriods > 0) {
+    dev.watchdog.reset(new StreamWatchdog(stallPeriods, stallRecoveryWindow));
+  }
+
+  std::vector<double> leverArm(3, 0.0);
+  dev.nh.getParam("lever_arm", leverArm);
+  if (leverArm.size() != 3) {
+    ROS_ERROR("%s: lever_arm must have 3 elements", dev.name.c_str());
+    return false;
+  }
+  for (int i = 0; i < 3; i++) {
+    dev.leverArm[i] = leverArm[i];
+  }
+
+  if (dev.requestedFilterRate < 0 || dev.requestedImuRate < 0) {
+    ROS_ERROR("%s: imu_rate and filter_rate must be > 0", dev.name.c_str());
+    return false;
+  }
+  if (filterOutput != "full" && filterOutput != "compact" &&
+      filterOutput != "both") {
+    ROS_ERROR("%s: filter_output must be one of: full, compact, both",
+              dev.name.c_str());
+    return false;
+  }
+  dev.filterOutputFull = (filterOutput != "compact");
+  dev.filterOutputCompact = (filterOutput != "full");
+  if (dev.imuBatchSize < 0 || dev.imuBatchPeriod < 0) {
+    ROS_ERROR("%s: imu_batch_size and imu_batch_period must be >= 0",
+              dev.name.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Advertise the topics of one device and create its non-ROS outputs
+bool createOutputs(Device &dev, const ros::NodeHandle &nh) {
+  std::string shmName, streamSocket;
+  int shmCapacity, streamQueueLength;
+  dev.nh.param<std::string>("shm_name", shmName, std::string(""));
+  deviceParam<int>(dev, nh, "shm_capacity", shmCapacity, 1024);
+  dev.nh.param<std::string>("stream_socket", streamSocket, std::string(""));
+  deviceParam<int>(dev, nh, "stream_queue_length", streamQueueLength, 256);
+
+  dev.pubIMU = dev.nh.advertise<sensor_msgs::Imu>("imu", 1);
+  dev.pubMag = dev.nh.advertise<imu_3dm_gx4::MagFieldCF>("magnetic_field", 1);
+  dev.pubPressure = dev.nh.advertise<sensor_msgs::FluidPressure>("pressure", 1);
+  if (dev.filterOutputFull) {
+    dev.pubFilter = dev.nh.advertise<imu_3dm_gx4::FilterOutput>("filter", 1);
+  }
+  if (dev.filterOutputCompact) {
+    dev.pubFilterCompact =
+        dev.nh.advertise<imu_3dm_gx4::FilterOutputCompact>("filter_compact", 1);
+  }
+  if (dev.imuBatchSize > 0 || dev.imuBatchPeriod > 0) {
+    dev.pubIMUBatch = dev.nh.advertise<imu_3dm_gx4::IMUBatch>("imu_batch", 1);
+    resetBatch(dev);
+  }
+
+  if (!shmName.empty()) {
+    if (shmCapacity <= 0) {
+      ROS_ERROR("%s: shm_capacity must be > 0", dev.name.c_str());
+      return false;
+    }
+    try {
+      dev.shmRing.reset(new ShmRingWriter(shmName, shmCapacity));
+      ROS_INFO("%s: Writing samples to shared memory: %s", dev.name.c_str(),
+               shmName.c_str());
+    }
+    catch (std::exception &e) {
+      ROS_ERROR("%s: Exception: %s\n", dev.name.c_str(), e.what());
+      return false;
+    }
+  }
+
+  if (!streamSocket.empty()) {
+    if (streamQueueLength < 2) {
+      ROS_ERROR("%s: stream_queue_length must be >= 2", dev.name.c_str());
+      return false;
+    }
+    try {
+      dev.streamServer.reset(new StreamServer(streamSocket, streamQueueLength));
+      ROS_INFO("%s: Streaming samples on socket: %s", dev.name.c_str(),
+               streamSocket.c_str());
+    }
+    catch (std::exception &e) {
+      ROS_ERROR("%s: Exception: %s\n", dev.name.c_str(), e.what());
+      return false;
+    }
+  }
+  return true;
+}
+
+// Abort the configuration of a device once its deadline has passed
+void checkDeadline(const std::chrono::steady_clock::time_point &deadline) {
+  if (std::chrono::steady_clock::now() > deadline) {
+    throw std::runtime_error("Initialization timed out");
+  }
+}
+
+// Make the configured streams fit into the link before they are enabled:
+// raise the baud rate, give up, or lower the rates, as selected by link_policy
+void admitStreams(Device &dev) {
+  const char *name = dev.name.c_str();
+  const double load = streamLoad(dev, dev.imuDecimation, dev.filterDecimation,
+                                 dev.imuSources, dev.filterSources);
+  const double limit = linkCapacity(dev.baudrate) * dev.linkMaxUtilization;
+  ROS_INFO("%s: Streams need %.0f B/s, %.1f%% of %d baud", name, load,
+           100 * load / linkCapacity(dev.baudrate), dev.baudrate);
+  if (load <= limit) {
+    return;
+  }
+
+  std::stringstream report;
+  report << "Streams need " << static_cast<int>(load) << " B/s (IMU " <<
+      static_cast<int>(Imu::imuPacketSize(dev.imuSources)) << " B at " <<
+      dev.imuBaseRate / dev.imuDecimation << " Hz, filter " <<
+      static_cast<int>(Imu::filterPacketSize(dev.filterSources)) << " B at " <<
+      dev.filterBaseRate / dev.filterDecimation << " Hz), but " <<
+      dev.baudrate << " baud allows " << static_cast<int>(limit) << " B/s";
+
+  if (dev.linkPolicy == "reject") {
+    throw std::runtime_error(report.str());
+  }
+
+  if (dev.linkPolicy == "auto_baud") {
+    static const unsigned int rates[] = {
+      9600, 19200, 115200, 230400, 460800, 921600
+    };
+    for (unsigned int baud : rates) {
+      if (static_cast<int>(baud) > dev.baudrate &&
+          load <= linkCapacity(baud) * dev.linkMaxUtilization) {
+        ROS_WARN("%s: %s, switching to %u baud", name, report.str().c_str(),
+                 baud);
+        dev.imu->selectBaudRate(baud);
+        dev.baudrate = baud;
+        return;
+      }
+    }
+    throw std::runtime_error(report.str() + ", even 921600 baud is too slow");
+  }
+
+  //  degrade: lower the rate of the larger stream until both fit
+  const double imuSize = Imu::imuPacketSize(dev.imuSources);
+  const double filterSize = Imu::filterPacketSize(dev.filterSources);
+  while (streamLoad(dev, dev.imuDecimation, dev.filterDecimation,
+                    dev.imuSources, dev.filterSources) > limit) {
+    if (imuSize * dev.imuBaseRate / dev.imuDecimation >=
+        filterSize * dev.filterBaseRate / dev.filterDecimation) {
+      dev.imuDecimation++;
+    } else {
+      dev.filterDecimation++;
+    }
+  }
+  ROS_WARN("%s: %s, lowering the rates to %.1f Hz (IMU) and %.1f Hz "
+           "(filter)", name, report.str().c_str(),
+           dev.imuBaseRate / (1.0 * dev.imuDecimation),
+           dev.filterBaseRate / (1.0 * dev.filterDecimation));
+}
 
-  pubIMU = nh.advertise<sensor_msgs::Imu>("imu", 1);
-  pubMag = nh.advertise<imu_3dm_gx4::MagFieldCF>("magnetic_field", 1);
-  pubPressure = nh.advertise<sensor_msgs::FluidPressure>("pressure", 1);
-  pubFilter = nh.advertise<imu_3dm_gx4::FilterOutput>("filter", 1);
+// Connect to and configure one device, leaving it idle. The deadline is
+// checked between steps, each of which is bounded by the command timeouts.
+void configureDevice(Device &dev,
+                     const std::chrono::steady_clock::time_point &deadline) {
+  const char *name = dev.name.c_str();
 
   // Ceate new instance of the IMU
-  Imu imu(device, verbose);
+  dev.imu.reset(new Imu(dev.device, dev.verbose));
+  Imu &imu = *dev.imu;
+  imu.setCommandTimeouts(dev.timeoutFloor, dev.timeoutCeiling,
+                         dev.timeoutInitial, dev.commandRetries);
+  const std::string logName = dev.name;
+  imu.setLogSink([logName](LogRing::Level level, const char *text) {
+    switch (level) {
+    case LogRing::Debug:
+      ROS_DEBUG("%s: %s", logName.c_str(), text);
+      break;
+    case LogRing::Info:
+      ROS_INFO("%s: %s", logName.c_str(), text);
+      break;
+    case LogRing::Warn:
+      ROS_WARN("%s: %s", logName.c_str(), text);
+      break;
+    default:
+      ROS_ERROR("%s: %s", logName.c_str(), text);
+      break;
+    }
+  });
+
+  ROS_INFO("%s: Connecting to device: %s", name, dev.device.c_str());
+  imu.connect();
+  checkDeadline(deadline);
+
+  ROS_INFO("%s: Selecting baud rate %u", name, dev.baudrate);
+  imu.selectBaudRate(dev.baudrate);
+  checkDeadline(deadline);
+
+  ROS_INFO("%s: Fetching device info.", name);
+  imu.getDeviceInfo(dev.info);
+  std::map<std::string,std::string> map = dev.info.toMap();
+  for (const std::pair<std::string,std::string>& p : map) {
+    ROS_INFO("%s: \t%s: %s", name, p.first.c_str(), p.second.c_str());
+  }
+
+  ROS_INFO("%s: Idling the device", name);
+  imu.idle();
+  checkDeadline(deadline);
+
+  // Read back data rates
+  uint16_t imuBaseRate, filterBaseRate;
+  imu.getIMUDataBaseRate(imuBaseRate);
+  ROS_INFO("%s: IMU data base rate: %u Hz", name, imuBaseRate);
+  imu.getFilterDataBaseRate(filterBaseRate);
+  ROS_INFO("%s: Filter data base rate: %u Hz", name, filterBaseRate);
+
+  // Calculate and set decimation rates
+  if (static_cast<uint16_t>(dev.requestedImuRate) > imuBaseRate) {
+    throw std::runtime_error("imu_rate cannot exceed " +
+                             std::to_string(imuBaseRate));
+  }
+  if (static_cast<uint16_t>(dev.requestedFilterRate) > filterBaseRate) {
+    throw std::runtime_error("filter_rate cannot exceed " +
+                             std::to_string(filterBaseRate));
+  }
+
+  dev.imuBaseRate = imuBaseRate;
+  dev.filterBaseRate = filterBaseRate;
+  dev.imuDecimation = imuBaseRate / dev.requestedImuRate;
+  dev.filterDecimation = filterBaseRate / dev.requestedFilterRate;
+
+  //The following variables are taken from 'enum' in the struct called IMUData
+  dev.imuSources = Imu::IMUData::Accelerometer |
+      Imu::IMUData::Gyroscope |
+      Imu::IMUData::Magnetometer |
+      Imu::IMUData::Barometer;
+  //The following variables are taken from 'enum' in the struct called FilterData
+  dev.filterSources = Imu::FilterData::Quaternion |
+      Imu::FilterData::OrientationEuler |
+      Imu::FilterData::HeadingUpdate |
+      Imu::FilterData::Acceleration |
+      Imu::FilterData::AngularRate |
+      Imu::FilterData::Bias |
+      Imu::FilterData::AngleUnertainty |
+      Imu::FilterData::BiasUncertainty;
+
+  //  the device drops packets which do not fit, check before streaming
+  admitStreams(dev);
+  checkDeadline(deadline);
+
+  ROS_INFO("%s: Selecting IMU decimation: %u", name, dev.imuDecimation);
+  imu.setIMUDataRate(dev.imuDecimation, dev.imuSources);
+
+  ROS_INFO("%s: Selecting filter decimation: %u", name, dev.filterDecimation);
+  imu.setFilterDataRate(dev.filterDecimation, dev.filterSources);
+  checkDeadline(deadline);
+
+  ROS_INFO("%s: Enabling IMU data stream", name);
+  imu.enableIMUStream(true);
+
+
+  ROS_INFO("%s: Enabling filter data stream", name);
+  imu.enableFilterStream(true);
+  dev.filterStreamEnabled = true;
+
+  ROS_INFO("%s: Enabling filter measurements", name);
+  imu.enableMeasurements(true, true); // Enable accel and mag updates
+
+  ROS_INFO("%s: Enabling gyro bias estimation", name);
+  imu.enableBiasEstimation(true);
+  checkDeadline(deadline);
+
+  //  the event loop reads through a DeviceSink, the callbacks only receive
+  //  what is read while a command waits for its reply
+  imu.setIMUDataCallback(boost::bind(&publishData, boost::ref(dev), _1));
+  imu.setFilterDataCallback(boost::bind(&publishFilter, boost::ref(dev), _1));
+  if (dev.streamServer) {
+    imu.setPacketCallback(boost::bind(&publishPacket, boost::ref(dev), _1));
+  }
+
+  // Additional IMU Settings //////////////////////////////////////////////
+  // Set parameters and display them to console thru ROS_INFO
+  // The below parameters MUST be in radians
+  const float rollRad = dev.rollDeg * (PI/180);
+  const float pitchRad = dev.pitchDeg * (PI/180);
+  const float yawRad = dev.yawDeg * (PI/180);
+  dev.declinationRad = dev.declinationDeg * (PI/180);
+
+  ROS_INFO("%s: Sensor to Vehicle Frame Transformation", name);
+  imu.setSensorToVehicleTF(rollRad, pitchRad, yawRad);
+  ROS_INFO("%s: \tRoll (deg): %f", name, rollRad);
+  ROS_INFO("%s: \tPitch (deg): %f", name, pitchRad);
+  ROS_INFO("%s: \tYaw (deg): %f", name, yawRad);
+
+  ROS_INFO("%s: Reference Position", name);
+  imu.setReferencePosition(dev.latitude, dev.longitude, dev.altitude);
+  ROS_INFO("%s: \tLatitude (deg): %f", name, dev.latitude);
+  ROS_INFO("%s: \tLongitude (deg): %f", name, dev.longitude);
+  ROS_INFO("%s: \tAltitude (m): %f", name, dev.altitude);
+
+  ROS_INFO("%s: Heading Update Source", name);
+  imu.setHeadingUpdateSource(dev.headingUpdateSource);
+  ROS_INFO("%s: \tUpate Source: %s", name, dev.headingUpdateSource.c_str());
+
+  ROS_INFO("%s: Declination Source", name);
+  imu.setDeclinationSource(dev.declinationSource, dev.declinationRad);
+  checkDeadline(deadline);
+  ROS_INFO("%s: \tDec Source: %s", name, dev.declinationSource.c_str());
+  ROS_INFO("%s: \tManual Dec (deg): %f", name, dev.declinationDeg);
+
+  ROS_INFO("%s: Sensor LPF Bandwidths", name);
+  std::string magLPFType =  (dev.magLPFBandwidth3DM > 0) ? (std::string)("IIR") : (std::string)("none");
+  std::string accelLPFType =  (dev.accelLPFBandwidth3DM > 0) ? (std::string)("IIR") : (std::string)("none");
+  std::string gyroLPFType =  (dev.gyroLPFBandwidth3DM > 0) ? (std::string)("IIR") : (std::string)("none");
+  imu.setLPFBandwidth("mag", magLPFType, "manual", abs(dev.magLPFBandwidth3DM));
+  imu.setLPFBandwidth("accel", accelLPFType, "manual", abs(dev.accelLPFBandwidth3DM));
+  imu.setLPFBandwidth("gyro", gyroLPFType, "manual", abs(dev.gyroLPFBandwidth3DM));
+  ROS_INFO("%s: \tMag LPF: %s, %i [Hz]", name, magLPFType.c_str(), dev.magLPFBandwidth3DM);
+  ROS_INFO("%s: \tAccel LPF: %s, %i [Hz]]", name, accelLPFType.c_str(), dev.accelLPFBandwidth3DM);
+  ROS_INFO("%s: \tGyro LPF: %s, %i [Hz]", name, gyroLPFType.c_str(), dev.gyroLPFBandwidth3DM);
+
+  ROS_INFO("%s: Hard and Soft Iron Offsets", name);
+  ROS_INFO("%s: \tEnable Status: %i", name, dev.enableIronOffset);
+  if (dev.enableIronOffset) {
+    imu.setHardIronOffset(dev.hardOffset);
+    imu.setSoftIronMatrix(dev.softMatrix);
+    ROS_INFO("%s: \t Hx: %f", name, dev.hardOffset[0]);
+    ROS_INFO("%s: \t Hy: %f", name, dev.hardOffset[1]);
+    ROS_INFO("%s: \t Hz: %f", name, dev.hardOffset[2]);
+    for (int i = 0; i < 9; i++) {
+      ROS_INFO("%s: \t m%i%i: %f", name, i / 3 + 1, i % 3 + 1,
+               dev.softMatrix[i]);
+    }
+  }
+  //////////////////////////////////////////////////////////////////////////
+  checkDeadline(deadline);
+
+  // Calculate the actual rates we will get
+  dev.imuRate = imuBaseRate / (1.0 * dev.imuDecimation);
+  dev.filterRate = filterBaseRate / (1.0 * dev.filterDecimation);
+}
+
+// Configure all devices, running at most maxParallel configurations at once.
+// Every device has its own deadline, a failure is reported without delaying
+// the others. Returns the devices which were configured.
+std::vector<std::shared_ptr<Device>> configureDevices(
+    const std::vector<std::shared_ptr<Device>> &devices, size_t maxParallel,
+    double timeout) {
+  using namespace std::chrono;
+  std::vector<char> succeeded(devices.size(), 0);
+  std::atomic<size_t> next(0);
+
+  auto worker = [&]() {
+    for (size_t i; (i = next++) < devices.size();) {
+      Device &dev = *devices[i];
+      const steady_clock::time_point start = steady_clock::now();
+      const steady_clock::time_point deadline = (timeout > 0) ?
+          start + duration_cast<steady_clock::duration>(
+              duration<double>(timeout)) :
+          steady_clock::time_point::max();
+      try {
+        configureDevice(dev, deadline);
+        succeeded[i] = 1;
+        ROS_INFO("%s: Configured in %.2f s", dev.name.c_str(),
+                 duration<double>(steady_clock::now() - start).count());
+      }
+      catch (Imu::io_error &e) {
+        ROS_ERROR("%s: IO error: %s\n", dev.name.c_str(), e.what());
+      }
+      catch (Imu::timeout_error &e) {
+        ROS_ERROR("%s: Timeout: %s\n", dev.name.c_str(), e.what());
+      }
+      catch (std::exception &e) {
+        ROS_ERROR("%s: Exception: %s\n", dev.name.c_str(), e.what());
+      }
+    }
+  };
+
+  //  the calling thread is one of the workers
+  const size_t numThreads = std::max<size_t>(
+      1, std::min(maxParallel, devices.size()));
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < numThreads; t++) {
+    threads.push_back(std::thread(worker));
+  }
+  worker();
+  for (std::thread &t : threads) {
+    t.join();
+  }
+
+  std::vector<std::shared_ptr<Device>> configured;
+  for (size_t i = 0; i < devices.size(); i++) {
+    if (succeeded[i]) {
+      configured.push_back(devices[i]);
+    }
+  }
+  return configured;
+}
+
+// Create the diagnostic tasks of one device, prefixed with its name when
+// several devices share the node
+void configureDiagnostics(Device &dev, const std::string &diagName) {
+  dev.updater.reset(new diagnostic_updater::Updater(
+      ros::NodeHandle(), ros::NodeHandle("~"), diagName));
+  const std::string hwId = dev.info.modelName + "-" + dev.info.modelNumber;
+  dev.updater->setHardwareID(hwId);
+  //  the device info does not change, format it once
+  const std::map<std::string, std::string> info = dev.info.toMap();
+  dev.infoValues.assign(info.begin(), info.end());
+
+  dev.imuDiag = configTopicDiagnostic(*dev.updater, "imu", &dev.imuRate);
+  dev.filterDiag = configTopicDiagnostic(*dev.updater, "filter",
+                                         &dev.filterRate);
+
+  dev.updater->add("diagnostic_info",
+                   boost::bind(&updateDiagnosticInfo, _1, &dev));
+  dev.updater->add("link_statistics",
+                   boost::bind(&updateLinkDiagnostic, _1, &dev));
+  dev.updater->add("command_queue",
+                   boost::bind(&updateCommandQueueDiagnostic, _1, &dev));
+  if (dev.headingUpdateSource == "external") {
+    dev.updater->add("external_heading",
+                     boost::bind(&updateHeadingDiagnostic, _1, &dev));
+  }
+  if (dev.watchdog) {
+    dev.updater->add("stream_watchdog",
+                     boost::bind(&updateWatchdogDiagnostic, _1, &dev));
+  }
+}
+
+// Staged recovery of a stalled IMU stream: resume, then enable the streams
+// again, then reconnect. Only io_error is passed on. Returns true if the
+// device must be reconnected, which is left to tryReconnect() so the event
+// loop is never held up by probing the baud rate.
+bool recoverStream(Device &dev) {
+  const StreamWatchdog::Action action =
+      dev.watchdog->escalate(StreamWatchdog::Clock::now());
   try {
-    ROS_INFO("Connecting to device: %s", device.c_str());
-    imu.connect();
-
-    ROS_INFO("Selecting baud rate %u", baudrate);
-    imu.selectBaudRate(baudrate);
-
-    ROS_INFO("Fetching device info.");
-    imu.getDeviceInfo(info);
-    std::map<std::string,std::string> map = info.toMap();
-    for (const std::pair<std::string,std::string>& p : map) {
-      ROS_INFO("\t%s: %s", p.first.c_str(), p.second.c_str());
-    }
-
-    ROS_INFO("Idling the device");
-    imu.idle();
-
-    // Read back data rates
-    uint16_t imuBaseRate, filterBaseRate;
-    imu.getIMUDataBaseRate(imuBaseRate);
-    ROS_INFO("IMU data base rate: %u Hz", imuBaseRate);
-    imu.getFilterDataBaseRate(filterBaseRate);
-    ROS_INFO("Filter data base rate: %u Hz", filterBaseRate);
-
-    // Calculate and set decimation rates
-    if (static_cast<uint16_t>(requestedImuRate) > imuBaseRate) {
-      throw std::runtime_error("imu_rate cannot exceed " +
-                               std::to_string(imuBaseRate));
-    }
-    if (static_cast<uint16_t>(requestedFilterRate) > filterBaseRate) {
-      throw std::runtime_error("filter_rate cannot exceed " +
-                               std::to_string(filterBaseRate));
-    }
-
-    const uint16_t imuDecimation = imuBaseRate / requestedImuRate;
-    const uint16_t filterDecimation = filterBaseRate / requestedFilterRate;
-
-    ROS_INFO("Selecting IMU decimation: %u", imuDecimation);
-    //The following variables are taken from 'enum' in the struct called IMUData
-    imu.setIMUDataRate(
-        imuDecimation, Imu::IMUData::Accelerometer |
-          Imu::IMUData::Gyroscope |
-          Imu::IMUData::Magnetometer |
-          Imu::IMUData::Barometer);
-
-    ROS_INFO("Selecting filter decimation: %u", filterDecimation);
-    //The following variables are taken from 'enum' in the struct called FilterData
-    imu.setFilterDataRate(filterDecimation, Imu::FilterData::Quaternion |
-                          Imu::FilterData::OrientationEuler |
-                          Imu::FilterData::HeadingUpdate |
-                          Imu::FilterData::Acceleration |
-                          Imu::FilterData::AngularRate |
-                          Imu::FilterData::Bias |
-                          Imu::FilterData::AngleUnertainty |
-                          Imu::FilterData::BiasUncertainty);
-
-    ROS_INFO("Enabling IMU data stream");
-    imu.enableIMUStream(true);
-
-
-    ROS_INFO("Enabling filter data stream");
-    imu.enableFilterStream(true);
-
-    ROS_INFO("Enabling filter measurements");
-    imu.enableMeasurements(true, true); // Enable accel and mag updates
-
-    ROS_INFO("Enabling gyro bias estimation");
-    imu.enableBiasEstimation(true);
-
-    imu.setIMUDataCallback(publishData);
-    imu.setFilterDataCallback(publishFilter);
-
-    // Additional IMU Settings //////////////////////////////////////////////
-    // Set parameters and display them to console thru ROS_INFO
-    // The below parameters MUST be in radians
-    rollRad = rollDeg * (PI/180);
-    pitchRad = pitchDeg * (PI/180);
-    yawRad = yawDeg * (PI/180);
-    declinationRad = declinationDeg * (PI/180);
-
-    ROS_INFO("IMU Name = %s", name.c_str());
-
-    ROS_INFO("Sensor to Vehicle Frame Transformation");
-    imu.setSensorToVehicleTF(rollRad, pitchRad, yawRad);
-    ROS_INFO("\tRoll (deg): %f", rollRad);
-    ROS_INFO("\tPitch (deg): %f", pitchRad);
-    ROS_INFO("\tYaw (deg): %f", yawRad);
-
-    ROS_INFO("Reference Position");
-    imu.setReferencePosition(latitude, longitude, altitude);
-    ROS_INFO("\tLatitude (deg): %f", latitude);
-    ROS_INFO("\tLongitude (deg): %f", longitude);
-    ROS_INFO("\tAltitude (m): %f", altitude);
-
-    ROS_INFO("Heading Update Source");
-    imu.setHeadingUpdateSource(headingUpdateSource);
-    ROS_INFO("\tUpate Source: %s", headingUpdateSource.c_str());
-
-    ROS_INFO("Declination Source");
-    imu.setDeclinationSource(declinationSource, declinationRad);
-    ROS_INFO("\tDec Source: %s", declinationSource.c_str());
-    ROS_INFO("\tManual Dec (deg): %f", declinationDeg);
-
-    ROS_INFO("Sensor LPF Bandwidths");
-    std::string magLPFType =  (magLPFBandwidth3DM > 0) ? (std::string)("IIR") : (std::string)("none");
-    std::string accelLPFType =  (accelLPFBandwidth3DM > 0) ? (std::string)("IIR") : (std::string)("none");
-    std::string gyroLPFType =  (gyroLPFBandwidth3DM > 0) ? (std::string)("IIR") : (std::string)("none");
-    imu.setLPFBandwidth("mag", magLPFType, "manual", abs(magLPFBandwidth3DM));
-    imu.setLPFBandwidth("accel", accelLPFType, "manual", abs(accelLPFBandwidth3DM));
-    imu.setLPFBandwidth("gyro", gyroLPFType, "manual", abs(gyroLPFBandwidth3DM));
-    ROS_INFO("\tMag LPF: %s, %i [Hz]", magLPFType.c_str(), magLPFBandwidth3DM);
-    ROS_INFO("\tAccel LPF: %s, %i [Hz]]", accelLPFType.c_str(), accelLPFBandwidth3DM);
-    ROS_INFO("\tGyro LPF: %s, %i [Hz]", gyroLPFType.c_str(), gyroLPFBandwidth3DM);
-
-    ROS_INFO("Hard and Soft Iron Offsets");
-    ROS_INFO("\tEnable Status: %i", enable_iron_offset);
-    if(enable_iron_offset) {
-      imu.setHardIronOffset(hard_offset);
-      imu.setSoftIronMatrix(soft_matrix);
-      ROS_INFO("\t Hx: %f", hx);
-      ROS_INFO("\t Hy: %f", hy);
-      ROS_INFO("\t Hz: %f", hz);
-      ROS_INFO("\t m11: %f", m11);
-      ROS_INFO("\t m12: %f", m12);
-      ROS_INFO("\t m13: %f", m13);
-      ROS_INFO("\t m21: %f", m21);
-      ROS_INFO("\t m22: %f", m22);
-      ROS_INFO("\t m23: %f", m23);
-      ROS_INFO("\t m31: %f", m31);
-      ROS_INFO("\t m32: %f", m32);
-      ROS_INFO("\t m33: %f", m33);
-    }
-    //////////////////////////////////////////////////////////////////////////
-
-    // Configure diagnostic updater
-    if (!nh.hasParam("diagnostic_period")) {
-      nh.setParam("diagnostic_period", 0.2);  //  5hz period
-    }
-
-    updater.reset(new diagnostic_updater::Updater());
-    const std::string hwId = info.modelName + "-" + info.modelNumber;
-    updater->setHardwareID(hwId);
-
-    // Calculate the actual rates we will get
-    double imuRate = imuBaseRate / (1.0 * imuDecimation);
-    double filterRate = filterBaseRate / (1.0 * filterDecimation);
-    imuDiag = configTopicDiagnostic("imu",&imuRate);
-    filterDiag = configTopicDiagnostic("filter",&filterRate);
-
-    updater->add("diagnostic_info",
-                 boost::bind(&updateDiagnosticInfo, _1, &imu));
-
-    ROS_INFO("Resuming the device");
-    imu.resume();
-
-    while (ros::ok()) {
-      imu.runOnce();
-      updater->update();
-    }
-    imu.disconnect();
-  }
-  catch (Imu::io_error &e) {
-    ROS_ERROR("IO error: %s\n", e.what());
+    switch (action) {
+    case StreamWatchdog::Resume:
+      ROS_WARN("%s: IMU stream stalled, resuming", dev.name.c_str());
+      dev.imu->resume();
+      break;
+    case StreamWatchdog::EnableStreams:
+      ROS_WARN("%s: IMU stream stalled, enabling streams", dev.name.c_str());
+      dev.imu->enableIMUStream(true);
+      dev.imu->enableFilterStream(true);
+      dev.filterStreamEnabled = true;
+      dev.imu->resume();
+      break;
+    case StreamWatchdog::Reconnect:
+      ROS_WARN("%s: IMU stream stalled, reconnecting", dev.name.c_str());
+      return true;
+    default:
+      break;
+    }
   }
-  catch (Imu::timeout_error &e) {
-    ROS_ERROR("Timeout: %s\n", e.what());
+  catch (Imu::io_error &) {
+    throw;
   }
   catch (std::exception &e) {
-    ROS_ERROR("Exception: %s\n", e.what());
+    ROS_WARN("%s: Recovery failed: %s", dev.name.c_str(), e.what());
   }
+  return false;
+}
 
+// Forward an external heading measurement to the filter. Runs on the heading
+// spinner thread, the update is written by the thread reading the device.
+void headingCallback(const imu_3dm_gx4::HeadingUpdate::ConstPtr &msg,
+                     Device *dev) {
+  try {
+    dev->imu->setExternalHeading(msg->heading, msg->uncertainty,
+                                 msg->magnetic);
+  }
+  catch (std::exception &e) {
+    ROS_WARN_THROTTLE(1.0, "%s: Failed to queue heading update: %s",
+                      dev->name.c_str(), e.what());
+  }
+}
+
+// Convert a requested rate to a decimation of the base rate, returns false if
+// the rate is out of range
+bool rateToDecimation(double rate, uint16_t baseRate, uint16_t &decimation) {
+  if (!(rate > 0) || rate > baseRate || baseRate / rate > UINT16_MAX) {
+    return false;
+  }
+  decimation = static_cast<uint16_t>(baseRate / rate);
+  return true;
+}
+
+// Service callback changing the rates and fields of a streaming device. The
+// device is idled only for the commands which actually change something, and
+// the new field masks take effect only once those commands succeeded.
+bool setRates(imu_3dm_gx4::SetRates::Request &req,
+              imu_3dm_gx4::SetRates::Response &res, Device *dev) {
+  using std::chrono::steady_clock;
+  res.success = false;
+  res.imu_rate = dev->imuRate;
+  res.filter_rate = dev->filterRate;
+  res.command_duration = 0;
+  if (!dev->running || dev->reconnecting) {
+    res.message = "Device is not streaming";
+    return true;
+  }
+
+  uint16_t imuDecimation = dev->imuDecimation;
+  uint16_t filterDecimation = dev->filterDecimation;
+  if (req.imu_rate != 0 &&
+      !rateToDecimation(req.imu_rate, dev->imuBaseRate, imuDecimation)) {
+    res.message = "imu_rate must be in (" +
+        std::to_string(dev->imuBaseRate / UINT16_MAX) + ", " +
+        std::to_string(dev->imuBaseRate) + "]";
+    return true;
+  }
+  if (req.filter_rate != 0 &&
+      !rateToDecimation(req.filter_rate, dev->filterBaseRate,
+                        filterDecimation)) {
+    res.message = "filter_rate must be in (" +
+        std::to_string(dev->filterBaseRate / UINT16_MAX) + ", " +
+        std::to_string(dev->filterBaseRate) + "]";
+    return true;
+  }
+
+  std::bitset<4> imuMask = dev->imuFieldMask;
+  std::bitset<8> filterMask = dev->filterFieldMask;
+  if (req.set_fields) {
+    imuMask = req.imu_fields | Imu::IMUData::Accelerometer |
+        Imu::IMUData::Gyroscope;
+    filterMask = req.filter_fields;
+  }
+  //  with field selection enabled, newly allowed fields are added by
+  //  updateFieldSelection once they are wanted
+  const std::bitset<4> imuSources = (dev->unsubscribedTimeout > 0) ?
+      (dev->imuSources & imuMask) : imuMask;
+  const std::bitset<8> filterSources = (dev->unsubscribedTimeout > 0) ?
+      (dev->filterSources & filterMask) : filterMask;
+
+  const bool imuChanged = imuDecimation != dev->imuDecimation ||
+      imuSources != dev->imuSources;
+  const bool filterChanged = filterDecimation != dev->filterDecimation ||
+      filterSources != dev->filterSources;
+  if (!imuChanged && !filterChanged) {
+    dev->imuFieldMask = imuMask;
+    dev->filterFieldMask = filterMask;
+    res.success = true;
+    res.message = "Nothing to change";
+    return true;
+  }
+
+  //  the baud rate is not changed while streaming
+  const double load = streamLoad(*dev, imuDecimation, filterDecimation,
+                                 imuSources, filterSources);
+  const double limit = linkCapacity(dev->baudrate) * dev->linkMaxUtilization;
+  if (load > limit) {
+    res.message = "Streams would need " + std::to_string(load) +
+        " B/s, but " + std::to_string(dev->baudrate) + " baud allows " +
+        std::to_string(limit) + " B/s";
+    return true;
+  }
+
+  const steady_clock::time_point start = steady_clock::now();
+  try {
+    dev->imu->idle();
+    if (imuChanged) {
+      dev->imu->setIMUDataRate(imuDecimation, imuSources);
+      dev->imuDecimation = imuDecimation;
+      dev->imuSources = imuSources;
+    }
+    if (filterChanged) {
+      dev->imu->setFilterDataRate(filterDecimation, filterSources);
+      dev->filterDecimation = filterDecimation;
+      dev->filterSources = filterSources;
+    }
+    dev->imu->resume();
+  }
+  catch (std::exception &e) {
+    res.message = std::string("Failed: ") + e.what();
+    ROS_WARN("%s: Rate change failed: %s", dev->name.c_str(), e.what());
+    try {
+      dev->imu->resume();
+    }
+    catch (std::exception &) {
+      //  the watchdog takes over from here
+    }
+    return true;
+  }
+  res.command_duration =
+      std::chrono::duration<double>(steady_clock::now() - start).count();
+  dev->imuFieldMask = imuMask;
+  dev->filterFieldMask = filterMask;
+
+  //  the diagnostics hold pointers to these frequency targets
+  dev->imuRate = dev->imuBaseRate / (1.0 * dev->imuDecimation);
+  dev->filterRate = dev->filterBaseRate / (1.0 * dev->filterDecimation);
+  res.imu_rate = dev->imuRate;
+  res.filter_rate = dev->filterRate;
+  if (dev->watchdog) {
+    dev->watchdog->arm(1.0 / dev->imuRate, steady_clock::now());
+  }
+
+  //  the main loop measures the data gap once the stream comes back, the
+  //  other devices must not wait for it
+  dev->awaitingRateSample = true;
+  dev->rateChangeDeadline =
+      steady_clock::now() + std::chrono::milliseconds(kRateChangeSampleTimeout);
+  dev->rateChanges++;
+  res.success = true;
+  res.message = "Applied";
+  ROS_INFO("%s: Rates changed to %.1f Hz (IMU), %.1f Hz (filter)",
+           dev->name.c_str(), dev->imuRate, dev->filterRate);
+  return true;
+}
+
+// Try to reopen a disconnected device, returns true once it streams again.
+// Only the last baud rate is tried on the calling thread, which serves the
+// other devices; if the device does not answer at it, eg. after a power
+// cycle, all baud rates are probed on the prober thread.
+bool tryReconnect(Device &dev) {
+  using namespace std::chrono;
+  if (dev.prober.joinable()) {
+    if (dev.probing) {
+      return false;
+    }
+    dev.prober.join();
+    if (dev.probeFailed) {
+      ROS_WARN("%s: Reconnect failed: %s", dev.name.c_str(),
+               dev.probeError.c_str());
+      return false;
+    }
+    dev.awaitingSample = true;
+    return true;
+  }
+
+  const steady_clock::time_point now = steady_clock::now();
+  if (now - dev.lastAttempt < milliseconds(kReconnectInterval)) {
+    return false;
+  }
+  dev.lastAttempt = now;
+
+  //  cheap check for the device node, before going through termios
+  if (access(dev.device.c_str(), F_OK) != 0) {
+    dev.reappeared = steady_clock::time_point();
+    return false;
+  }
+  if (dev.reappeared == steady_clock::time_point()) {
+    dev.reappeared = now;
+  }
+
+  try {
+    if (!dev.imu->reconnect(false)) {
+      ROS_WARN("%s: No reply at %u baud, probing the baud rate",
+               dev.name.c_str(), dev.baudrate);
+      dev.probing = true;
+      dev.probeFailed = false;
+      Device *device = &dev;
+      dev.prober = std::thread([device]() {
+        try {
+          device->imu->reconnect(true);
+        }
+        catch (std::exception &e) {
+          device->probeError = e.what();
+          device->probeFailed = true;
+        }
+        device->probing = false;
+      });
+      return false;
+    }
+  }
+  catch (std::exception &e) {
+    ROS_WARN("%s: Reconnect failed: %s", dev.name.c_str(), e.what());
+    return false;
+  }
+  dev.awaitingSample = true;
+  return true;
+}
+
+// Periodic work which does not depend on input from the device
+void serviceDevice(Device &dev) {
+  //  posted commands held back by the pacing are not signalled again
+  if (dev.imu->pendingPosts() > 0) {
+    dev.imu->runPosted();
+  }
+  //  the reply is decoded when it arrives, nothing waits for it
+  if (dev.statusPollPeriod > 0) {
+    const std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+    if (now >= dev.nextStatusRequest) {
+      dev.imu->requestDiagnosticInfo();
+      dev.nextStatusRequest = now + std::chrono::duration_cast<
+          std::chrono::steady_clock::duration>(
+              std::chrono::duration<double>(dev.statusPollPeriod));
+    }
+  }
+  if (dev.awaitingRateSample &&
+      std::chrono::steady_clock::now() >= dev.rateChangeDeadline) {
+    dev.awaitingRateSample = false;
+    ROS_WARN("%s: No sample within %d ms of the rate change",
+             dev.name.c_str(), kRateChangeSampleTimeout);
+  }
+  dev.updater->update();
+  if (dev.streamServer) {
+    dev.streamServer->service();
+  }
+
+  if (dev.unsubscribedTimeout > 0) {
+    const ros::Time now = ros::Time::now();
+    if ((now - dev.lastFieldSelection).toSec() >= 0.5) {
+      updateFieldSelection(dev);
+      dev.lastFieldSelection = now;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "imu_3dm_gx4");
+  ros::NodeHandle nh;
+
+  //  heading updates are handled on their own thread, so they do not wait for
+  //  the event loop; outlives the subscribers of all devices
+  ros::CallbackQueue headingQueue;
+
+  //  several devices are listed by name, each with its own namespace;
+  //  without a list a single device is configured from the node namespace
+  std::vector<std::string> names;
+  int maxParallelInit;
+  double initTimeout;
+  nh.param<int>("max_parallel_init", maxParallelInit, 4);
+  nh.param<double>("init_timeout", initTimeout, 30.0);
+  const bool multiDevice = nh.getParam("devices", names) && !names.empty();
+  if (!multiDevice) {
+    names.assign(1, nh.param<std::string>("name", std::string("imu")));
+  }
+
+  std::vector<std::shared_ptr<Device>> devices;
+  for (const std::string &name : names) {
+    std::shared_ptr<Device> dev(new Device());
+    dev->name = name;
+    dev->index = devices.size();
+    dev->nh = multiDevice ? ros::NodeHandle(nh, name) : nh;
+    if (!loadParameters(*dev, nh, multiDevice ? name : std::string("imu")) ||
+        !createOutputs(*dev, nh)) {
+      return -1;
+    }
+    devices.push_back(dev);
+  }
+
+  //  virtual IMU, disabled when the rate is zero
+  double fusionRate, fusionStaleTimeout;
+  std::string fusionVoting;
+  nh.param<double>("fusion_rate", fusionRate, 0.0);
+  nh.param<std::string>("fusion_voting", fusionVoting, std::string("median"));
+  nh.param<double>("fusion_stale_timeout", fusionStaleTimeout, 0.05);
+  nh.param<std::string>("fusion_frame_id", fusionFrameId,
+                        std::string("base_link"));
+  fusionMsg.header.frame_id = fusionFrameId;
+  fusionMsg.orientation_covariance[0] = -1; //  no orientation
+  if (fusionRate > 0) {
+    if (fusionVoting != "mean" && fusionVoting != "median") {
+      ROS_ERROR("fusion_voting must be one of: mean, median");
+      return -1;
+    }
+    try {
+      fusion.reset(new ImuFusion(devices.size(), fusionRate,
+                                 (fusionVoting == "mean") ? ImuFusion::Mean :
+                                                            ImuFusion::Median,
+                                 fusionStaleTimeout));
+      for (const std::shared_ptr<Device> &dev : devices) {
+        fusion->setMounting(dev->index, dev->rollDeg * (PI/180),
+                            dev->pitchDeg * (PI/180), dev->yawDeg * (PI/180),
+                            dev->leverArm);
+      }
+    }
+    catch (std::exception &e) {
+      ROS_ERROR("Exception: %s\n", e.what());
+      return -1;
+    }
+    pubFusion = nh.advertise<sensor_msgs::Imu>("virtual/imu", 1);
+    ROS_INFO("Fusing %zu devices at %.1f Hz (%s)", devices.size(), fusionRate,
+             fusionVoting.c_str());
+  }
+
+  // Configure diagnostic updater
+  if (!nh.hasParam("diagnostic_period")) {
+    nh.setParam("diagnostic_period", 0.2);  //  5hz period
+  }
+
+  //  a device which fails to configure is dropped, the others keep running
+  const std::chrono::steady_clock::time_point initStart =
+      std::chrono::steady_clock::now();
+  std::vector<std::shared_ptr<Device>> configured = configureDevices(
+      devices, std::max(maxParallelInit, 1), initTimeout);
+  if (configured.size() < devices.size()) {
+    ROS_ERROR("%zu of %zu devices failed to initialize",
+              devices.size() - configured.size(), devices.size());
+  }
+  if (configured.empty()) {
+    return 0;
+  }
+  for (const std::shared_ptr<Device> &dev : configured) {
+    configureDiagnostics(*dev, multiDevice ?
+        ros::this_node::getName() + "/" + dev->name :
+        ros::this_node::getName());
+  }
+
+  //  one epoll set services the serial ports of all devices
+  const int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    ROS_ERROR("epoll_create1: %s\n", strerror(errno));
+    return -1;
+  }
+
+  size_t numRunning = 0;
+  for (const std::shared_ptr<Device> &dev : configured) {
+    try {
+      ROS_INFO("%s: Resuming the device", dev->name.c_str());
+      dev->imu->resume();
+    }
+    catch (std::exception &e) {
+      ROS_ERROR("%s: Exception: %s\n", dev->name.c_str(), e.what());
+      continue;
+    }
+
+    //  input and posted calls are both handled by readInput()
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = dev.get();
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, dev->imu->fileDescriptor(), &ev) < 0 ||
+        epoll_ctl(epfd, EPOLL_CTL_ADD, dev->imu->submitFd(), &ev) < 0) {
+      ROS_ERROR("%s: epoll_ctl: %s\n", dev->name.c_str(), strerror(errno));
+      continue;
+    }
+    dev->running = true;
+    numRunning++;
+
+    if (dev->watchdog) {
+      dev->watchdog->arm(1.0 / dev->imuRate, StreamWatchdog::Clock::now());
+    }
+
+    //  start the subscriber timeouts from the moment streaming begins
+    dev->lastMagWanted = dev->lastPressureWanted = dev->lastFilterWanted =
+        dev->lastFieldSelection = ros::Time::now();
+
+    dev->setRatesServer = dev->nh.advertiseService<
+        imu_3dm_gx4::SetRates::Request, imu_3dm_gx4::SetRates::Response>(
+            "set_rates", boost::bind(&setRates, _1, _2, dev.get()));
+
+    if (dev->headingUpdateSource == "external") {
+      ros::SubscribeOptions ops =
+          ros::SubscribeOptions::create<imu_3dm_gx4::HeadingUpdate>(
+              "external_heading", 1,
+              boost::bind(&headingCallback, _1, dev.get()), ros::VoidPtr(),
+              &headingQueue);
+      ops.transport_hints = ros::TransportHints().tcpNoDelay();
+      dev->subHeading = dev->nh.subscribe(ops);
+    }
+  }
+  ros::AsyncSpinner headingSpinner(1, &headingQueue);
+  headingSpinner.start();
+
+  ROS_INFO("%zu of %zu devices streaming after %.2f s", numRunning,
+           devices.size(), std::chrono::duration<double>(
+               std::chrono::steady_clock::now() - initStart).count());
+
+  bool autoReconnect;
+  nh.param<bool>("auto_reconnect", autoReconnect, true);
+
+  //  stop reading from a device, posted calls wait until it is back
+  auto stopReading = [&](Device &dev) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, dev.imu->fileDescriptor(), nullptr);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, dev.imu->submitFd(), nullptr);
+    if (dev.watchdog) {
+      dev.watchdog->disarm();
+    }
+  };
+
+  //  the device is reopened from the loop, see tryReconnect()
+  auto startReconnect = [&](Device &dev) {
+    stopReading(dev);
+    dev.reconnecting = true;
+    dev.awaitingSample = false;
+    dev.reappeared = std::chrono::steady_clock::time_point();
+  };
+
+  //  a device which disconnected is either waited for or dropped
+  auto disconnected = [&](Device &dev, const char *what) {
+    ROS_ERROR("%s: IO error: %s\n", dev.name.c_str(), what);
+    if (autoReconnect) {
+      ROS_WARN("%s: Waiting for the device to reconnect", dev.name.c_str());
+      startReconnect(dev);
+    } else {
+      stopReading(dev);
+      dev.running = false;
+      numRunning--;
+    }
+  };
+
+  std::vector<struct epoll_event> events(2 * configured.size());
+  while (ros::ok() && numRunning > 0) {
+    //  wake up for the earliest watchdog deadline, there is no timer thread
+    int timeout = 5;
+    StreamWatchdog::Clock::time_point now = StreamWatchdog::Clock::now();
+    for (const std::shared_ptr<Device> &dev : configured) {
+      if (dev->running && dev->watchdog && dev->watchdog->armed()) {
+        const auto left = std::chrono::duration_cast<
+            std::chrono::microseconds>(dev->watchdog->deadline() - now);
+        timeout = std::min<int>(timeout,
+                                std::max<int>(0, (left.count() + 999) / 1000));
+      }
+    }
+
+    const int num = epoll_wait(epfd, &events[0], events.size(), timeout);
+    if (num < 0 && errno != EINTR) {
+      ROS_ERROR("epoll_wait: %s\n", strerror(errno));
+      break;
+    }
+
+    for (int i = 0; i < num; i++) {
+      Device &dev = *static_cast<Device *>(events[i].data.ptr);
+      if (!dev.running || dev.reconnecting) {
+        continue; //  disconnected by an earlier event of this round
+      }
+      try {
+        DeviceSink sink(dev);
+        dev.imu->readInput(sink);
+      }
+      catch (Imu::io_error &e) {
+        //  device disconnected, keep servicing the others
+        disconnected(dev, e.what());
+      }
+    }
+
+    for (const std::shared_ptr<Device> &dev : configured) {
+      if (!dev->running) {
+        continue;
+      }
+      if (dev->reconnecting) {
+        //  the diagnostics read the Imu, which the prober owns meanwhile
+        if (!dev->probing) {
+          dev->updater->update();
+        }
+        if (tryReconnect(*dev)) {
+          struct epoll_event ev;
+          ev.events = EPOLLIN;
+          ev.data.ptr = dev.get();
+          epoll_ctl(epfd, EPOLL_CTL_ADD, dev->imu->fileDescriptor(), &ev);
+          epoll_ctl(epfd, EPOLL_CTL_ADD, dev->imu->submitFd(), &ev);
+          dev->reconnecting = false;
+          if (dev->watchdog) {
+            dev->watchdog->arm(1.0 / dev->imuRate,
+                               StreamWatchdog::Clock::now());
+          }
+        }
+        continue;
+      }
+      try {
+        now = StreamWatchdog::Clock::now();
+        if (dev->watchdog && dev->watchdog->expired(now)) {
+          if (recoverStream(*dev)) {
+            //  reconnected as after a disconnect, right away
+            startReconnect(*dev);
+            dev->lastAttempt = std::chrono::steady_clock::time_point();
+            continue;
+          }
+        }
+        serviceDevice(*dev);
+      }
+      catch (Imu::io_error &e) {
+        disconnected(*dev, e.what());
+      }
+    }
+
+    //  service calls
+    ros::spinOnce();
+  }
+
+  headingSpinner.stop();
+  close(epfd);
+  for (const std::shared_ptr<Device> &dev : configured) {
+    if (dev->prober.joinable()) {
+      dev->prober.join();
+      continue;
+    }
+    if (dev->running && !dev->reconnecting) {
+      dev->imu->disconnect();
+    }
+  }
   return 0;
 }
@@ -0,0 +1,227 @@
+/*
+ * imu_fusion.cpp
+ *
+ *  Resampling of several IMUs onto a common timeline, fused into a single
+ *  virtual IMU.
+ */
+
+#include "imu_3dm_gx4/imu_fusion.hpp"
+#include <stdexcept>
+#include <cmath>
+
+using namespace imu_3dm_gx4;
+
+#define kEarthGravity (9.80665)
+
+//  highest data rate of the device, sizes the per-unit buffers
+static const double kMaxSampleRate = 1000.0;
+
+ImuFusion::ImuFusion(size_t numUnits, double rate, Voting voting,
+                     double staleTimeout)
+    : period_(1e9 / rate), voting_(voting),
+      staleTimeout_(static_cast<int64_t>(staleTimeout * 1e9)), newest_(0),
+      tick_(0), ticks_(0), start_(0) {
+  if (numUnits == 0 || numUnits > kMaxUnits) {
+    throw std::runtime_error("Number of fused units must be between 1 and " +
+                             std::to_string(kMaxUnits));
+  }
+  if (!(rate > 0) || !(staleTimeout > 0)) {
+    throw std::runtime_error("Fusion rate and stale timeout must be > 0");
+  }
+
+  //  a unit may run ahead of the slowest one by up to the stale timeout
+  const size_t capacity =
+      static_cast<size_t>(std::ceil(staleTimeout * kMaxSampleRate)) + 16;
+  const float zero[3] = {0, 0, 0};
+  units_.resize(numUnits);
+  for (size_t i = 0; i < numUnits; i++) {
+    units_[i].samples.resize(capacity);
+    units_[i].head = units_[i].count = 0;
+    units_[i].lastStamp = 0;
+    setMounting(i, 0, 0, 0, zero);
+  }
+}
+
+void ImuFusion::setMounting(size_t unit, float roll, float pitch, float yaw,
+                            const float leverArm[3]) {
+  const float cr = std::cos(roll), sr = std::sin(roll);
+  const float cp = std::cos(pitch), sp = std::sin(pitch);
+  const float cy = std::cos(yaw), sy = std::sin(yaw);
+
+  //  R = Rz(yaw) * Ry(pitch) * Rx(roll)
+  float *R = units_.at(unit).rotation;
+  R[0] = cy * cp;
+  R[1] = cy * sp * sr - sy * cr;
+  R[2] = cy * sp * cr + sy * sr;
+  R[3] = sy * cp;
+  R[4] = sy * sp * sr + cy * cr;
+  R[5] = sy * sp * cr - cy * sr;
+  R[6] = -sp;
+  R[7] = cp * sr;
+  R[8] = cp * cr;
+
+  for (int i = 0; i < 3; i++) {
+    units_[unit].leverArm[i] = leverArm[i];
+  }
+}
+
+void ImuFusion::addSample(size_t unit, int64_t stamp,
+                          const Imu::IMUData &data) {
+  if (!(data.fields & Imu::IMUData::Accelerometer) ||
+      !(data.fields & Imu::IMUData::Gyroscope)) {
+    return;
+  }
+  Unit &u = units_.at(unit);
+  if (u.count > 0 && stamp <= u.lastStamp) {
+    return; //  out of order
+  }
+
+  const size_t capacity = u.samples.size();
+  if (u.count == capacity) {
+    u.head = (u.head + 1) % capacity; //  drop the oldest sample
+    u.count--;
+  }
+  Sample &s = u.samples[(u.head + u.count) % capacity];
+  s.stamp = stamp;
+  const float *R = u.rotation;
+  for (int i = 0; i < 3; i++) {
+    s.accel[i] = R[3*i] * data.accel[0] + R[3*i + 1] * data.accel[1] +
+        R[3*i + 2] * data.accel[2];
+    s.gyro[i] = R[3*i] * data.gyro[0] + R[3*i + 1] * data.gyro[1] +
+        R[3*i + 2] * data.gyro[2];
+  }
+  u.count++;
+  u.lastStamp = stamp;
+  if (stamp > newest_) {
+    newest_ = stamp;
+  }
+}
+
+bool ImuFusion::next(Output &output) {
+  if (newest_ == 0) {
+    return false; //  no samples yet
+  }
+
+  for (;;) {
+    //  (re)start the timeline on a multiple of the period, after the oldest
+    //  buffered sample of every active unit
+    if (tick_ == 0 || tick_ < newest_ - staleTimeout_) {
+      int64_t first = newest_ - staleTimeout_;
+      for (const Unit &unit : units_) {
+        if (unit.count > 0 && unit.at(0).stamp > first) {
+          first = unit.at(0).stamp;
+        }
+      }
+      start_ = static_cast<int64_t>(std::ceil(first / period_) * period_);
+      ticks_ = 0;
+      tick_ = start_;
+    }
+
+    //  gather the samples bracketing the tick, one column per unit
+    float w[kMaxUnits], invDt[kMaxUnits];
+    float a0[3][kMaxUnits], a1[3][kMaxUnits];
+    float g0[3][kMaxUnits], g1[3][kMaxUnits];
+    float r[3][kMaxUnits];
+    size_t n = 0;
+    for (Unit &unit : units_) {
+      if (unit.count == 0 || newest_ - unit.lastStamp > staleTimeout_) {
+        continue; //  inactive
+      }
+      if (unit.lastStamp < tick_) {
+        return false; //  wait for this unit to catch up
+      }
+      while (unit.count >= 2 && unit.at(1).stamp <= tick_) {
+        unit.head = (unit.head + 1) % unit.samples.size();
+        unit.count--;
+      }
+      const Sample &s0 = unit.at(0);
+      if (s0.stamp > tick_) {
+        continue; //  unit started after this tick
+      }
+      const Sample &s1 = (unit.count >= 2) ? unit.at(1) : s0;
+      const double dt = static_cast<double>(s1.stamp - s0.stamp);
+      w[n] = (dt > 0) ? (tick_ - s0.stamp) / dt : 0;
+      invDt[n] = (dt > 0) ? 1e9 / dt : 0;
+      for (int c = 0; c < 3; c++) {
+        a0[c][n] = s0.accel[c];
+        a1[c][n] = s1.accel[c];
+        g0[c][n] = s0.gyro[c];
+        g1[c][n] = s1.gyro[c];
+        r[c][n] = unit.leverArm[c];
+      }
+      n++;
+    }
+
+    const int64_t stamp = tick_;
+    ticks_++;
+    tick_ = start_ + static_cast<int64_t>(std::llround(ticks_ * period_));
+    if (n == 0) {
+      continue; //  no unit covers this tick, skip it
+    }
+
+    //  interpolate, and differentiate the angular rate
+    float a[3][kMaxUnits], g[3][kMaxUnits], alpha[3][kMaxUnits];
+    for (int c = 0; c < 3; c++) {
+      for (size_t u = 0; u < n; u++) {
+        a[c][u] = a0[c][u] + w[u] * (a1[c][u] - a0[c][u]);
+        g[c][u] = g0[c][u] + w[u] * (g1[c][u] - g0[c][u]);
+        alpha[c][u] = (g1[c][u] - g0[c][u]) * invDt[u];
+      }
+    }
+
+    //  lever arm: a - w x (w x r) - alpha x r, converted to G
+    float wr[3][kMaxUnits], acc[3][kMaxUnits];
+    for (size_t u = 0; u < n; u++) {
+      wr[0][u] = g[1][u] * r[2][u] - g[2][u] * r[1][u];
+      wr[1][u] = g[2][u] * r[0][u] - g[0][u] * r[2][u];
+      wr[2][u] = g[0][u] * r[1][u] - g[1][u] * r[0][u];
+    }
+    const float invG = 1.0f / kEarthGravity;
+    for (size_t u = 0; u < n; u++) {
+      acc[0][u] = a[0][u] - invG * (g[1][u] * wr[2][u] - g[2][u] * wr[1][u] +
+                                    alpha[1][u] * r[2][u] -
+                                    alpha[2][u] * r[1][u]);
+      acc[1][u] = a[1][u] - invG * (g[2][u] * wr[0][u] - g[0][u] * wr[2][u] +
+                                    alpha[2][u] * r[0][u] -
+                                    alpha[0][u] * r[2][u]);
+      acc[2][u] = a[2][u] - invG * (g[0][u] * wr[1][u] - g[1][u] * wr[0][u] +
+                                    alpha[0][u] * r[1][u] -
+                                    alpha[1][u] * r[0][u]);
+    }
+
+    //  vote
+    output.stamp = stamp;
+    output.numUnits = n;
+    for (int c = 0; c < 3; c++) {
+      if (voting_ == Median) {
+        output.accel[c] = median(acc[c], n);
+        output.gyro[c] = median(g[c], n);
+      } else {
+        float sumA = 0, sumG = 0;
+        for (size_t u = 0; u < n; u++) {
+          sumA += acc[c][u];
+          sumG += g[c][u];
+        }
+        output.accel[c] = sumA / n;
+        output.gyro[c] = sumG / n;
+      }
+    }
+    return true;
+  }
+}
+
+float ImuFusion::median(float *values, size_t count) {
+  //  insertion sort, count is at most kMaxUnits
+  for (size_t i = 1; i < count; i++) {
+    const float v = values[i];
+    size_t j = i;
+    for (; j > 0 && values[j - 1] > v; j--) {
+      values[j] = values[j - 1];
+    }
+    values[j] = v;
+  }
+  if (count % 2) {
+    return values[count / 2];
+  }
+  return 0.5f * (values[count / 2 - 1] + values[count / 2]);
+}
@@ -0,0 +1,95 @@
+/*
+ * link_monitor.cpp
+ *
+ *  Host-side accounting of lost and corrupted packets.
+ */
+
+#include "imu_3dm_gx4/link_monitor.hpp"
+#include <cmath>
+
+using namespace imu_3dm_gx4;
+
+static uint64_t load(const std::atomic<uint64_t> &counter) {
+  return counter.load(std::memory_order_relaxed);
+}
+
+LinkMonitor::LinkMonitor()
+    : bytes_(0), resyncBytes_(0), checksumErrors_(0), parseErrors_(0) {
+  for (int s = 0; s < kNumStreams; s++) {
+    packets_[s] = 0;
+    gaps_[s] = 0;
+    missed_[s] = 0;
+    period_[s] = 0;
+    pending_[s] = 0;
+  }
+}
+
+void LinkMonitor::setPeriod(Stream stream, double period) {
+  period_[stream] = period;
+  last_[stream] = Clock::time_point();
+  pending_[stream] = 0;
+}
+
+void LinkMonitor::restart() {
+  for (int s = 0; s < kNumStreams; s++) {
+    last_[s] = Clock::time_point();
+    pending_[s] = 0;
+  }
+}
+
+void LinkMonitor::countPacket(Stream stream, const Clock::time_point &arrival) {
+  add(packets_[stream], 1);
+  const double period = period_[stream];
+  if (period > 0 && last_[stream] != Clock::time_point()) {
+    const double dt =
+        std::chrono::duration<double>(arrival - last_[stream]).count();
+    const long missing = std::lround(dt / period) - 1;
+    if (missing < 0) {
+      //  buffered packet, it fills the last gap
+      if (pending_[stream] > 0) {
+        pending_[stream]--;
+      }
+    } else {
+      //  on time or after a gap, the previous gap is final
+      if (pending_[stream] > 0) {
+        add(gaps_[stream], 1);
+        add(missed_[stream], pending_[stream]);
+      }
+      pending_[stream] = missing;
+    }
+  }
+  last_[stream] = arrival;
+}
+
+LinkMonitor::Counters LinkMonitor::counters() const {
+  Counters c;
+  c.bytes = load(bytes_);
+  c.resyncBytes = load(resyncBytes_);
+  c.checksumErrors = load(checksumErrors_);
+  c.parseErrors = load(parseErrors_);
+  for (int s = 0; s < kNumStreams; s++) {
+    c.packets[s] = load(packets_[s]);
+    c.gaps[s] = load(gaps_[s]);
+    c.missed[s] = load(missed_[s]);
+  }
+  return c;
+}
+
+LinkMonitor::Losses LinkMonitor::attribute(const Counters &before,
+                                           const Counters &after,
+                                           uint64_t deviceDropped,
+                                           uint64_t deviceOverruns) {
+  uint64_t missed = 0;
+  for (int s = 0; s < kNumStreams; s++) {
+    missed += after.missed[s] - before.missed[s];
+  }
+  Losses losses;
+  //  the device knows what it dropped, a bad checksum is a corrupted packet,
+  //  whatever else is missing was lost between the UART driver and the reader
+  losses.device = deviceDropped + deviceOverruns;
+  losses.link = (after.checksumErrors - before.checksumErrors) +
+      (after.parseErrors - before.parseErrors);
+  const uint64_t explained = losses.device + losses.link;
+  losses.host = (missed > explained) ? missed - explained : 0;
+  return losses;
+}
@@ -0,0 +1,196 @@
+/*
+ * log_ring.cpp
+ *
+ *  Bounded, non-blocking log queue drained by a background thread.
+ */
+
+#include "imu_3dm_gx4/log_ring.hpp"
+#include <algorithm>
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+
+using namespace imu_3dm_gx4;
+
+//  how often the drain thread looks for records, the producer never wakes it
+#define kDrainPeriod (std::chrono::milliseconds(20))
+
+constexpr size_t LogRing::kMaxDump;
+
+static size_t roundUpPow2(size_t n) {
+  size_t size = 1;
+  while (size < n) {
+    size <<= 1;
+  }
+  return size;
+}
+
+LogRing::LogRing(size_t capacity, unsigned int burst, double window)
+    : ring_(roundUpPow2(capacity ? capacity : 1)), mask_(ring_.size() - 1),
+      burst_(burst),
+      window_(std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>(window))),
+      head_(0), tail_(0), dropped_(0), suppressed_(0), reportedDrops_(0),
+      numLimits_(0), stop_(false) {
+  for (Limit &limit : limits_) {
+    limit.format = nullptr;
+    limit.level = Debug;
+    limit.count = 0;
+    limit.suppressed = 0;
+    limit.reportedSuppressed = 0;
+  }
+  sink_ = [](Level, const char *text) {
+    std::cout << text << "\n" << std::flush;
+  };
+  thread_ = std::thread(&LogRing::run, this);
+}
+
+LogRing::~LogRing() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_one();
+  thread_.join();
+}
+
+void LogRing::setSink(const Sink &sink) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  sink_ = sink;
+}
+
+void LogRing::dump(Level level, const char *format, const uint8_t *data,
+                   size_t length, uint32_t a0, uint32_t a1, uint32_t a2,
+                   uint32_t a3) {
+  if (!admit(level, format)) {
+    return;
+  }
+  const uint64_t head = head_.load(std::memory_order_relaxed);
+  if (head - tail_.load(std::memory_order_acquire) > mask_) {
+    dropped_.store(dropped_.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_relaxed);
+    return; //  full, the drain thread reports the drop
+  }
+  Record &record = ring_[head & mask_];
+  record.level = level;
+  record.format = format;
+  record.args[0] = a0;
+  record.args[1] = a1;
+  record.args[2] = a2;
+  record.args[3] = a3;
+  record.length = static_cast<uint16_t>(std::min(length, kMaxDump));
+  if (record.length) {
+    memcpy(record.data, data, record.length);
+  }
+  head_.store(head + 1, std::memory_order_release);
+}
+
+bool LogRing::admit(Level level, const char *format) {
+  //  formats are string literals, so the pointer identifies the message
+  const size_t num = numLimits_.load(std::memory_order_relaxed);
+  Limit *limit = nullptr;
+  for (size_t i = 0; i < num; i++) {
+    if (limits_[i].format.load(std::memory_order_relaxed) == format) {
+      limit = &limits_[i];
+      break;
+    }
+  }
+  const Clock::time_point now = Clock::now();
+  if (!limit) {
+    if (num == kMaxLimits) {
+      return true; //  out of slots, not rate limited
+    }
+    limit = &limits_[num];
+    limit->level = level;
+    limit->start = now;
+    limit->count = 0;
+    limit->format.store(format, std::memory_order_release);
+    numLimits_.store(num + 1, std::memory_order_release);
+  }
+
+  if (now - limit->start >= window_) {
+    limit->start = now;
+    limit->count = 0;
+  }
+  if (limit->count < burst_) {
+    limit->count++;
+    return true;
+  }
+  limit->suppressed.store(
+      limit->suppressed.load(std::memory_order_relaxed) + 1,
+      std::memory_order_relaxed);
+  suppressed_.store(suppressed_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+  return false;
+}
+
+void LogRing::flush() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  drain();
+}
+
+void LogRing::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    wake_.wait_for(lock, kDrainPeriod);
+    drain();
+  }
+  drain();
+}
+
+void LogRing::emit(Level level, const char *text) {
+  sink_(level, text);
+}
+
+void LogRing::drain() {
+  //  called with mutex_ held
+  char text[64 + 3 * kMaxDump + 256];
+  const uint64_t head = head_.load(std::memory_order_acquire);
+  for (uint64_t tail = tail_.load(std::memory_order_relaxed); tail != head;
+       tail++) {
+    const Record &record = ring_[tail & mask_];
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+    int len = snprintf(text, 256, record.format, record.args[0],
+                       record.args[1], record.args[2], record.args[3]);
+#pragma GCC diagnostic pop
+    len = std::min(std::max(len, 0), 255);
+    for (size_t i = 0; i < record.length; i++) {
+      len += snprintf(text + len, sizeof(text) - len, i ? " %02x" : ": %02x",
+                      record.data[i]);
+    }
+    const Level level = record.level;
+    tail_.store(tail + 1, std::memory_order_release);
+    emit(level, text);
+  }
+
+  const Clock::time_point now = Clock::now();
+  const uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+  if (dropped != reportedDrops_ && now - dropsReported_ >= window_) {
+    snprintf(text, sizeof(text), "Log queue full, dropped %llu messages",
+             static_cast<unsigned long long>(dropped - reportedDrops_));
+    reportedDrops_ = dropped;
+    dropsReported_ = now;
+    emit(Warn, text);
+  }
+
+  const size_t num = numLimits_.load(std::memory_order_acquire);
+  for (size_t i = 0; i < num; i++) {
+    Limit &limit = limits_[i];
+    const uint64_t suppressed =
+        limit.suppressed.load(std::memory_order_relaxed);
+    if (suppressed == limit.reportedSuppressed ||
+        now - limit.reported < window_) {
+      continue;
+    }
+    //  the format itself, unformatted, identifies the suppressed message
+    snprintf(text, sizeof(text), "Suppressed %llu messages like: %s",
+             static_cast<unsigned long long>(
+                 suppressed - limit.reportedSuppressed),
+             limit.format.load(std::memory_order_relaxed));
+    limit.reportedSuppressed = suppressed;
+    limit.reported = now;
+    emit(limit.level, text);
+  }
+}
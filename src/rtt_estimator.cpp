@@ -0,0 +1,67 @@
+/*
+ * rtt_estimator.cpp
+ *
+ *  Command timeouts derived from measured round-trip times.
+ */
+
+#include "imu_3dm_gx4/rtt_estimator.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace imu_3dm_gx4;
+
+//  gains of the smoothed RTT and its deviation, as in RFC 6298
+static const double kAlpha = 1.0 / 8;
+static const double kBeta = 1.0 / 4;
+
+RttEstimator::RttEstimator(double floor, double ceiling, double initial) {
+  setLimits(floor, ceiling, initial);
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+void RttEstimator::setLimits(double floor, double ceiling, double initial) {
+  floor_ = floor;
+  ceiling_ = std::max(floor, ceiling);
+  initial_ = std::min(std::max(initial, floor_), ceiling_);
+}
+
+void RttEstimator::reset() {
+  entries_.clear();
+}
+
+void RttEstimator::sample(uint16_t type, double rtt) {
+  stats_.samples++;
+  std::map<uint16_t, Entry>::iterator it = entries_.find(type);
+  if (it == entries_.end()) {
+    Entry entry;
+    entry.srtt = rtt;
+    entry.rttvar = rtt / 2;
+    entries_[type] = entry;
+    return;
+  }
+  Entry &entry = it->second;
+  entry.rttvar = (1 - kBeta) * entry.rttvar + kBeta * std::fabs(entry.srtt - rtt);
+  entry.srtt = (1 - kAlpha) * entry.srtt + kAlpha * rtt;
+}
+
+unsigned int RttEstimator::timeout(uint16_t type) const {
+  double to = initial_;
+  std::map<uint16_t, Entry>::const_iterator it = entries_.find(type);
+  if (it != entries_.end()) {
+    to = it->second.srtt + 4 * it->second.rttvar;
+  }
+  to = std::min(std::max(to, floor_), ceiling_);
+  return static_cast<unsigned int>(std::ceil(to * 1e3));
+}
+
+unsigned int RttEstimator::backoff(unsigned int timeout) const {
+  const unsigned int ceiling =
+      static_cast<unsigned int>(std::ceil(ceiling_ * 1e3));
+  return std::min(2 * timeout, ceiling);
+}
+
+double RttEstimator::srtt(uint16_t type) const {
+  std::map<uint16_t, Entry>::const_iterator it = entries_.find(type);
+  return (it != entries_.end()) ? it->second.srtt : 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * shm_ring.cpp
+ *
+ *  Shared-memory ring buffer of decoded IMU and filter samples, for local
+ *  consumers which do not use ROS.
+ */
+
+#include "imu_3dm_gx4/shm_ring.hpp"
+#include <stdexcept>
+#include <climits>
+
+extern "C" {
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h> //  close, ftruncate
+#include <string.h> //  strerror, memcpy
+}
+
+using namespace imu_3dm_gx4;
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "Shared-memory atomics must be lock free");
+
+static int futex(std::atomic<uint32_t> *addr, int op, uint32_t val,
+                 const struct timespec *to) {
+  return syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), op, val, to,
+                 nullptr, 0);
+}
+
+ShmRingWriter::ShmRingWriter(const std::string &name, uint32_t capacity)
+    : name_(name), size_(0), header_(nullptr), slots_(nullptr), mask_(0),
+      next_(0) {
+  //  round capacity up to a power of two
+  uint32_t cap = 1;
+  while (cap < capacity && cap < (1u << 30)) {
+    cap <<= 1;
+  }
+  size_ = ShmRing::mappingSize(cap);
+
+  //  replace any stale ring left behind by a previous instance
+  shm_unlink(name_.c_str());
+  const int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to create shared memory " + name_ +
+                             ": " + strerror(errno));
+  }
+  if (ftruncate(fd, size_) < 0) {
+    const std::string err(strerror(errno));
+    close(fd);
+    shm_unlink(name_.c_str());
+    throw std::runtime_error("Failed to size shared memory " + name_ +
+                             ": " + err);
+  }
+  void *addr = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    const std::string err(strerror(errno));
+    shm_unlink(name_.c_str());
+    throw std::runtime_error("Failed to map shared memory " + name_ +
+                             ": " + err);
+  }
+
+  //  ftruncate zero-fills the object, only the header needs to be set
+  header_ = static_cast<ShmRing::Header *>(addr);
+  slots_ = reinterpret_cast<ShmRing::Slot *>(header_ + 1);
+  mask_ = cap - 1;
+
+  header_->version = ShmRing::kVersion;
+  header_->slotSize = sizeof(ShmRing::Slot);
+  header_->capacity = cap;
+  header_->imuDataSize = sizeof(Imu::IMUData);
+  header_->filterDataSize = sizeof(Imu::FilterData);
+  header_->writeIndex.store(0, std::memory_order_relaxed);
+  header_->futex.store(0, std::memory_order_relaxed);
+  header_->waiters.store(0, std::memory_order_relaxed);
+
+  //  magic last, readers check it before trusting the rest
+  std::atomic_thread_fence(std::memory_order_release);
+  header_->magic = ShmRing::kMagic;
+}
+
+ShmRingWriter::~ShmRingWriter() {
+  if (header_) {
+    munmap(header_, size_);
+    shm_unlink(name_.c_str());
+  }
+}
+
+ShmRing::Slot &ShmRingWriter::beginSlot(uint32_t type, int64_t stamp) {
+  ShmRing::Slot &slot = slots_[next_ & mask_];
+  const uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+  slot.seq.store(seq + 1, std::memory_order_relaxed); //  odd = writing
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.type = type;
+  slot.index = next_;
+  slot.stamp = stamp;
+  return slot;
+}
+
+void ShmRingWriter::commitSlot(ShmRing::Slot &slot) {
+  slot.seq.store(slot.seq.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_release);
+  header_->writeIndex.store(++next_, std::memory_order_release);
+
+  //  wake sleeping readers, the syscall is skipped if there are none
+  //  (sequentially consistent, pairs with the reader registering in waiters)
+  header_->futex.fetch_add(1);
+  if (header_->waiters.load() > 0) {
+    futex(&header_->futex, FUTEX_WAKE, INT_MAX, nullptr);
+  }
+}
+
+void ShmRingWriter::write(const Imu::IMUData &data, int64_t stamp) {
+  ShmRing::Slot &slot = beginSlot(ShmRing::IMUData, stamp);
+  memcpy(&slot.imu, &data, sizeof(data));
+  commitSlot(slot);
+}
+
+void ShmRingWriter::write(const Imu::FilterData &data, int64_t stamp) {
+  ShmRing::Slot &slot = beginSlot(ShmRing::FilterData, stamp);
+  memcpy(&slot.filter, &data, sizeof(data));
+  commitSlot(slot);
+}
+
+ShmRingReader::ShmRingReader(const std::string &name)
+    : size_(0), header_(nullptr), slots_(nullptr), mask_(0), next_(0),
+      dropped_(0) {
+  const int fd = shm_open(name.c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to open shared memory " + name + ": " +
+                             strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(ShmRing::Header)) {
+    close(fd);
+    throw std::runtime_error("Shared memory " + name + " is not a ring");
+  }
+  size_ = st.st_size;
+
+  //  read-write, since waiting readers register in the header
+  void *addr = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    throw std::runtime_error("Failed to map shared memory " + name + ": " +
+                             strerror(errno));
+  }
+  header_ = static_cast<ShmRing::Header *>(addr);
+
+  const bool valid = header_->magic == ShmRing::kMagic &&
+      header_->version == ShmRing::kVersion &&
+      header_->slotSize == sizeof(ShmRing::Slot) &&
+      header_->imuDataSize == sizeof(Imu::IMUData) &&
+      header_->filterDataSize == sizeof(Imu::FilterData) &&
+      size_ >= ShmRing::mappingSize(header_->capacity);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (!valid) {
+    munmap(header_, size_);
+    throw std::runtime_error("Shared memory " + name +
+                             " has an incompatible ring layout");
+  }
+
+  slots_ = reinterpret_cast<const ShmRing::Slot *>(header_ + 1);
+  mask_ = header_->capacity - 1;
+  next_ = header_->writeIndex.load(std::memory_order_acquire);
+}
+
+ShmRingReader::~ShmRingReader() {
+  munmap(header_, size_);
+}
+
+bool ShmRingReader::poll(ShmRing::Record &record) {
+  for (;;) {
+    const uint64_t written =
+        header_->writeIndex.load(std::memory_order_acquire);
+    if (next_ >= written) {
+      return false; //  caught up
+    }
+    if (written - next_ > mask_ + 1) {
+      //  overrun, skip to the oldest record still in the ring
+      dropped_ += written - next_ - (mask_ + 1);
+      next_ = written - (mask_ + 1);
+    }
+
+    const ShmRing::Slot &slot = slots_[next_ & mask_];
+    const uint32_t seq = slot.seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+      continue; //  being written, try again
+    }
+    record.type = slot.type;
+    record.index = slot.index;
+    record.stamp = slot.stamp;
+    if (record.type == ShmRing::IMUData) {
+      memcpy(&record.imu, &slot.imu, sizeof(record.imu));
+    } else {
+      memcpy(&record.filter, &slot.filter, sizeof(record.filter));
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) != seq) {
+      continue; //  torn read, try again
+    }
+    if (record.index != next_) {
+      continue; //  overwritten by a newer lap, re-evaluate position
+    }
+    next_++;
+    return true;
+  }
+}
+
+bool ShmRingReader::wait(ShmRing::Record &record, unsigned int timeout) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout / 1000;
+  deadline.tv_nsec += (timeout % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  for (;;) {
+    const uint32_t val = header_->futex.load(std::memory_order_acquire);
+    if (poll(record)) {
+      return true;
+    }
+
+    struct timespec now, rel;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rel.tv_sec = deadline.tv_sec - now.tv_sec;
+    rel.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+    if (rel.tv_nsec < 0) {
+      rel.tv_sec--;
+      rel.tv_nsec += 1000000000L;
+    }
+    if (rel.tv_sec < 0) {
+      return false; //  timed out
+    }
+
+    //  sleep until the writer bumps the futex word past val
+    header_->waiters.fetch_add(1);
+    futex(&header_->futex, FUTEX_WAIT, val, &rel);
+    header_->waiters.fetch_sub(1);
+  }
+}
@@ -0,0 +1,232 @@
+/*
+ * stream_server.cpp
+ *
+ *  Unix-domain socket server streaming raw MIP frames and decoded samples to
+ *  local clients which do not use ROS.
+ */
+
+#include "imu_3dm_gx4/stream_server.hpp"
+#include <stdexcept>
+#include <algorithm>
+
+extern "C" {
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h> //  close, unlink
+#include <string.h> //  strerror, memcpy
+}
+
+using namespace imu_3dm_gx4;
+
+static_assert(sizeof(StreamServer::MessageHeader) == 16,
+              "MessageHeader is part of the wire format");
+static_assert(sizeof(StreamServer::IMURecord) == 44,
+              "IMURecord is part of the wire format");
+static_assert(sizeof(StreamServer::FilterRecord) == 118,
+              "FilterRecord is part of the wire format");
+
+StreamServer::StreamServer(const std::string &path, size_t queueLength)
+    : path_(path), queueLength_(std::max<size_t>(queueLength, 2)), fd_(-1),
+      dropped_(0) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path_.size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error("Socket path is too long: " + path_);
+  }
+  strncpy(addr.sun_path, path_.c_str(), sizeof(addr.sun_path) - 1);
+
+  fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) {
+    throw std::runtime_error(std::string("Failed to create socket: ") +
+                             strerror(errno));
+  }
+
+  //  remove a stale socket left behind by a previous instance
+  unlink(path_.c_str());
+  if (bind(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 ||
+      listen(fd_, 8) < 0) {
+    const std::string err(strerror(errno));
+    close(fd_);
+    throw std::runtime_error("Failed to listen on " + path_ + ": " + err);
+  }
+}
+
+StreamServer::~StreamServer() {
+  while (!clients_.empty()) {
+    closeClient(clients_.size() - 1);
+  }
+  close(fd_);
+  unlink(path_.c_str());
+}
+
+void StreamServer::service() {
+  //  accept all pending connections
+  for (;;) {
+    const int fd = accept4(fd_, nullptr, nullptr,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      break;  //  EAGAIN, or a client which hung up already
+    }
+    Client client;
+    client.fd = fd;
+    client.subscription = 0;
+    client.dropped = 0;
+    client.queue.resize(queueLength_);
+    client.head = client.count = client.offset = 0;
+    clients_.push_back(std::move(client));
+  }
+
+  for (size_t i = 0; i < clients_.size();) {
+    if (readSubscription(clients_[i]) && flush(clients_[i])) {
+      i++;
+    } else {
+      closeClient(i);
+    }
+  }
+}
+
+void StreamServer::publish(const Imu::Packet &packet, int64_t stamp) {
+  //  wire layout of the frame: header, payload, checksum
+  uint8_t frame[Imu::Packet::kHeaderLength + sizeof(packet.payload) + 2];
+  frame[0] = packet.syncMSB;
+  frame[1] = packet.syncLSB;
+  frame[2] = packet.descriptor;
+  frame[3] = packet.length;
+  memcpy(&frame[Imu::Packet::kHeaderLength], packet.payload, packet.length);
+  frame[Imu::Packet::kHeaderLength + packet.length] = packet.checkMSB;
+  frame[Imu::Packet::kHeaderLength + packet.length + 1] = packet.checkLSB;
+  publish(Raw, RawFrame, frame, Imu::Packet::kHeaderLength + packet.length + 2,
+          stamp);
+}
+
+void StreamServer::publish(const Imu::IMUData &data, int64_t stamp) {
+  IMURecord record;
+  record.fields = data.fields;
+  memcpy(record.accel, data.accel, sizeof(record.accel));
+  memcpy(record.gyro, data.gyro, sizeof(record.gyro));
+  memcpy(record.mag, data.mag, sizeof(record.mag));
+  record.pressure = data.pressure;
+  publish(Decoded, IMUSample, &record, sizeof(record), stamp);
+}
+
+void StreamServer::publish(const Imu::FilterData &data, int64_t stamp) {
+  FilterRecord record;
+  record.fields = data.fields;
+  memcpy(record.quaternion, data.quaternion, sizeof(record.quaternion));
+  record.quaternionStatus = data.quaternionStatus;
+  memcpy(record.eulerRPY, data.eulerRPY, sizeof(record.eulerRPY));
+  record.eulerRPYStatus = data.eulerRPYStatus;
+  record.headingUpdate = data.headingUpdate;
+  record.headingUpdateUncertainty = data.headingUpdateUncertainty;
+  record.headingUpdateSource = data.headingUpdateSource;
+  record.headingUpdateFlags = data.headingUpdateFlags;
+  memcpy(record.acceleration, data.acceleration, sizeof(record.acceleration));
+  record.accelerationStatus = data.accelerationStatus;
+  memcpy(record.angularRate, data.angularRate, sizeof(record.angularRate));
+  record.angularRateStatus = data.angularRateStatus;
+  memcpy(record.eulerAngleUncertainty, data.eulerAngleUncertainty,
+         sizeof(record.eulerAngleUncertainty));
+  record.eulerAngleUncertaintyStatus = data.eulerAngleUncertaintyStatus;
+  memcpy(record.gyroBias, data.gyroBias, sizeof(record.gyroBias));
+  record.gyroBiasStatus = data.gyroBiasStatus;
+  memcpy(record.gyroBiasUncertainty, data.gyroBiasUncertainty,
+         sizeof(record.gyroBiasUncertainty));
+  record.gyroBiasUncertaintyStatus = data.gyroBiasUncertaintyStatus;
+  publish(Decoded, FilterSample, &record, sizeof(record), stamp);
+}
+
+void StreamServer::publish(uint8_t subscription, MessageType type,
+                           const void *payload, uint16_t length,
+                           int64_t stamp) {
+  for (size_t i = 0; i < clients_.size();) {
+    Client &client = clients_[i];
+    if (client.subscription & subscription) {
+      enqueue(client, type, payload, length, stamp);
+      //  send right away, unless the socket is full
+      if (!flush(client)) {
+        closeClient(i);
+        continue;
+      }
+    }
+    i++;
+  }
+}
+
+void StreamServer::enqueue(Client &client, MessageType type,
+                           const void *payload, uint16_t length,
+                           int64_t stamp) {
+  const size_t capacity = client.queue.size();
+  if (client.count == capacity) {
+    //  drop the oldest message
+    if (client.offset > 0) {
+      //  the oldest message is partially sent and must be completed to keep
+      //  the stream framed, so it replaces the next oldest instead; this is
+      //  why the queue holds at least two messages
+      const size_t next = (client.head + 1) % capacity;
+      client.queue[next] = client.queue[client.head];
+    } else {
+      client.offset = 0;
+    }
+    client.head = (client.head + 1) % capacity;
+    client.count--;
+    client.dropped++;
+    dropped_++;
+  }
+
+  Message &msg = client.queue[(client.head + client.count) % capacity];
+  MessageHeader header;
+  header.type = type;
+  header.length = length;
+  header.dropped = client.dropped;
+  header.stamp = stamp;
+  memcpy(msg.data, &header, sizeof(header));
+  memcpy(msg.data + sizeof(header), payload, length);
+  msg.size = sizeof(header) + length;
+  client.count++;
+}
+
+bool StreamServer::flush(Client &client) {
+  while (client.count > 0) {
+    const Message &msg = client.queue[client.head];
+    const ssize_t sent = send(client.fd, msg.data + client.offset,
+                              msg.size - client.offset,
+                              MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return true;  //  socket full, try again later
+      }
+      return false;   //  client went away
+    }
+    client.offset += sent;
+    if (client.offset == msg.size) {
+      client.offset = 0;
+      client.head = (client.head + 1) % client.queue.size();
+      client.count--;
+    }
+  }
+  return true;
+}
+
+bool StreamServer::readSubscription(Client &client) {
+  uint8_t buffer[16];
+  for (;;) {
+    const ssize_t amt = recv(client.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (amt > 0) {
+      client.subscription = buffer[amt - 1];  //  latest request wins
+    } else if (amt == 0) {
+      return false; //  end-of-file, client disconnected
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return true;
+    } else {
+      return false;
+    }
+  }
+}
+
+void StreamServer::closeClient(size_t index) {
+  close(clients_[index].fd);
+  clients_.erase(clients_.begin() + index);
+}
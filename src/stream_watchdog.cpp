@@ -0,0 +1,81 @@
+/*
+ * stream_watchdog.cpp
+ *
+ *  Detection of stalled data streams, with staged recovery.
+ */
+
+#include "imu_3dm_gx4/stream_watchdog.hpp"
+#include <algorithm>
+#include <cstring>
+
+using namespace imu_3dm_gx4;
+
+static StreamWatchdog::Clock::duration toDuration(double seconds) {
+  return std::chrono::duration_cast<StreamWatchdog::Clock::duration>(
+      std::chrono::duration<double>(seconds));
+}
+
+StreamWatchdog::StreamWatchdog(unsigned int missedPeriods,
+                               double recoveryWindow)
+    : missedPeriods_(missedPeriods ? missedPeriods : 1),
+      recoveryWindow_(toDuration(recoveryWindow)), window_(0), period_(0),
+      armed_(false), stalled_(false), stage_(None), gaps_(0) {
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+void StreamWatchdog::arm(double period, const Clock::time_point &now) {
+  period_ = period;
+  window_ = toDuration(period * missedPeriods_);
+  last_ = Clock::time_point(); //  no gap before the first sample
+  //  the first sample after arming may take up to the recovery window
+  deadline_ = now + std::max(window_, recoveryWindow_);
+  armed_ = true;
+  stalled_ = false;
+  stage_ = None;
+}
+
+void StreamWatchdog::disarm() {
+  armed_ = false;
+}
+
+void StreamWatchdog::sample(const Clock::time_point &now) {
+  if (!armed_) {
+    return;
+  }
+  const bool first = (last_ == Clock::time_point());
+  const double gap = std::chrono::duration<double>(now - last_).count();
+  if (!first && !stalled_) {
+    //  gaps across a stall are counted as the stall duration instead
+    stats_.lastGap = gap;
+    if (gap > stats_.maxGap) {
+      stats_.maxGap = gap;
+    }
+    gaps_++;
+    stats_.meanGap += (gap - stats_.meanGap) / gaps_;
+    if (gap > 1.5 * period_) {
+      stats_.lateSamples++;
+    }
+  }
+  if (!first && stalled_) {
+    stats_.lastStallGap = gap;
+  }
+  stats_.samples++;
+
+  last_ = now;
+  deadline_ = now + window_;
+  stalled_ = false;
+  stage_ = None;
+}
+
+StreamWatchdog::Action StreamWatchdog::escalate(const Clock::time_point &now) {
+  if (!stalled_) {
+    stalled_ = true;
+    stats_.stalls++;
+  }
+  if (stage_ != Reconnect) {
+    stage_ = static_cast<Action>(stage_ + 1);
+  }
+  stats_.recoveries++;
+  deadline_ = now + std::max(window_, recoveryWindow_);
+  return stage_;
+}
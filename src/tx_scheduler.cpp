@@ -0,0 +1,90 @@
+/*
+ * tx_scheduler.cpp
+ *
+ *  Prioritized, coalescing and paced queue of outbound commands.
+ */
+
+#include "imu_3dm_gx4/tx_scheduler.hpp"
+#include <algorithm>
+#include <cstring>
+
+using namespace imu_3dm_gx4;
+
+//  weight of the newest sample in the moving average of the queue delay
+static const double kDelayAverageWeight = 0.1;
+
+TxScheduler::TxScheduler(double rate, double burst)
+    : size_(0), rate_(rate), burst_(burst), tokens_(burst),
+      lastRefill_(Clock::now()) {
+  memset(stats_, 0, sizeof(stats_));
+}
+
+void TxScheduler::setRate(double rate, double burst) {
+  refill(Clock::now());
+  rate_ = rate;
+  burst_ = burst;
+  tokens_ = std::min(tokens_, burst_);
+}
+
+bool TxScheduler::push(Item &&item) {
+  Stats &stats = stats_[item.priority];
+  stats.queued++;
+  if (item.key != 0) {
+    for (Item &waiting : queues_[item.priority]) {
+      if (waiting.key == item.key) {
+        //  the newest command wins, everybody waiting on either is completed
+        //  when it has run
+        waiting.run = std::move(item.run);
+        for (std::promise<void> &done : item.done) {
+          waiting.done.push_back(std::move(done));
+        }
+        stats.coalesced++;
+        return true;
+      }
+    }
+  }
+  queues_[item.priority].push_back(std::move(item));
+  size_++;
+  return false;
+}
+
+bool TxScheduler::pop(const Clock::time_point &now, Item &item,
+                      Priority maxPriority) {
+  for (int p = Aiding; p <= maxPriority; p++) {
+    std::deque<Item> &queue = queues_[p];
+    if (queue.empty()) {
+      continue;
+    }
+    if (p != Aiding) {
+      refill(now);
+      if (tokens_ <= 0) {
+        stats_[p].deferred++;
+        return false;  //  strict priority, lower ones wait as well
+      }
+    }
+    item = std::move(queue.front());
+    queue.pop_front();
+    size_--;
+
+    Stats &stats = stats_[p];
+    const double delay =
+        std::chrono::duration<double>(now - item.queued).count();
+    stats.sent++;
+    stats.meanDelay = (stats.sent == 1) ? delay :
+        stats.meanDelay + kDelayAverageWeight * (delay - stats.meanDelay);
+    stats.maxDelay = std::max(stats.maxDelay, delay);
+    return true;
+  }
+  return false;
+}
+
+void TxScheduler::charge(size_t bytes) {
+  tokens_ -= bytes;
+}
+
+void TxScheduler::refill(const Clock::time_point &now) {
+  const double elapsed =
+      std::chrono::duration<double>(now - lastRefill_).count();
+  lastRefill_ = now;
+  tokens_ = std::min(burst_, tokens_ + elapsed * rate_);
+}
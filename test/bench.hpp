@@ -0,0 +1,59 @@
+/*
+ * bench.hpp
+ *
+ *  Timing helpers of the benchmark executable. Nothing asserts on the
+ *  timings, they are only reported.
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <limits>
+
+namespace bench {
+
+/**
+ * @brief nanosecondsPer Time per call of f, the best of several runs of
+ * the given number of calls.
+ */
+template <typename F> double nanosecondsPer(size_t calls, F f) {
+  double best = std::numeric_limits<double>::max();
+  for (int run = 0; run < 5; run++) {
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    for (size_t i = 0; i < calls; i++) {
+      f();
+    }
+    const std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count() / calls);
+  }
+  return best;
+}
+
+/**
+ * @brief note Print how the timings were built, they mean little without
+ * optimization.
+ */
+inline void note() {
+#ifdef __OPTIMIZE__
+  printf("optimized build\n");
+#else
+  printf("unoptimized build, configure with -DCMAKE_BUILD_TYPE=Release "
+         "for meaningful timings\n");
+#endif
+}
+
+/**
+ * @brief sink Keeps the optimizer from dropping a computed value.
+ */
+template <typename T> void sink(const T &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+} //  bench
+
+#endif // BENCH_H_
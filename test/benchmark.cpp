@@ -0,0 +1,209 @@
+/*
+ * benchmark.cpp
+ *
+ *  Timings of the packet path and the shared-memory ring: the checksum,
+ *  dispatch through callbacks and sinks, the resync over garbage, ring
+ *  writes and reads, and the latency from a writer to a reader sleeping in
+ *  wait() on another thread. Not run by ctest, the numbers are only printed.
+ */
+
+#include "imu_3dm_gx4/checksum.hpp"
+#include "imu_3dm_gx4/imu.hpp"
+#include "imu_3dm_gx4/imu_sink.hpp"
+#include "imu_3dm_gx4/shm_ring.hpp"
+#include "bench.hpp"
+#include "mip_frames.hpp"
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace imu_3dm_gx4;
+
+namespace {
+
+struct CountingSink : public ImuSink {
+  long samples;
+  CountingSink() : samples(0) {}
+  void onIMUData(const Imu::IMUData &) { samples++; }
+  void onFilterData(const Imu::FilterData &) { samples++; }
+};
+
+int64_t steadyNanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//  the lengths of an IMU packet with accelerometer and gyroscope, a filter
+//  packet with most fields, and the largest packet
+void checksum() {
+  std::vector<uint8_t> data(261);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<uint8_t>(i * 7);
+  }
+  printf("fletcher16 implementation: %s\n", fletcher16Implementation());
+  for (size_t length : {46, 132, 261}) {
+    const double scalar = bench::nanosecondsPer(200000, [&] {
+      bench::sink(fletcher16Scalar(&data[0], length));
+    });
+    const double selected = bench::nanosecondsPer(200000, [&] {
+      bench::sink(fletcher16(&data[0], length));
+    });
+    printf("%3zu bytes: %6.1f ns scalar, %6.1f ns %s\n", length, scalar,
+           selected, fletcher16Implementation());
+  }
+}
+
+//  bursts of packets through the std::function callbacks, a sink called
+//  directly, and a SinkSet of three sinks
+bool dispatch() {
+  std::vector<uint8_t> burst;
+  for (int i = 0; i < 60; i++) {
+    mip_frames::append(burst, (i % 3 == 2) ? mip_frames::filterFrame(i) :
+                                             mip_frames::imuFrame(i));
+  }
+
+  Imu callbacks("/dev/null", false);
+  long viaCallbacks = 0;
+  callbacks.setIMUDataCallback([&](const Imu::IMUData &) { viaCallbacks++; });
+  callbacks.setFilterDataCallback(
+      [&](const Imu::FilterData &) { viaCallbacks++; });
+  const double callbackTime = bench::nanosecondsPer(200, [&] {
+    callbacks.feed(burst.data(), burst.size());
+  }) / 60;
+
+  Imu direct("/dev/null", false);
+  CountingSink sink;
+  const double directTime = bench::nanosecondsPer(200, [&] {
+    direct.feed(burst.data(), burst.size(), sink);
+  }) / 60;
+
+  Imu fanOut("/dev/null", false);
+  CountingSink first, second, third;
+  SinkSet<CountingSink, CountingSink, CountingSink> sinks(first, second,
+                                                          third);
+  const double setTime = bench::nanosecondsPer(200, [&] {
+    fanOut.feed(burst.data(), burst.size(), sinks);
+  }) / 60;
+
+  printf("per sample: %.1f ns callbacks, %.1f ns sink, %.1f ns SinkSet of "
+         "three\n", callbackTime, directTime, setTime);
+  return viaCallbacks == 5 * 200 * 60 && sink.samples == viaCallbacks &&
+      third.samples == viaCallbacks;
+}
+
+//  garbage dense in false headers which claim long packets, between bursts
+bool resync() {
+  std::mt19937 random(50);
+  std::vector<uint8_t> stream;
+  size_t garbage = 0;
+  for (int burst = 0; burst < 50; burst++) {
+    for (int i = 0; i < 20; i++) {
+      mip_frames::append(stream, mip_frames::imuFrame(i));
+    }
+    for (int i = 0; i < 256; i++) {
+      mip_frames::append(stream, {0x75, 0x65, static_cast<uint8_t>(random()),
+                                  static_cast<uint8_t>(200 + random() % 56)});
+      garbage += 4;
+    }
+  }
+
+  long samples = 0;
+  const double streamTime = bench::nanosecondsPer(1, [&] {
+    Imu imu("/dev/null", false);
+    CountingSink sink;
+    for (size_t off = 0; off < stream.size(); off += 512) {
+      imu.feed(&stream[off], std::min<size_t>(512, stream.size() - off), sink);
+    }
+    samples = sink.samples;
+  });
+  printf("resync: %.1f ns per garbage byte\n", streamTime / garbage);
+  return samples == 50 * 20;
+}
+
+Imu::IMUData imuSample(float v) {
+  Imu::IMUData data;
+  data.fields = Imu::IMUData::Accelerometer | Imu::IMUData::Gyroscope;
+  data.accel[0] = v;
+  data.gyro[2] = -v;
+  return data;
+}
+
+//  one write, and one write and read by a reader which keeps up
+bool shmRing(const std::string &name) {
+  ShmRingWriter writer(name, 1024);
+  ShmRingReader reader(name);
+  const Imu::IMUData data = imuSample(1);
+  ShmRing::Record record;
+
+  const double writeTime = bench::nanosecondsPer(1000, [&] {
+    writer.write(data, 0);
+  });
+  while (reader.poll(record)) {
+  }
+  const double roundTime = bench::nanosecondsPer(1000, [&] {
+    writer.write(data, 0);
+    reader.poll(record);
+  });
+  printf("shm ring: %.1f ns per write, %.1f ns per write and read\n",
+         writeTime, roundTime);
+  return !reader.poll(record);
+}
+
+//  records written at 1 kHz, as by the driver, to a reader sleeping in wait()
+//  on another thread; each record carries the time it was written
+bool shmRingLatency(const std::string &name) {
+  const int count = 2000;
+  ShmRingWriter writer(name, 1024);
+  ShmRingReader reader(name);
+  std::vector<double> latencies;
+  latencies.reserve(count);
+
+  std::thread consumer([&] {
+    ShmRing::Record record;
+    while (latencies.size() < static_cast<size_t>(count) &&
+           reader.wait(record, 1000)) {
+      latencies.push_back((steadyNanoseconds() - record.stamp) * 1e-3);
+    }
+  });
+  const Imu::IMUData data = imuSample(1);
+  std::chrono::steady_clock::time_point next =
+      std::chrono::steady_clock::now();
+  for (int i = 0; i < count; i++) {
+    next += std::chrono::milliseconds(1);
+    std::this_thread::sleep_until(next);
+    writer.write(data, steadyNanoseconds());
+  }
+  consumer.join();
+  if (latencies.size() != static_cast<size_t>(count) ||
+      reader.dropped() != 0) {
+    return false;
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  printf("shm ring write to wake-up: %.1f us median, %.1f us p99, "
+         "%.1f us max\n", latencies[count / 2], latencies[count * 99 / 100],
+         latencies.back());
+  return true;
+}
+
+} //  namespace
+
+int main() {
+  bench::note();
+  //  one name per process, so parallel runs do not share a ring
+  const std::string ring = "/imu_3dm_gx4_bench_" + std::to_string(getpid());
+  checksum();
+  bool ok = dispatch();
+  ok = resync() && ok;
+  ok = shmRing(ring) && ok;
+  ok = shmRingLatency(ring) && ok;
+  if (!ok) {
+    fprintf(stderr, "a benchmark did not see the expected samples\n");
+    return 1;
+  }
+  return 0;
+}
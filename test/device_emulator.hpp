@@ -0,0 +1,180 @@
+/*
+ * device_emulator.hpp
+ *
+ *  A device on the master side of a pseudo terminal: streams IMU and filter
+ *  packets at 1 kHz and answers the commands read back from the driver.
+ */
+
+#ifndef DEVICE_EMULATOR_H_
+#define DEVICE_EMULATOR_H_
+
+#include "mip_frames.hpp"
+#include "reference_parser.hpp"
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <termios.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace device_emulator {
+
+/**
+ * @brief Emulator Streams one IMU and one filter packet per millisecond,
+ * carrying the sample number i as in mip_frames::imuFrame(i) and
+ * mip_frames::filterFrame(i). Every command is ACKed on the next tick, and a
+ * device status command also gets a status report.
+ */
+class Emulator {
+public:
+  Emulator() : stop_(false), samples_(0), commands_(0), statusRequests_(0),
+               headings_(0) {
+    if (openpty(&master_, &slave_, name_, NULL, NULL) != 0) {
+      throw std::runtime_error("openpty failed");
+    }
+    struct termios attributes;
+    tcgetattr(slave_, &attributes);
+    cfmakeraw(&attributes);
+    tcsetattr(slave_, TCSANOW, &attributes);
+    fcntl(master_, F_SETFL, fcntl(master_, F_GETFL) | O_NONBLOCK);
+  }
+
+  ~Emulator() {
+    stop();
+    close(slave_);
+    close(master_);
+  }
+
+  /**
+   * @brief name Path of the slave side, to open with Imu.
+   */
+  const char *name() const { return name_; }
+
+  void start() {
+    thread_ = std::thread([this] { run(); });
+  }
+
+  /**
+   * @brief stop Stop streaming. Commands are not answered afterwards.
+   */
+  void stop() {
+    stop_ = true;
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  /**
+   * @brief samples Number of IMU packets written, as many filter packets
+   * were written too.
+   */
+  int samples() const { return samples_.load(); }
+  int commands() const { return commands_.load(); }
+  int statusRequests() const { return statusRequests_.load(); }
+  int headings() const { return headings_.load(); }
+
+private:
+  void run() {
+    std::chrono::steady_clock::time_point next =
+        std::chrono::steady_clock::now();
+    std::vector<uint8_t> out;
+    while (!stop_.load()) {
+      next += std::chrono::milliseconds(1);
+      std::this_thread::sleep_until(next);
+
+      out.clear();
+      const int i = samples_.load();
+      mip_frames::append(out, mip_frames::imuFrame(i));
+      mip_frames::append(out, mip_frames::filterFrame(i));
+      answerCommands(out);
+      writeAll(out);
+      samples_ = i + 1;
+    }
+  }
+
+  void answerCommands(std::vector<uint8_t> &out) {
+    uint8_t buffer[1024];
+    for (ssize_t amt; (amt = read(master_, buffer, sizeof(buffer))) > 0;) {
+      for (const std::vector<uint8_t> &command : parser_.feed(buffer, amt)) {
+        if (command.size() < 8) {
+          continue; //  no field
+        }
+        mip_frames::append(out, reply(command[2], command[5]));
+        commands_++;
+      }
+    }
+  }
+
+  //  ACK of a command, with a status report for the device status command
+  std::vector<uint8_t> reply(uint8_t descriptor, uint8_t field) {
+    mip_frames::Frame frame(descriptor);
+    frame.raw(0xF1, {field, 0x00});
+    if (descriptor == 0x0C && field == 0x64) {
+      statusRequests_++;
+      frame.raw(0x90, statusReport());
+    } else if (descriptor == 0x0D && field == 0x17) {
+      headings_++;
+    }
+    return frame.finish();
+  }
+
+  //  the packed status report of a 3DM-GX4-25 in diagnostic mode, with the
+  //  number of IMU packets sent as totalIMUMessages
+  std::vector<uint8_t> statusReport() const {
+    std::vector<uint8_t> body;
+    pushBigEndian(body, 6234, 2); //  model number
+    body.push_back(0x02);         //  selector
+    for (int i = 0; i < 4; i++) {
+      pushBigEndian(body, 0, 4);  //  status flags to last 1PPS pulse
+    }
+    body.push_back(1);            //  IMU stream enabled
+    body.push_back(1);            //  filter stream enabled
+    for (int i = 0; i < 13; i++) {
+      pushBigEndian(body, i == 11 ? samples_.load() : 0, 4);
+    }
+    return body;
+  }
+
+  static void pushBigEndian(std::vector<uint8_t> &body, uint32_t value,
+                            int bytes) {
+    for (int b = bytes - 1; b >= 0; b--) {
+      body.push_back(static_cast<uint8_t>(value >> (8 * b)));
+    }
+  }
+
+  void writeAll(const std::vector<uint8_t> &bytes) {
+    for (size_t off = 0; off < bytes.size();) {
+      const ssize_t amt = write(master_, &bytes[off], bytes.size() - off);
+      if (amt > 0) {
+        off += amt;
+      } else if (amt < 0 && errno != EAGAIN && errno != EINTR) {
+        return; //  the slave was closed
+      } else {
+        struct pollfd p;
+        p.fd = master_;
+        p.events = POLLOUT;
+        poll(&p, 1, 1);
+      }
+    }
+  }
+
+  int master_, slave_;
+  char name_[64];
+  std::thread thread_;
+  std::atomic<bool> stop_;
+  std::atomic<int> samples_;
+  std::atomic<int> commands_;
+  std::atomic<int> statusRequests_;
+  std::atomic<int> headings_;
+  reference_parser::Parser parser_;
+};
+
+} //  device_emulator
+
+#endif // DEVICE_EMULATOR_H_
@@ -0,0 +1,90 @@
+/*
+ * fuzz_packet.cpp
+ *
+ *  libFuzzer entry point for the packet parser and decoder, and for matching
+ *  replies to commands. Built as a fuzz target where the compiler supports
+ *  -fsanitize=fuzzer, and run over the committed corpus by test_parser.cpp
+ *  otherwise.
+ */
+
+#include "imu_3dm_gx4/imu.hpp"
+#include "imu_3dm_gx4/imu_sink.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+using namespace imu_3dm_gx4;
+
+namespace {
+
+//  the samples passed on must only carry known fields, and zero the others
+struct CheckingSink : public ImuSink {
+  void onIMUData(const Imu::IMUData &data) {
+    if (!data.fields || (data.fields & ~0xFu)) {
+      abort();
+    }
+    if (!(data.fields & Imu::IMUData::Barometer) && data.pressure != 0) {
+      abort();
+    }
+  }
+
+  void onFilterData(const Imu::FilterData &data) {
+    if (!data.fields || (data.fields & ~0xFFu)) {
+      abort();
+    }
+    if (!(data.fields & Imu::FilterData::Quaternion) &&
+        (data.quaternion[0] != 0 || data.quaternionStatus != 0)) {
+      abort();
+    }
+  }
+};
+
+// The input as a command/reply pair: the class of both, the field length and
+// descriptor of the command, and the reply payload. The class is shared so
+// the fields of the reply are always looked at.
+void checkAck(const uint8_t *data, size_t size) {
+  if (size < 3) {
+    return;
+  }
+  Imu::Packet command(data[0]);
+  command.length = 2;
+  command.payload[0] = data[1];
+  command.payload[1] = data[2];
+  Imu::Packet reply(data[0]);
+  reply.length = static_cast<uint8_t>(std::min<size_t>(size - 3, 255));
+  memcpy(reply.payload, data + 3, reply.length);
+  const int code = reply.ackErrorCodeFor(command);
+  if (code < -1 || code > 255) {
+    abort();
+  }
+}
+
+} //  namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  checkAck(data, size);
+  Imu imu("/dev/null", false);
+  CheckingSink sink;
+
+  //  the first byte picks the size of the reads, so the input is split at
+  //  every possible point across runs
+  const size_t chunk = data[0] % 32 + 1;
+  data++;
+  size--;
+  while (size > 0) {
+    const size_t amt = std::min(chunk, size);
+    try {
+      imu.feed(data, amt, sink);
+    }
+    catch (std::runtime_error &) {
+      //  malformed packets are reported, and reading goes on
+    }
+    data += amt;
+    size -= amt;
+  }
+  return 0;
+}
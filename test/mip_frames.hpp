@@ -0,0 +1,104 @@
+/*
+ * mip_frames.hpp
+ *
+ *  Builds MIP data packets for the tests, independently of the driver.
+ */
+
+#ifndef MIP_FRAMES_H_
+#define MIP_FRAMES_H_
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace mip_frames {
+
+/**
+ * @brief Frame Data packet under construction, fields are appended in
+ * order and the length and checksum are filled in by finish().
+ */
+class Frame {
+public:
+  explicit Frame(uint8_t descriptor) : bytes_{0x75, 0x65, descriptor, 0} {}
+
+  Frame &field(uint8_t descriptor, const std::vector<float> &values,
+               const std::vector<uint16_t> &words = std::vector<uint16_t>()) {
+    bytes_.push_back(static_cast<uint8_t>(2 + 4 * values.size() +
+                                          2 * words.size()));
+    bytes_.push_back(descriptor);
+    for (float value : values) {
+      uint32_t u;
+      memcpy(&u, &value, sizeof(u));
+      for (int b = 3; b >= 0; b--) {
+        bytes_.push_back(static_cast<uint8_t>(u >> (8 * b)));
+      }
+    }
+    for (uint16_t word : words) {
+      bytes_.push_back(static_cast<uint8_t>(word >> 8));
+      bytes_.push_back(static_cast<uint8_t>(word));
+    }
+    return *this;
+  }
+
+  Frame &raw(uint8_t descriptor, const std::vector<uint8_t> &body) {
+    bytes_.push_back(static_cast<uint8_t>(2 + body.size()));
+    bytes_.push_back(descriptor);
+    bytes_.insert(bytes_.end(), body.begin(), body.end());
+    return *this;
+  }
+
+  std::vector<uint8_t> finish() const {
+    std::vector<uint8_t> frame(bytes_);
+    frame[3] = static_cast<uint8_t>(frame.size() - 4);
+    return checksummed(frame);
+  }
+
+  /**
+   * @brief checksummed Append the checksum to a header and payload, which
+   * may be inconsistent on purpose.
+   */
+  static std::vector<uint8_t> checksummed(std::vector<uint8_t> frame) {
+    uint8_t sum1 = 0, sum2 = 0;
+    for (uint8_t byte : frame) {
+      sum1 += byte;
+      sum2 += sum1;
+    }
+    frame.push_back(sum1);
+    frame.push_back(sum2);
+    return frame;
+  }
+
+private:
+  std::vector<uint8_t> bytes_;
+};
+
+/**
+ * @brief imuFrame IMU packet with accelerometer and gyroscope set to v.
+ */
+inline std::vector<uint8_t> imuFrame(float v) {
+  return Frame(0x80)
+      .field(0x04, {v, v + 1, v + 2})
+      .field(0x05, {-v, -v - 1, -v - 2})
+      .finish();
+}
+
+/**
+ * @brief filterFrame Filter packet with quaternion, Euler angles and angular
+ * rate derived from v.
+ */
+inline std::vector<uint8_t> filterFrame(float v) {
+  return Frame(0x82)
+      .field(0x03, {1, v, 0, 0}, {1})
+      .field(0x05, {v, -v, 2 * v}, {1})
+      .field(0x0E, {v, v, v}, {1})
+      .finish();
+}
+
+inline void append(std::vector<uint8_t> &stream,
+                   const std::vector<uint8_t> &bytes) {
+  stream.insert(stream.end(), bytes.begin(), bytes.end());
+}
+
+} //  mip_frames
+
+#endif // MIP_FRAMES_H_
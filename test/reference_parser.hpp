@@ -0,0 +1,103 @@
+/*
+ * reference_parser.hpp
+ *
+ *  The byte-wise packet parser the driver used before the memchr resync,
+ *  kept as the reference the current parser is compared against.
+ */
+
+#ifndef REFERENCE_PARSER_H_
+#define REFERENCE_PARSER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace reference_parser {
+
+/**
+ * @brief Parser State machine fed one byte at a time. A candidate which
+ * fails at the second sync byte or the checksum is dropped by one byte, and
+ * the bytes after it are parsed again.
+ */
+class Parser {
+public:
+  Parser() : reading_(false), dstIndex_(0), srcIndex_(0), length_(0) {}
+
+  /**
+   * @brief feed Append bytes, and return the frames completed by them, each
+   * from the sync bytes to the checksum.
+   */
+  std::vector<std::vector<uint8_t>> feed(const uint8_t *data, size_t size) {
+    queue_.insert(queue_.end(), data, data + size);
+    std::vector<std::vector<uint8_t>> frames;
+    while (srcIndex_ < queue_.size()) {
+      bool found = false;
+      const size_t clear = handleByte(queue_[srcIndex_], found);
+      if (found) {
+        frames.push_back(std::vector<uint8_t>(queue_.begin(),
+                                              queue_.begin() + clear));
+      }
+      if (clear) {
+        queue_.erase(queue_.begin(), queue_.begin() + clear);
+        srcIndex_ = 0;
+      } else {
+        srcIndex_++;
+      }
+    }
+    return frames;
+  }
+
+private:
+  //  number of bytes to clear from the front of the queue: 1 for a failed
+  //  candidate, the frame for a complete one, 0 to go on
+  size_t handleByte(uint8_t byte, bool &found) {
+    if (!reading_) {
+      dstIndex_ = 0;
+      if (byte != 0x75) {
+        return 1;
+      }
+      reading_ = true;
+    } else {
+      const size_t end = 4 + length_;
+      if (dstIndex_ == 1) {
+        if (byte != 0x65) {
+          reading_ = false;
+          return 1;
+        }
+      } else if (dstIndex_ == 3) {
+        length_ = byte;
+      } else if (dstIndex_ == end + 1) {
+        reading_ = false;
+        const uint16_t received =
+            static_cast<uint16_t>((queue_[end] << 8) | byte);
+        if (received != checksum(end)) {
+          return 1;
+        }
+        found = true;
+        return end + 2;
+      }
+    }
+    dstIndex_++;
+    return 0;
+  }
+
+  //  Fletcher-16 of the first size bytes of the queue
+  uint16_t checksum(size_t size) const {
+    uint8_t a = 0, b = 0;
+    for (size_t i = 0; i < size; i++) {
+      a += queue_[i];
+      b += a;
+    }
+    return static_cast<uint16_t>((a << 8) | b);
+  }
+
+  std::vector<uint8_t> queue_;
+  bool reading_;
+  size_t dstIndex_; //  index of the byte in the candidate
+  size_t srcIndex_; //  index of the next byte in the queue
+  size_t length_;   //  payload length of the candidate
+};
+
+} //  reference_parser
+
+#endif // REFERENCE_PARSER_H_
@@ -0,0 +1,137 @@
+/*
+ * test_allocations.cpp
+ *
+ *  The read path must not allocate: frames are fed through Imu::feed() and
+ *  read from a pseudo terminal with Imu::readInput(), while operator new
+ *  counts the allocations.
+ */
+
+#include "imu_3dm_gx4/imu.hpp"
+#include "imu_3dm_gx4/imu_sink.hpp"
+#include "mip_frames.hpp"
+#include <gtest/gtest.h>
+#include <pty.h>
+#include <termios.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+using namespace imu_3dm_gx4;
+
+static std::atomic<bool> counting(false);
+static std::atomic<long> allocations(0);
+
+void *operator new(size_t size) {
+  if (counting.load(std::memory_order_relaxed)) {
+    allocations++;
+  }
+  void *p = malloc(size ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+#define kFrames    (2000)
+#define kChunkSize (512)
+
+namespace {
+
+struct CountingSink : public ImuSink {
+  long imu, filter;
+  CountingSink() : imu(0), filter(0) {}
+  void onIMUData(const Imu::IMUData &) { imu++; }
+  void onFilterData(const Imu::FilterData &) { filter++; }
+};
+
+//  data packets with some garbage, false headers and bad checksums between
+std::vector<uint8_t> noisyStream(long &imuFrames, long &filterFrames) {
+  std::vector<uint8_t> stream;
+  imuFrames = filterFrames = 0;
+  for (int i = 0; i < kFrames; i++) {
+    const bool filter = (i % 4 == 3);
+    std::vector<uint8_t> frame = filter ? mip_frames::filterFrame(i) :
+                                          mip_frames::imuFrame(i);
+    if (i % 100 == 7) {
+      frame[10] ^= 0xff; //  checksum error
+    } else if (filter) {
+      filterFrames++;
+    } else {
+      imuFrames++;
+    }
+    if (i % 50 == 3) {
+      mip_frames::append(stream, {0x75, 0x11, 0x42});
+    }
+    mip_frames::append(stream, frame);
+  }
+  return stream;
+}
+
+} //  namespace
+
+TEST(Allocations, Feed) {
+  long imuFrames, filterFrames;
+  const std::vector<uint8_t> stream = noisyStream(imuFrames, filterFrames);
+  Imu imu("/dev/null", false);
+  CountingSink sink;
+
+  allocations = 0;
+  counting = true;
+  for (size_t off = 0; off < stream.size(); off += kChunkSize) {
+    imu.feed(&stream[off], std::min<size_t>(kChunkSize, stream.size() - off),
+             sink);
+  }
+  counting = false;
+
+  EXPECT_EQ(0, allocations.load());
+  EXPECT_EQ(imuFrames, sink.imu);
+  EXPECT_EQ(filterFrames, sink.filter);
+  EXPECT_EQ(kFrames / 100u, imu.link().counters().checksumErrors);
+}
+
+TEST(Allocations, ReadInput) {
+  long imuFrames, filterFrames;
+  const std::vector<uint8_t> stream = noisyStream(imuFrames, filterFrames);
+
+  int master, slave;
+  char name[64];
+  ASSERT_EQ(0, openpty(&master, &slave, name, NULL, NULL));
+  struct termios attributes;
+  tcgetattr(slave, &attributes);
+  cfmakeraw(&attributes);
+  tcsetattr(slave, TCSANOW, &attributes);
+
+  Imu imu(name, false);
+  imu.connect();
+  CountingSink sink;
+
+  allocations = 0;
+  counting = true;
+  for (size_t off = 0; off < stream.size(); off += kChunkSize) {
+    const size_t amt = std::min<size_t>(kChunkSize, stream.size() - off);
+    ASSERT_EQ(static_cast<ssize_t>(amt), write(master, &stream[off], amt));
+    usleep(1000);
+    imu.readInput(sink);
+  }
+  for (int i = 0; i < 100 && sink.imu + sink.filter <
+                                 imuFrames + filterFrames; i++) {
+    usleep(1000);
+    imu.readInput(sink);
+  }
+  counting = false;
+
+  EXPECT_EQ(0, allocations.load());
+  EXPECT_EQ(imuFrames, sink.imu);
+  EXPECT_EQ(filterFrames, sink.filter);
+
+  imu.disconnect();
+  close(slave);
+  close(master);
+}
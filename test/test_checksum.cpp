@@ -0,0 +1,66 @@
+/*
+ * test_checksum.cpp
+ *
+ *  The vector Fletcher checksum against the scalar one, and bulk frame
+ *  validation.
+ */
+
+#include "imu_3dm_gx4/checksum.hpp"
+#include "mip_frames.hpp"
+#include <gtest/gtest.h>
+#include <random>
+
+using namespace imu_3dm_gx4;
+
+TEST(Checksum, MatchesScalarForEveryLength) {
+  std::mt19937 random(49);
+  std::vector<uint8_t> data(1024);
+  for (uint8_t &byte : data) {
+    byte = static_cast<uint8_t>(random());
+  }
+  const std::vector<uint8_t> ones(1024, 0xFF); //  largest sums
+  for (size_t length = 0; length <= data.size(); length++) {
+    ASSERT_EQ(fletcher16Scalar(&data[0], length), fletcher16(&data[0], length))
+        << "length " << length;
+    ASSERT_EQ(fletcher16Scalar(&ones[0], length), fletcher16(&ones[0], length))
+        << "length " << length;
+    //  unaligned start
+    if (length > 0) {
+      ASSERT_EQ(fletcher16Scalar(&data[1], length - 1),
+                fletcher16(&data[1], length - 1));
+    }
+  }
+}
+
+TEST(Checksum, MatchesPacketChecksum) {
+  const std::vector<uint8_t> frame = mip_frames::filterFrame(1);
+  const uint16_t received =
+      static_cast<uint16_t>((frame[frame.size() - 2] << 8) | frame.back());
+  EXPECT_EQ(received, fletcher16(&frame[0], frame.size() - 2));
+}
+
+TEST(Checksum, FindFrames) {
+  std::vector<uint8_t> stream = {0x00, 0x75, 0x11};
+  const std::vector<uint8_t> first = mip_frames::imuFrame(1);
+  std::vector<uint8_t> corrupt = mip_frames::filterFrame(2);
+  corrupt[8] ^= 0x01;
+  const std::vector<uint8_t> second = mip_frames::filterFrame(3);
+  mip_frames::append(stream, first);
+  mip_frames::append(stream, corrupt);
+  mip_frames::append(stream, second);
+  const size_t complete = stream.size();
+  const std::vector<uint8_t> partial = mip_frames::imuFrame(4);
+  stream.insert(stream.end(), partial.begin(), partial.begin() + 10);
+
+  MipFrame frames[4];
+  size_t scanned;
+  ASSERT_EQ(2u, findFrames(&stream[0], stream.size(), frames, 4, scanned));
+  EXPECT_EQ(3u, frames[0].offset);
+  EXPECT_EQ(first.size(), frames[0].length);
+  EXPECT_EQ(3 + first.size() + corrupt.size(), frames[1].offset);
+  EXPECT_EQ(second.size(), frames[1].length);
+  EXPECT_EQ(complete, scanned); //  the partial frame is left for later
+
+  ASSERT_EQ(1u, findFrames(&stream[0], stream.size(), frames, 1, scanned));
+  EXPECT_EQ(3 + first.size(), scanned);
+}
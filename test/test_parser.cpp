@@ -0,0 +1,418 @@
+/*
+ * test_parser.cpp
+ *
+ *  Framing and decoding of data packets: the bounds of PacketDecoder, input
+ *  split across reads, the resync after corrupted input, ACK matching, the
+ *  fuzz entry point over the committed corpus and mutations of it, and the
+ *  same input through the byte-wise parser the driver used before.
+ */
+
+#include "imu_3dm_gx4/imu.hpp"
+#include "imu_3dm_gx4/imu_sink.hpp"
+#include "mip_frames.hpp"
+#include "reference_parser.hpp"
+#include <gtest/gtest.h>
+#include <dirent.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+
+using namespace imu_3dm_gx4;
+using mip_frames::Frame;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+namespace {
+
+struct RecordingSink : public ImuSink {
+  std::vector<uint8_t> descriptors;
+  std::vector<std::vector<uint8_t>> frames; //  sync bytes to checksum
+  std::vector<Imu::IMUData> imu;
+  std::vector<Imu::FilterData> filter;
+
+  void onPacket(const Imu::Packet &packet) {
+    descriptors.push_back(packet.descriptor);
+    //  header and payload are contiguous in the packed struct
+    const uint8_t *start = &packet.syncMSB;
+    std::vector<uint8_t> frame(
+        start, start + Imu::Packet::kHeaderLength + packet.length);
+    frame.push_back(packet.checkMSB);
+    frame.push_back(packet.checkLSB);
+    frames.push_back(frame);
+  }
+  void onIMUData(const Imu::IMUData &data) { imu.push_back(data); }
+  void onFilterData(const Imu::FilterData &data) { filter.push_back(data); }
+};
+
+//  feeds one buffer, and returns how many reads threw
+int feed(Imu &imu, const uint8_t *data, size_t size, RecordingSink &sink) {
+  try {
+    imu.feed(data, size, sink);
+  }
+  catch (std::runtime_error &) {
+    return 1;
+  }
+  return 0;
+}
+
+int feed(Imu &imu, const std::vector<uint8_t> &bytes, RecordingSink &sink) {
+  return feed(imu, bytes.data(), bytes.size(), sink);
+}
+
+template <typename T> bool sameBits(const T &a, const T &b) {
+  return memcmp(&a, &b, sizeof(T)) == 0;
+}
+
+bool sameSample(const Imu::IMUData &a, const Imu::IMUData &b) {
+  return a.fields == b.fields && sameBits(a.accel, b.accel) &&
+      sameBits(a.gyro, b.gyro) && sameBits(a.mag, b.mag) &&
+      sameBits(a.pressure, b.pressure);
+}
+
+bool sameSample(const Imu::FilterData &a, const Imu::FilterData &b) {
+  return a.fields == b.fields && sameBits(a.quaternion, b.quaternion) &&
+      a.quaternionStatus == b.quaternionStatus &&
+      sameBits(a.eulerRPY, b.eulerRPY) &&
+      a.eulerRPYStatus == b.eulerRPYStatus &&
+      sameBits(a.headingUpdate, b.headingUpdate) &&
+      sameBits(a.headingUpdateUncertainty, b.headingUpdateUncertainty) &&
+      a.headingUpdateSource == b.headingUpdateSource &&
+      a.headingUpdateFlags == b.headingUpdateFlags &&
+      sameBits(a.acceleration, b.acceleration) &&
+      a.accelerationStatus == b.accelerationStatus &&
+      sameBits(a.angularRate, b.angularRate) &&
+      a.angularRateStatus == b.angularRateStatus &&
+      sameBits(a.eulerAngleUncertainty, b.eulerAngleUncertainty) &&
+      a.eulerAngleUncertaintyStatus == b.eulerAngleUncertaintyStatus &&
+      sameBits(a.gyroBias, b.gyroBias) &&
+      a.gyroBiasStatus == b.gyroBiasStatus &&
+      sameBits(a.gyroBiasUncertainty, b.gyroBiasUncertainty) &&
+      a.gyroBiasUncertaintyStatus == b.gyroBiasUncertaintyStatus;
+}
+
+template <typename T>
+void expectSameSamples(const std::vector<T> &a, const std::vector<T> &b) {
+  ASSERT_EQ(a.size(), b.size());
+  for (size_t i = 0; i < a.size(); i++) {
+    EXPECT_TRUE(sameSample(a[i], b[i])) << "sample " << i;
+  }
+}
+
+// Feed input in chunks to the driver, and to the reference parser whose
+// frames are then decoded one at a time. Frames and samples must agree.
+void expectSameAsReference(const std::vector<uint8_t> &input, size_t chunk) {
+  Imu imu("/dev/null", false);
+  RecordingSink current;
+  reference_parser::Parser parser;
+  std::vector<std::vector<uint8_t>> frames;
+  int threw = 0;
+  auto both = [&](const uint8_t *data, size_t size) {
+    threw = feed(imu, data, size, current);
+    const std::vector<std::vector<uint8_t>> found = parser.feed(data, size);
+    frames.insert(frames.end(), found.begin(), found.end());
+  };
+  for (size_t off = 0; off < input.size(); off += chunk) {
+    both(&input[off], std::min(chunk, input.size() - off));
+  }
+  //  a malformed packet ends feed() with the rest of its input queued,
+  //  zeros are never part of a candidate and let the parser go on
+  const uint8_t zero = 0;
+  for (int i = 0; threw && i < 256; i++) {
+    both(&zero, 1);
+  }
+  ASSERT_FALSE(threw);
+
+  Imu decoder("/dev/null", false);
+  RecordingSink reference;
+  for (const std::vector<uint8_t> &frame : frames) {
+    feed(decoder, frame, reference);
+  }
+  ASSERT_EQ(frames, reference.frames);
+  EXPECT_EQ(frames, current.frames);
+  expectSameSamples(reference.imu, current.imu);
+  expectSameSamples(reference.filter, current.filter);
+}
+
+//  one to four of the edits libFuzzer makes
+void mutate(std::vector<uint8_t> &input, std::mt19937 &random) {
+  const int edits = 1 + random() % 4;
+  for (int i = 0; i < edits && !input.empty(); i++) {
+    const size_t pos = random() % input.size();
+    switch (random() % 4) {
+    case 0:
+      input[pos] ^= static_cast<uint8_t>(1 << (random() % 8));
+      break;
+    case 1:
+      input[pos] = static_cast<uint8_t>(random());
+      break;
+    case 2:
+      input.insert(input.begin() + pos, static_cast<uint8_t>(random()));
+      break;
+    default:
+      input.resize(pos + 1);
+      break;
+    }
+  }
+}
+
+std::vector<uint8_t> readFile(const std::string &path) {
+  std::vector<uint8_t> bytes;
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file) {
+    return bytes;
+  }
+  uint8_t chunk[1024];
+  for (size_t amt; (amt = fread(chunk, 1, sizeof(chunk), file)) > 0;) {
+    bytes.insert(bytes.end(), chunk, chunk + amt);
+  }
+  fclose(file);
+  return bytes;
+}
+
+std::vector<std::string> corpusFiles() {
+  std::vector<std::string> files;
+  DIR *dir = opendir(CORPUS_DIR);
+  if (!dir) {
+    return files;
+  }
+  for (struct dirent *entry; (entry = readdir(dir)) != NULL;) {
+    if (entry->d_name[0] != '.') {
+      files.push_back(std::string(CORPUS_DIR "/") + entry->d_name);
+    }
+  }
+  closedir(dir);
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+} //  namespace
+
+TEST(Parser, DecodesDataPackets) {
+  Imu imu("/dev/null", false);
+  RecordingSink sink;
+  std::vector<uint8_t> stream = mip_frames::imuFrame(3);
+  mip_frames::append(stream, mip_frames::filterFrame(0.5f));
+  EXPECT_EQ(0, feed(imu, stream, sink));
+
+  ASSERT_EQ(1u, sink.imu.size());
+  const Imu::IMUData &data = sink.imu[0];
+  EXPECT_EQ(Imu::IMUData::Accelerometer | Imu::IMUData::Gyroscope,
+            data.fields);
+  EXPECT_EQ(4.0f, data.accel[1]);
+  EXPECT_EQ(-5.0f, data.gyro[2]);
+  EXPECT_EQ(0.0f, data.mag[0]);
+  EXPECT_EQ(0.0f, data.pressure);
+
+  ASSERT_EQ(1u, sink.filter.size());
+  const Imu::FilterData &filter = sink.filter[0];
+  EXPECT_EQ(Imu::FilterData::Quaternion | Imu::FilterData::OrientationEuler |
+                Imu::FilterData::AngularRate,
+            filter.fields);
+  EXPECT_EQ(0.5f, filter.quaternion[1]);
+  EXPECT_EQ(1, filter.quaternionStatus);
+  EXPECT_EQ(1.0f, filter.eulerRPY[2]);
+  EXPECT_EQ(0.0f, filter.gyroBias[0]);
+  EXPECT_EQ(0, filter.gyroBiasStatus);
+}
+
+TEST(Parser, FieldsOfEarlierPacketsDoNotLeak) {
+  Imu imu("/dev/null", false);
+  RecordingSink sink;
+  std::vector<uint8_t> stream =
+      Frame(0x80).field(0x06, {1, 2, 3}).field(0x17, {1000}).finish();
+  mip_frames::append(stream, mip_frames::imuFrame(1));
+  EXPECT_EQ(0, feed(imu, stream, sink));
+  ASSERT_EQ(2u, sink.imu.size());
+  EXPECT_EQ(0.0f, sink.imu[1].mag[0]);
+  EXPECT_EQ(0.0f, sink.imu[1].pressure);
+}
+
+TEST(Parser, SplitAtEveryOffset) {
+  std::vector<uint8_t> stream = mip_frames::imuFrame(1);
+  mip_frames::append(stream, mip_frames::filterFrame(2));
+  mip_frames::append(stream, mip_frames::imuFrame(3));
+
+  for (size_t split = 1; split < stream.size(); split++) {
+    Imu imu("/dev/null", false);
+    RecordingSink sink;
+    feed(imu, std::vector<uint8_t>(stream.begin(), stream.begin() + split),
+         sink);
+    feed(imu, std::vector<uint8_t>(stream.begin() + split, stream.end()),
+         sink);
+    ASSERT_EQ(2u, sink.imu.size()) << "split at " << split;
+    ASSERT_EQ(1u, sink.filter.size()) << "split at " << split;
+    EXPECT_EQ(5.0f, sink.imu[1].accel[2]);
+  }
+}
+
+TEST(Parser, RejectsFieldPastPacketEnd) {
+  Imu imu("/dev/null", false);
+  RecordingSink sink;
+  std::vector<uint8_t> frame = {0x75, 0x65, 0x80, 14, 40, 0x04};
+  frame.resize(4 + 14, 0x40);
+  EXPECT_EQ(1, feed(imu, Frame::checksummed(frame), sink));
+  EXPECT_TRUE(sink.imu.empty());
+  EXPECT_EQ(1u, imu.link().counters().parseErrors);
+}
+
+TEST(Parser, RejectsFieldLengthBelowHeader) {
+  Imu imu("/dev/null", false);
+  RecordingSink sink;
+  std::vector<uint8_t> frame = {0x75, 0x65, 0x80, 14, 1, 0x04};
+  frame.resize(4 + 14, 0x40);
+  EXPECT_EQ(1, feed(imu, Frame::checksummed(frame), sink));
+  EXPECT_TRUE(sink.imu.empty());
+  EXPECT_EQ(1u, imu.link().counters().parseErrors);
+}
+
+TEST(Parser, RejectsShortFields) {
+  Imu imu("/dev/null", false);
+  RecordingSink sink;
+  //  two floats where three are expected, and a status word missing
+  EXPECT_EQ(1, feed(imu, Frame(0x80).field(0x04, {1, 2}).finish(), sink));
+  EXPECT_EQ(1, feed(imu, Frame(0x82).field(0x03, {1, 0, 0, 0}).finish(),
+                    sink));
+  EXPECT_TRUE(sink.imu.empty());
+  EXPECT_TRUE(sink.filter.empty());
+  EXPECT_EQ(2u, imu.link().counters().parseErrors);
+
+  //  reading goes on with the next packet
+  EXPECT_EQ(0, feed(imu, mip_frames::imuFrame(1), sink));
+  EXPECT_EQ(1u, sink.imu.size());
+}
+
+TEST(Parser, RejectsEmptyAndUnknownFields) {
+  Imu imu("/dev/null", false);
+  RecordingSink sink;
+  EXPECT_EQ(1, feed(imu, Frame(0x80).finish(), sink));
+  EXPECT_EQ(1, feed(imu, Frame(0x80).field(0x42, {1}).finish(), sink));
+  EXPECT_EQ(1, feed(imu, Frame(0x82).field(0x42, {1}).finish(), sink));
+  EXPECT_TRUE(sink.imu.empty());
+  EXPECT_TRUE(sink.filter.empty());
+  EXPECT_EQ(3u, imu.link().counters().parseErrors);
+}
+
+TEST(Parser, ResyncsAfterBadChecksum) {
+  Imu imu("/dev/null", false);
+  RecordingSink sink;
+  std::vector<uint8_t> stream = mip_frames::imuFrame(1);
+  stream.back() ^= 1;
+  mip_frames::append(stream, {0x00, 0x75, 0x11});
+  mip_frames::append(stream, mip_frames::imuFrame(2));
+  EXPECT_EQ(0, feed(imu, stream, sink));
+  ASSERT_EQ(1u, sink.imu.size());
+  EXPECT_EQ(2.0f, sink.imu[0].accel[0]);
+  EXPECT_EQ(1u, imu.link().counters().checksumErrors);
+}
+
+//  a packet whose payload holds a valid frame is kept whole, even while only
+//  the part up to the end of that frame has arrived
+TEST(Parser, KeepsPacketWithEmbeddedFrame) {
+  const std::vector<uint8_t> inner = mip_frames::imuFrame(1);
+  const std::vector<uint8_t> outer = Frame(0x0C).raw(0x44, inner).finish();
+
+  Imu imu("/dev/null", false);
+  RecordingSink sink;
+  const size_t split = 6 + inner.size();
+  feed(imu, std::vector<uint8_t>(outer.begin(), outer.begin() + split), sink);
+  EXPECT_TRUE(sink.descriptors.empty());
+  feed(imu, std::vector<uint8_t>(outer.begin() + split, outer.end()), sink);
+  ASSERT_EQ(1u, sink.descriptors.size());
+  EXPECT_EQ(0x0C, sink.descriptors[0]);
+  EXPECT_TRUE(sink.imu.empty());
+  EXPECT_EQ(0u, imu.link().counters().resyncBytes);
+}
+
+//  a false header waits for its declared length, unless the input pauses
+TEST(Parser, DropsIncompleteCandidateAfterPause) {
+  const std::vector<uint8_t> header = {0x75, 0x65, 0x80, 0xFF};
+  const std::vector<uint8_t> frame = mip_frames::imuFrame(1);
+
+  Imu imu("/dev/null", false);
+  RecordingSink sink;
+  feed(imu, header, sink);
+  feed(imu, frame, sink);
+  EXPECT_TRUE(sink.imu.empty());
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  feed(imu, frame, sink);
+  EXPECT_EQ(2u, sink.imu.size());
+}
+
+TEST(Parser, Corpus) {
+  const std::vector<std::string> files = corpusFiles();
+  ASSERT_FALSE(files.empty()) << "no corpus in " CORPUS_DIR;
+  for (const std::string &file : files) {
+    SCOPED_TRACE(file);
+    const std::vector<uint8_t> input = readFile(file);
+    ASSERT_FALSE(input.empty());
+    EXPECT_EQ(0, LLVMFuzzerTestOneInput(input.data(), input.size()));
+  }
+}
+
+//  a few rounds of what the fuzzer does, so any build runs them
+TEST(Parser, CorpusMutations) {
+  std::mt19937 random(48);
+  const std::vector<std::string> files = corpusFiles();
+  ASSERT_FALSE(files.empty());
+  for (int round = 0; round < 5000; round++) {
+    std::vector<uint8_t> input = readFile(files[random() % files.size()]);
+    mutate(input, random);
+    EXPECT_EQ(0, LLVMFuzzerTestOneInput(input.data(), input.size()));
+  }
+}
+
+TEST(Parser, SameAsReferenceOnCorpus) {
+  const std::vector<std::string> files = corpusFiles();
+  ASSERT_FALSE(files.empty());
+  for (const std::string &file : files) {
+    SCOPED_TRACE(file);
+    const std::vector<uint8_t> input = readFile(file);
+    for (size_t chunk : {1, 7, 32, 4096}) {
+      SCOPED_TRACE(chunk);
+      expectSameAsReference(input, chunk);
+    }
+  }
+}
+
+TEST(Parser, SameAsReferenceOnMutations) {
+  std::mt19937 random(51);
+  const std::vector<std::string> files = corpusFiles();
+  ASSERT_FALSE(files.empty());
+  for (int round = 0; round < 5000; round++) {
+    std::vector<uint8_t> input = readFile(files[random() % files.size()]);
+    mutate(input, random);
+    SCOPED_TRACE(round);
+    expectSameAsReference(input, 1 + random() % 32);
+    if (HasFailure()) {
+      break;
+    }
+  }
+}
+
+TEST(Parser, AckErrorCodeFor) {
+  Imu::Packet command(0x0C);
+  command.length = 2;
+  command.payload[0] = 2;
+  command.payload[1] = 0x01;
+
+  //  a field which is not an ACK, then the ACK with its echo and code
+  Imu::Packet reply(0x0C);
+  const uint8_t payload[] = {0x04, 0x80, 0x01, 0x00, 0x04, 0xF1, 0x01, 0x03};
+  memcpy(reply.payload, payload, sizeof(payload));
+  reply.length = sizeof(payload);
+  EXPECT_EQ(3, reply.ackErrorCodeFor(command));
+
+  //  another command, another class, or an ACK field cut short
+  command.payload[1] = 0x02;
+  EXPECT_EQ(-1, reply.ackErrorCodeFor(command));
+  command.payload[1] = 0x01;
+  command.descriptor = 0x0D;
+  EXPECT_EQ(-1, reply.ackErrorCodeFor(command));
+  command.descriptor = 0x0C;
+  reply.payload[4] = 0x03;
+  EXPECT_EQ(-1, reply.ackErrorCodeFor(command));
+}
@@ -0,0 +1,258 @@
+/*
+ * test_post.cpp
+ *
+ *  Stress test of Imu::post() from several threads against the owner, on
+ *  its own and against an emulated device streaming at 1 kHz.
+ */
+
+#include "imu_3dm_gx4/imu.hpp"
+#include "imu_3dm_gx4/imu_sink.hpp"
+#include "device_emulator.hpp"
+#include <gtest/gtest.h>
+#include <poll.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace imu_3dm_gx4;
+
+#define kProducers      (8)
+#define kPostsPerThread (2000)
+#define kWakeupTimeout  (1000) //  [ms], longest wait of the owner
+#define kDeviceCommands (60)   //  commands per producer against the device
+
+namespace {
+
+//  sleeps on submitFd() and runs the posted calls until told to stop, like
+//  the node's event loop does
+void runOwner(Imu &imu, const std::atomic<bool> &stop,
+              std::atomic<bool> &lostWakeup) {
+  while (!stop.load() || imu.pendingPosts() > 0) {
+    struct pollfd p;
+    p.fd = imu.submitFd();
+    p.events = POLLIN;
+    p.revents = 0;
+    const int ready = poll(&p, 1, kWakeupTimeout);
+    if (ready == 0 && imu.pendingPosts() > 0) {
+      lostWakeup = true;
+    }
+    imu.runPosted();
+  }
+}
+
+//  samples must arrive numbered 0, 1, 2... through the sink and the callbacks
+//  and are counted on the owner thread, read by the test when it is done
+struct ContinuitySink : public ImuSink {
+  std::atomic<int> imu, filter, gaps;
+  ContinuitySink() : imu(0), filter(0), gaps(0) {}
+  void onIMUData(const Imu::IMUData &data) {
+    gaps += (data.accel[0] != imu);
+    imu = static_cast<int>(data.accel[0]) + 1;
+  }
+  void onFilterData(const Imu::FilterData &data) {
+    gaps += (data.quaternion[1] != filter);
+    filter = static_cast<int>(data.quaternion[1]) + 1;
+  }
+};
+
+//  reads the device and runs the posted calls, like the node's event loop
+void runDeviceOwner(Imu &imu, ContinuitySink &sink,
+                    const std::atomic<bool> &stop) {
+  while (!stop.load()) {
+    struct pollfd p[2];
+    p[0].fd = imu.fileDescriptor();
+    p[1].fd = imu.submitFd();
+    for (struct pollfd &fd : p) {
+      fd.events = POLLIN;
+      fd.revents = 0;
+    }
+    poll(p, 2, 5);
+    imu.readInput(sink);
+  }
+}
+
+} //  namespace
+
+TEST(Post, ProducersAgainstOwner) {
+  Imu imu("/dev/null", false);
+  std::atomic<bool> stop(false), lostWakeup(false);
+  std::atomic<bool> started(false);
+  std::thread::id owner;
+  std::atomic<int> wrongThread(0), outOfOrder(0);
+
+  //  the last call run of each producer, only touched by the owner
+  std::vector<int> last(kProducers, -1);
+  std::vector<std::vector<std::future<void> > > futures(kProducers);
+
+  std::thread ownerThread([&] {
+    owner = std::this_thread::get_id();
+    started = true;
+    runOwner(imu, stop, lostWakeup);
+  });
+  while (!started.load()) {
+    std::this_thread::yield();
+  }
+
+  std::vector<std::thread> producers;
+  for (int t = 0; t < kProducers; t++) {
+    producers.push_back(std::thread([&, t] {
+      futures[t].reserve(kPostsPerThread);
+      for (int i = 0; i < kPostsPerThread; i++) {
+        futures[t].push_back(imu.post([&, t, i](Imu &) {
+          if (std::this_thread::get_id() != owner) {
+            wrongThread++;
+          }
+          //  calls of one priority run in submission order
+          if (last[t] != i - 1) {
+            outOfOrder++;
+          }
+          last[t] = i;
+        }));
+      }
+    }));
+  }
+  for (std::thread &producer : producers) {
+    producer.join();
+  }
+  for (std::vector<std::future<void> > &list : futures) {
+    for (std::future<void> &future : list) {
+      ASSERT_EQ(std::future_status::ready,
+                future.wait_for(std::chrono::seconds(10)));
+      future.get();
+    }
+  }
+  //  stopping from a posted call also wakes the owner up
+  imu.post([&](Imu &) { stop = true; });
+  ownerThread.join();
+
+  EXPECT_EQ(0, wrongThread.load());
+  EXPECT_EQ(0, outOfOrder.load());
+  EXPECT_FALSE(lostWakeup.load());
+  for (int t = 0; t < kProducers; t++) {
+    EXPECT_EQ(kPostsPerThread - 1, last[t]);
+  }
+  EXPECT_EQ(0u, imu.pendingPosts());
+  EXPECT_EQ(static_cast<uint64_t>(kProducers * kPostsPerThread + 1),
+            imu.txStats(TxScheduler::Control).sent);
+}
+
+TEST(Post, CoalescedCallsCompleteAllFutures) {
+  Imu imu("/dev/null", false);
+  std::atomic<bool> stop(false), lostWakeup(false);
+  std::atomic<int> runs(0);
+  std::thread ownerThread([&] { runOwner(imu, stop, lostWakeup); });
+
+  std::vector<std::thread> producers;
+  std::vector<std::vector<std::future<void> > > futures(kProducers);
+  for (int t = 0; t < kProducers; t++) {
+    producers.push_back(std::thread([&, t] {
+      for (int i = 0; i < kPostsPerThread; i++) {
+        //  one key shared by all producers, so waiting calls are replaced
+        futures[t].push_back(imu.post([&](Imu &) { runs++; },
+                                      TxScheduler::Background, 1));
+      }
+    }));
+  }
+  for (std::thread &producer : producers) {
+    producer.join();
+  }
+  for (std::vector<std::future<void> > &list : futures) {
+    for (std::future<void> &future : list) {
+      ASSERT_EQ(std::future_status::ready,
+                future.wait_for(std::chrono::seconds(10)));
+      future.get();
+    }
+  }
+  imu.post([&](Imu &) { stop = true; });
+  ownerThread.join();
+
+  const TxScheduler::Stats stats = imu.txStats(TxScheduler::Background);
+  EXPECT_FALSE(lostWakeup.load());
+  EXPECT_LE(runs.load(), kProducers * kPostsPerThread);
+  EXPECT_EQ(static_cast<uint64_t>(runs.load()), stats.sent);
+  EXPECT_EQ(static_cast<uint64_t>(kProducers * kPostsPerThread),
+            stats.sent + stats.coalesced);
+}
+
+// Commands posted from several threads while the device streams: every call
+// gets its reply, and no sample is lost or reordered, whether it is read by
+// the owner or while a command waits for its ACK.
+TEST(Post, CommandsWhileStreaming) {
+  device_emulator::Emulator device;
+  Imu imu(device.name(), false);
+  imu.connect();
+  ContinuitySink sink;
+  imu.setIMUDataCallback([&](const Imu::IMUData &data) {
+    sink.onIMUData(data);
+  });
+  imu.setFilterDataCallback([&](const Imu::FilterData &data) {
+    sink.onFilterData(data);
+  });
+  device.start();
+
+  std::atomic<bool> stop(false);
+  std::atomic<int> badReports(0);
+  std::thread ownerThread([&] { runDeviceOwner(imu, sink, stop); });
+
+  std::vector<std::thread> producers;
+  std::vector<std::vector<std::future<void> > > futures(kProducers);
+  for (int t = 0; t < kProducers; t++) {
+    producers.push_back(std::thread([&, t] {
+      for (int i = 0; i < kDeviceCommands; i++) {
+        switch ((t + i) % 3) {
+        case 0:
+          futures[t].push_back(imu.post([](Imu &imu) { imu.ping(); }));
+          break;
+        case 1:
+          futures[t].push_back(imu.post([&](Imu &imu) {
+            Imu::DiagnosticFields fields;
+            imu.getDiagnosticInfo(fields);
+            if (fields.modelNumber != 6234 || fields.totalIMUMessages == 0) {
+              badReports++;
+            }
+          }));
+          break;
+        default:
+          //  not awaited, sent by the owner ahead of the other commands
+          imu.setExternalHeading(0.1f * i, 0.01f, false);
+          break;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+      }
+    }));
+  }
+  for (std::thread &producer : producers) {
+    producer.join();
+  }
+  for (std::vector<std::future<void> > &list : futures) {
+    for (std::future<void> &future : list) {
+      ASSERT_EQ(std::future_status::ready,
+                future.wait_for(std::chrono::seconds(10)));
+      future.get(); //  rethrows a timeout or NACK
+    }
+  }
+  //  let the last heading updates and samples through
+  while (imu.pendingPosts() > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  device.stop();
+  const int written = device.samples();
+  for (int i = 0; i < 1000 && sink.imu < written; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  stop = true;
+  ownerThread.join();
+
+  const Imu::HeadingStats headings = imu.externalHeadingStats();
+  EXPECT_EQ(0, badReports.load());
+  EXPECT_EQ(written, sink.imu);
+  EXPECT_EQ(written, sink.filter);
+  EXPECT_EQ(0, sink.gaps);
+  EXPECT_EQ(0u, imu.link().counters().checksumErrors);
+  EXPECT_EQ(0u, imu.link().counters().resyncBytes);
+  EXPECT_EQ(headings.queued, headings.sent + headings.coalesced);
+  EXPECT_EQ(0u, headings.rejected);
+  EXPECT_EQ(static_cast<uint64_t>(device.headings()), headings.sent);
+  imu.disconnect();
+}
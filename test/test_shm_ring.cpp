@@ -0,0 +1,101 @@
+/*
+ * test_shm_ring.cpp
+ *
+ *  Records written into the shared-memory ring and read back, readers which
+ *  fall behind, and waking a sleeping reader.
+ */
+
+#include "imu_3dm_gx4/shm_ring.hpp"
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+
+using namespace imu_3dm_gx4;
+
+namespace {
+
+//  one name per test process, so parallel runs do not share a ring
+std::string ringName() {
+  return "/imu_3dm_gx4_test_" + std::to_string(getpid());
+}
+
+Imu::IMUData imuSample(float v) {
+  Imu::IMUData data;
+  data.fields = Imu::IMUData::Accelerometer | Imu::IMUData::Gyroscope;
+  data.accel[0] = v;
+  data.gyro[2] = -v;
+  return data;
+}
+
+Imu::FilterData filterSample(float v) {
+  Imu::FilterData data;
+  data.fields = Imu::FilterData::Quaternion;
+  data.quaternion[0] = v;
+  data.quaternionStatus = 1;
+  return data;
+}
+
+} //  namespace
+
+TEST(ShmRing, RoundTrip) {
+  ShmRingWriter writer(ringName(), 64);
+  ShmRingReader reader(ringName());
+  ShmRing::Record record;
+  EXPECT_FALSE(reader.poll(record));
+
+  for (int i = 0; i < 40; i++) {
+    if (i % 4 == 3) {
+      writer.write(filterSample(i), 1000 + i);
+    } else {
+      writer.write(imuSample(i), 1000 + i);
+    }
+  }
+  for (int i = 0; i < 40; i++) {
+    ASSERT_TRUE(reader.poll(record));
+    EXPECT_EQ(static_cast<uint64_t>(i), record.index);
+    EXPECT_EQ(1000 + i, record.stamp);
+    if (i % 4 == 3) {
+      ASSERT_EQ(static_cast<uint32_t>(ShmRing::FilterData), record.type);
+      EXPECT_EQ(static_cast<float>(i), record.filter.quaternion[0]);
+      EXPECT_EQ(1, record.filter.quaternionStatus);
+    } else {
+      ASSERT_EQ(static_cast<uint32_t>(ShmRing::IMUData), record.type);
+      EXPECT_EQ(static_cast<float>(i), record.imu.accel[0]);
+      EXPECT_EQ(static_cast<float>(-i), record.imu.gyro[2]);
+    }
+  }
+  EXPECT_FALSE(reader.poll(record));
+  EXPECT_EQ(0u, reader.dropped());
+}
+
+TEST(ShmRing, ReaderFallsBehind) {
+  ShmRingWriter writer(ringName(), 16);
+  ShmRingReader reader(ringName());
+  for (int i = 0; i < 100; i++) {
+    writer.write(imuSample(i), i);
+  }
+  ShmRing::Record record;
+  for (int i = 84; i < 100; i++) {
+    ASSERT_TRUE(reader.poll(record));
+    EXPECT_EQ(static_cast<uint64_t>(i), record.index);
+    EXPECT_EQ(static_cast<float>(i), record.imu.accel[0]);
+  }
+  EXPECT_FALSE(reader.poll(record));
+  EXPECT_EQ(84u, reader.dropped());
+}
+
+TEST(ShmRing, WaitWakesReader) {
+  ShmRingWriter writer(ringName(), 16);
+  ShmRingReader reader(ringName());
+  std::thread producer([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    writer.write(imuSample(7), 7);
+  });
+  ShmRing::Record record;
+  const bool woken = reader.wait(record, 2000);
+  producer.join();
+  ASSERT_TRUE(woken);
+  EXPECT_EQ(7.0f, record.imu.accel[0]);
+  EXPECT_FALSE(reader.wait(record, 10));
+}
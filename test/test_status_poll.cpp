@@ -0,0 +1,114 @@
+/*
+ * test_status_poll.cpp
+ *
+ *  The background status requests must not disturb the stream: the gaps
+ *  between samples read from an emulated device are compared with and
+ *  without requestDiagnosticInfo() polling.
+ */
+
+#include "imu_3dm_gx4/imu.hpp"
+#include "imu_3dm_gx4/imu_sink.hpp"
+#include "device_emulator.hpp"
+#include <gtest/gtest.h>
+#include <poll.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+using namespace imu_3dm_gx4;
+
+#define kStreamTime    (1000) //  [ms] of streaming per run
+#define kPollPeriod    (10)   //  [ms], much faster than the node's default
+#define kGapSlack      (1.0)  //  [ms] allowed increase of the p99 gap
+
+namespace {
+
+//  arrival time of every IMU sample on the owner thread
+struct GapSink : public ImuSink {
+  std::vector<std::chrono::steady_clock::time_point> arrivals;
+  int gaps;
+  GapSink() : gaps(0) { arrivals.reserve(2 * kStreamTime); }
+  void onIMUData(const Imu::IMUData &data) {
+    gaps += (data.accel[0] != arrivals.size());
+    arrivals.push_back(std::chrono::steady_clock::now());
+  }
+};
+
+struct GapStats {
+  double median, p99, max; //  [ms]
+  size_t samples;
+  int gaps;
+};
+
+//  streams for kStreamTime, requesting the status every pollPeriod [ms] from
+//  the owner thread as serviceDevice() does, 0 to not request it
+GapStats streamGaps(int pollPeriod, Imu::DiagnosticSnapshot &snapshot) {
+  device_emulator::Emulator device;
+  Imu imu(device.name(), false);
+  imu.connect();
+  GapSink sink;
+  device.start();
+
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  const std::chrono::steady_clock::time_point end =
+      start + std::chrono::milliseconds(kStreamTime);
+  std::chrono::steady_clock::time_point nextRequest = start;
+  for (std::chrono::steady_clock::time_point now = start; now < end;
+       now = std::chrono::steady_clock::now()) {
+    if (pollPeriod > 0 && now >= nextRequest) {
+      imu.requestDiagnosticInfo();
+      nextRequest = now + std::chrono::milliseconds(pollPeriod);
+    }
+    struct pollfd p[2];
+    p[0].fd = imu.fileDescriptor();
+    p[1].fd = imu.submitFd();
+    for (struct pollfd &fd : p) {
+      fd.events = POLLIN;
+      fd.revents = 0;
+    }
+    poll(p, 2, 5);
+    imu.readInput(sink);
+  }
+  device.stop();
+  snapshot = imu.diagnosticSnapshot();
+  imu.disconnect();
+
+  std::vector<double> gaps;
+  for (size_t i = 1; i < sink.arrivals.size(); i++) {
+    gaps.push_back(std::chrono::duration<double, std::milli>(
+        sink.arrivals[i] - sink.arrivals[i - 1]).count());
+  }
+  std::sort(gaps.begin(), gaps.end());
+  GapStats stats;
+  stats.samples = sink.arrivals.size();
+  stats.gaps = sink.gaps;
+  stats.median = gaps.empty() ? 0 : gaps[gaps.size() / 2];
+  stats.p99 = gaps.empty() ? 0 : gaps[gaps.size() * 99 / 100];
+  stats.max = gaps.empty() ? 0 : gaps.back();
+  return stats;
+}
+
+} //  namespace
+
+TEST(StatusPoll, DoesNotAddJitter) {
+  Imu::DiagnosticSnapshot quiet, polled;
+  const GapStats without = streamGaps(0, quiet);
+  const GapStats with = streamGaps(kPollPeriod, polled);
+  printf("gap between samples without polling: %.2f ms median, %.2f ms p99, "
+         "%.2f ms max\n", without.median, without.p99, without.max);
+  printf("gap between samples with polling:    %.2f ms median, %.2f ms p99, "
+         "%.2f ms max\n", with.median, with.p99, with.max);
+
+  //  every sample arrives, and the replies are decoded on the way
+  EXPECT_EQ(0, without.gaps);
+  EXPECT_EQ(0, with.gaps);
+  EXPECT_GT(with.samples, kStreamTime / 2u);
+  EXPECT_EQ(0u, quiet.reports);
+  EXPECT_GE(polled.reports, kStreamTime / kPollPeriod / 2u);
+  EXPECT_EQ(6234, polled.fields.modelNumber);
+  EXPECT_GT(polled.fields.totalIMUMessages, 0u);
+
+  EXPECT_LT(with.p99, without.p99 + kGapSlack);
+}
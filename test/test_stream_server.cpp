@@ -0,0 +1,237 @@
+/*
+ * test_stream_server.cpp
+ *
+ *  Subscriptions and framing of the socket server, and dropping the oldest
+ *  messages of a client which does not read.
+ */
+
+#include "imu_3dm_gx4/stream_server.hpp"
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string.h>
+}
+
+using namespace imu_3dm_gx4;
+
+namespace {
+
+//  one socket per test process, so parallel runs do not collide
+std::string socketPath() {
+  return "/tmp/imu_3dm_gx4_test_" + std::to_string(getpid()) + ".sock";
+}
+
+struct Message {
+  StreamServer::MessageHeader header;
+  std::vector<uint8_t> payload;
+};
+
+//  client end of the socket, reading without blocking
+class Client {
+public:
+  Client(const std::string &path, uint8_t subscription) : offset_(0) {
+    fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    connected_ = fd_ >= 0 &&
+        connect(fd_, reinterpret_cast<struct sockaddr *>(&addr),
+                sizeof(addr)) == 0;
+    subscribe(subscription);
+  }
+
+  ~Client() { close(fd_); }
+
+  bool connected() const { return connected_; }
+
+  void subscribe(uint8_t subscription) {
+    EXPECT_EQ(1, write(fd_, &subscription, 1));
+  }
+
+  //  read everything the server has queued for this client
+  void drain(StreamServer &server) {
+    uint8_t buffer[4096];
+    for (int idle = 0; idle < 3;) {
+      server.service();
+      const ssize_t amt = recv(fd_, buffer, sizeof(buffer), MSG_DONTWAIT);
+      if (amt > 0) {
+        bytes_.insert(bytes_.end(), buffer, buffer + amt);
+        idle = 0;
+      } else {
+        idle++;
+      }
+    }
+  }
+
+  //  next complete message received, false at the end of the bytes read
+  bool next(Message &msg) {
+    if (bytes_.size() - offset_ < sizeof(msg.header)) {
+      return false;
+    }
+    memcpy(&msg.header, &bytes_[offset_], sizeof(msg.header));
+    if (bytes_.size() - offset_ - sizeof(msg.header) < msg.header.length) {
+      return false;
+    }
+    const uint8_t *payload = &bytes_[offset_ + sizeof(msg.header)];
+    msg.payload.assign(payload, payload + msg.header.length);
+    offset_ += sizeof(msg.header) + msg.header.length;
+    return true;
+  }
+
+  //  bytes left over after the last complete message
+  size_t remaining() const { return bytes_.size() - offset_; }
+
+private:
+  int fd_;
+  bool connected_;
+  std::vector<uint8_t> bytes_;
+  size_t offset_;
+};
+
+Imu::IMUData imuSample(float v) {
+  Imu::IMUData data;
+  data.fields = Imu::IMUData::Accelerometer | Imu::IMUData::Gyroscope;
+  data.accel[0] = v;
+  data.gyro[2] = -v;
+  return data;
+}
+
+Imu::FilterData filterSample(float v) {
+  Imu::FilterData data;
+  data.fields = Imu::FilterData::Quaternion;
+  data.quaternion[0] = v;
+  data.quaternionStatus = 1;
+  return data;
+}
+
+Imu::Packet rawPacket(uint8_t length) {
+  Imu::Packet packet(0x80);
+  packet.length = length;
+  for (int i = 0; i < length; i++) {
+    packet.payload[i] = static_cast<uint8_t>(i);
+  }
+  packet.calcChecksum();
+  return packet;
+}
+
+} //  namespace
+
+TEST(StreamServer, Subscriptions) {
+  StreamServer server(socketPath(), 16);
+  Client decoded(socketPath(), StreamServer::Decoded);
+  Client raw(socketPath(), StreamServer::Raw);
+  ASSERT_TRUE(decoded.connected());
+  ASSERT_TRUE(raw.connected());
+  server.service();
+  EXPECT_EQ(2u, server.numClients());
+
+  server.publish(imuSample(3), 100);
+  server.publish(filterSample(4), 101);
+  const Imu::Packet packet = rawPacket(20);
+  server.publish(packet, 102);
+
+  Message msg;
+  decoded.drain(server);
+  ASSERT_TRUE(decoded.next(msg));
+  EXPECT_EQ(StreamServer::IMUSample, msg.header.type);
+  EXPECT_EQ(100, msg.header.stamp);
+  EXPECT_EQ(0u, msg.header.dropped);
+  ASSERT_EQ(sizeof(StreamServer::IMURecord), msg.payload.size());
+  StreamServer::IMURecord imu;
+  memcpy(&imu, msg.payload.data(), sizeof(imu));
+  EXPECT_EQ(static_cast<uint32_t>(Imu::IMUData::Accelerometer |
+                                  Imu::IMUData::Gyroscope), imu.fields);
+  EXPECT_EQ(3.0f, imu.accel[0]);
+  EXPECT_EQ(-3.0f, imu.gyro[2]);
+
+  ASSERT_TRUE(decoded.next(msg));
+  EXPECT_EQ(StreamServer::FilterSample, msg.header.type);
+  EXPECT_EQ(101, msg.header.stamp);
+  ASSERT_EQ(sizeof(StreamServer::FilterRecord), msg.payload.size());
+  StreamServer::FilterRecord filter;
+  memcpy(&filter, msg.payload.data(), sizeof(filter));
+  EXPECT_EQ(4.0f, filter.quaternion[0]);
+  EXPECT_EQ(1, filter.quaternionStatus);
+  EXPECT_FALSE(decoded.next(msg));
+
+  //  the frame as on the wire, sync bytes to checksum
+  raw.drain(server);
+  ASSERT_TRUE(raw.next(msg));
+  EXPECT_EQ(StreamServer::RawFrame, msg.header.type);
+  EXPECT_EQ(102, msg.header.stamp);
+  ASSERT_EQ(Imu::Packet::kHeaderLength + 20u + 2u, msg.payload.size());
+  EXPECT_EQ(0x75, msg.payload[0]);
+  EXPECT_EQ(0x65, msg.payload[1]);
+  EXPECT_EQ(0x80, msg.payload[2]);
+  EXPECT_EQ(20, msg.payload[3]);
+  EXPECT_EQ(0, memcmp(packet.payload, &msg.payload[4], 20));
+  EXPECT_EQ(packet.checkMSB, msg.payload[24]);
+  EXPECT_EQ(packet.checkLSB, msg.payload[25]);
+  EXPECT_FALSE(raw.next(msg));
+
+  //  a later byte replaces the subscription
+  raw.subscribe(StreamServer::Raw | StreamServer::Decoded);
+  server.service();
+  server.publish(imuSample(5), 103);
+  raw.drain(server);
+  ASSERT_TRUE(raw.next(msg));
+  EXPECT_EQ(StreamServer::IMUSample, msg.header.type);
+  EXPECT_EQ(103, msg.header.stamp);
+  EXPECT_FALSE(raw.next(msg));
+}
+
+TEST(StreamServer, ClientDisconnects) {
+  StreamServer server(socketPath(), 16);
+  {
+    Client client(socketPath(), StreamServer::Decoded);
+    server.service();
+    EXPECT_EQ(1u, server.numClients());
+  }
+  server.service();
+  EXPECT_EQ(0u, server.numClients());
+}
+
+// A client which does not read fills its socket, then its queue. The oldest
+// messages are dropped, the newest arrive, and the stream stays framed. A
+// queue length of 1 is raised to 2, see StreamServer::enqueue().
+TEST(StreamServer, DropsOldest) {
+  for (size_t queueLength : {1, 2, 64}) {
+    StreamServer server(socketPath(), queueLength);
+    Client client(socketPath(), StreamServer::Decoded);
+    server.service();
+
+    const int count = 20000;
+    for (int i = 0; i < count; i++) {
+      server.publish(imuSample(i), i);
+    }
+    EXPECT_GT(server.dropped(), 0u);
+    client.drain(server);
+
+    Message msg;
+    int64_t last = -1;
+    uint32_t dropped = 0;
+    int received = 0;
+    while (client.next(msg)) {
+      ASSERT_EQ(StreamServer::IMUSample, msg.header.type);
+      ASSERT_EQ(sizeof(StreamServer::IMURecord), msg.payload.size());
+      StreamServer::IMURecord imu;
+      memcpy(&imu, msg.payload.data(), sizeof(imu));
+      ASSERT_EQ(static_cast<float>(msg.header.stamp), imu.accel[0]);
+      ASSERT_GT(msg.header.stamp, last);
+      ASSERT_GE(msg.header.dropped, dropped);
+      last = msg.header.stamp;
+      dropped = msg.header.dropped;
+      received++;
+    }
+    EXPECT_EQ(0u, client.remaining());
+    EXPECT_EQ(count - 1, last);
+    //  every message is either received or counted as dropped
+    EXPECT_EQ(static_cast<uint64_t>(count), received + server.dropped());
+  }
+}